@@ -48,11 +48,70 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdarg.h>
+#include <stddef.h>
 #include <string.h>
 #include <math.h>
+#include <limits.h>	// LLONG_MIN, LLONG_MAX
+
+#ifndef _MSC_VER	// equivalents of Microsoft "safe" functions for gcc and clang
+#include <strings.h>
+#define strncpy_s(dst, dstlen, src, nlen) (memcpy(dst, src, strnlen(src, nlen)), (dst)[strnlen(src, nlen)] = '\0', 0)
+#define sscanf_s sscanf
+#define _strnicmp strncasecmp
+#define fopen_s(pfp, filename, mode) ((*(pfp) = fopen(filename, mode)) == NULL ? -1 : 0)
+#define strndup lci_strndup		// (not the POSIX one)
+#endif
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>	// CreateFileMapping, MapViewOfFile
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>	// mmap
+#include <sys/stat.h>
+#include <sys/resource.h>	// getrusage (peak RSS)
+#include <sys/file.h>	// flock (decode cache file)
+#include <errno.h>
+#endif
+
+#include <algorithm>	// std::nth_element (spatial index)
+#include <thread>		// std::thread (parallel fleet processing)
+#include <atomic>		// std::atomic (lock-free cache reads)
+#include <mutex>		// std::mutex (cache writers)
+#include <condition_variable>	// (server job queue)
+#include <chrono>
+
+#ifdef __linux__
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#if __cpp_impl_coroutine
+#include <coroutine>	// (server reads each connection in a coroutine, when compiled as C++20)
+#endif
+#endif
 
 #define INLINE __inline
 
+#ifdef _MSC_VER
+#include <intrin.h>		// _BitScanReverse64, __rdtsc
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>	// __rdtsc, _pdep_u64
+#include <cpuid.h>		// __get_cpuid (is pdep fast ?)
+#endif
+
 //////////////////////////////////////////////////////////////////////////////////////////////
 
 // The only valid version number for the LCI field (currently):
@@ -119,68 +178,339 @@ int checkflag = 0;		// -c (check result after encoding or decoding)
 //	Note: in the specification 0 uncertainty means uncertainty is *unknown*
 //  Can treat 0 on command line instead as *smallest representable uncertainty*:
 
-int	smallestflag = 0;	//  0 => zero uncertainty means *unknown* uncertainty code (default)
+//	NOTE: these and androidpolicy are per thread, so server threads can follow a profile
+
+thread_local int	smallestflag = 0;	//  0 => zero uncertainty means *unknown* uncertainty code (default)
 //	int	smallestflag = 1;	// 1 => zero uncertainty means *smallest* possible uncertainty code
 
-int wantLCIflag = 1;		// encode LCI subelement 
-int wantZflag = 1;			// encode Z subelement 
-int wantUsageflag = 1;		// encode Usage Rules/Policy subelement 
-int wantColocatedflag = 1;	// encode colocated BSSIDs (in LCI measurement element)
+thread_local int wantLCIflag = 1;		// encode LCI subelement 
+thread_local int wantZflag = 1;			// encode Z subelement 
+thread_local int wantUsageflag = 1;		// encode Usage Rules/Policy subelement 
+thread_local int wantColocatedflag = 1;	// encode colocated BSSIDs (in LCI measurement element)
+
+// What to do about settings with which Android will not provide location information
+
+enum android_policy { ANDROID_OFF, ANDROID_WARN, ANDROID_REJECT, NUM_ANDROID_POLICIES };
+
+const char *android_policy_names[NUM_ANDROID_POLICIES] = { "off", "warn", "reject" };
+
+thread_local int androidpolicy = ANDROID_WARN;	// -android=... (reject: refuse to encode)
+
+thread_local unsigned int codecprofilekey = 0;	// fingerprint of settings (part of cache keys)
 
 int sampleflag = 0;			// run an example of decoding and encoding an LCI string
 
+const char *neighborfile = NULL;	// -neighbors=... fleet file for neighbor report generation
+int statsflag = 0;			// -stats report time per stage, allocations, diagnostics at end of run
+int nearestk = 4;			// -nearest=... number of neighbors reported for each AP
+int nthreads = 0;			// -threads=... number of worker threads (0 => one per hardware thread)
+double floorheight = 4.0;	// -floorheight=... (m) used to place floors in space
+
+const char *decodefile = NULL;	// -decode=... file of LCI strings to decode (one per line)
+const char *encodefile = NULL;	// -encode=... file of records to encode (one per line)
+int cachemb = 64;			// -cache=... memory cap (MB) of encode/decode cache (0 => no cache)
+const char *persistfile = NULL;	// -persist=... file holding persistent decode cache
+int persistmb = 256;		// -persistmb=... size (MB) of persistent decode cache file when created
+const char *servepath = NULL;	// -serve=... Unix domain socket to serve requests on
+int httpport = 0;			// -http=... localhost TCP port to serve HTTP/JSON requests on
+int nreactors = 1;			// -reactors=... server threads watching connections (epoll)
+const char *connectpath = NULL;	// -connect=... server to do -decode/-encode work (shared memory)
+int benchflag = 0;			// -bench run microbenchmarks of codec kernels
+const char *benchfilter = NULL;	// -bench=... only those whose names contain this
+int benchreps = 21;			// -benchreps=... timed repetitions of each benchmark
+const char *benchjson = NULL;	// -benchjson=... file to write benchmark results to (JSON)
+const char *benchbaseline = NULL;	// -benchbaseline=... results (JSON) to compare against
+double benchthreshold = 5.0;	// -benchthreshold=... (%) slowdown that counts as regression
+int benchcountersflag = 0;	// -benchcounters add hardware performance counts (Linux)
+const char *tracefile = NULL;	// -trace-out=... file to write spans of batch and server stages to (JSON)
+int roundtripflag = 0;		// -roundtrip check encode -> decode -> encode over the value space
+long long roundtripcount = 100000;	// -roundtrip=... random cases per sampled sweep
+int goldenflag = 0;			// -golden check codec against golden corpus, then benchmark it
+int allocflag = 0;			// -alloccheck check decoding and encoding records does not allocate
+long long alloccount = 100000;	// -alloccheck=... records decoded (and encoded) while counting
+int scalingflag = 0;		// -scaling run thread scaling benchmark of batch modes
+long long scalingrecords = 100000;	// -scaling=... records in its corpus
+const char *loadtarget = NULL;	// -load=... server to drive with requests (socket:path, shm:path, http:port)
+const char *loadmix = NULL;	// -loadmix=... requests to send, by weight (decode:4,encode:1 ...)
+double loadrate = 0;		// -loadrate=... requests/s (open loop), 0 => as fast as answered (closed loop)
+double loadtime = 10;		// -loadtime=... seconds to run load for
+const char *quantfile = NULL;	// -quantization=... file of LCI strings or records to report quantization error of
+const char *spatialfile = NULL;	// -spatialindex=... spatial index file to build (from -fleet=...) or query
+const char *radiusquery = NULL;	// -radius=... lat,lon,meters[,floor1,floor2] of APs to find in spatial index
+const char *bboxquery = NULL;	// -bbox=... lat1,lon1,lat2,lon2[,floor1,floor2] of APs to find in spatial index
+const char *mortonfile = NULL;	// -mortonsort=... file of LCI strings or records to sort by location (Morton key)
+const char *bssidfile = NULL;	// -bssidindex=... BSSID index file to build (from -fleet=...) or query
+const char *lookupquery = NULL;	// -lookup=... BSSIDs (comma separated) to find in BSSID index
+
+///////////////////////////////////////////////////////////////////////////////
+
+// Diagnostics: problems found while decoding or encoding are remembered (as bits in
+// diagnostics) so batch modes can report them per record --- and printed unless quiet.
+
+enum diagnostic_code {
+	DIAG_HEX_DIGIT,				// invalid hexadecimal character (or value)
+	DIAG_HEADER,				// bad Measurement Report header
+	DIAG_LENGTH,				// subelement length runs past end of string
+	DIAG_SUBELEMENT,			// unrecognized subelement
+	DIAG_LCI_LENGTH,			// LCI subelement length not 16
+	DIAG_UNCERTAINTY,			// uncertainty code out of range (decoding)
+	DIAG_UNCERTAINTY_VALUE,		// uncertainty not representable (encoding)
+	DIAG_LCI_VERSION,			// LCI Version not 1
+	DIAG_Z_LENGTH,				// Z subelement length not 6
+	DIAG_Z_UNCERTAINTY,			// STA height above floor uncertainty code out of range
+	DIAG_USAGE_LENGTH,			// Usage Rules/Policy subelement length not 1 or 3
+	DIAG_USAGE_INCONSISTENT,	// retention expires flag inconsistent with expiration or length
+	DIAG_COLOCATED_LENGTH,		// Colocated BSSID subelement length not 1 + 6 n
+	DIAG_MAXBSSID_INDICATOR,	// MaxBSSID Indicator not 0
+	DIAG_BSSID,					// invalid BSSID
+	DIAG_ANDROID,				// Android will not provide location information
+	NUM_DIAGNOSTICS
+};
+
+const char *diagnostic_names[NUM_DIAGNOSTICS] = {
+	"hex_digit", "header", "length", "subelement", "lci_length", "uncertainty", "uncertainty_value",
+	"lci_version", "z_length", "z_uncertainty", "usage_length", "usage_inconsistent",
+	"colocated_length", "maxbssid_indicator", "bssid", "android",
+};
+
+thread_local int diagnostics = 0;	// bit mask of diagnostic codes seen (reset by caller)
+int quietflag = 0;		// don't print ERROR and WARNING messages from decoder and encoder
+
+void diagnose (int code, const char *format, ...) {
+	diagnostics |= (1 << code);
+	if (quietflag) return;
+	va_list args;
+	va_start(args, format);
+	vprintf(format, args);
+	va_end(args);
+}
+
+// comma separated names of diagnostics in bit mask diag
+
+void formatDiagnostics (char *str, int nlen, int diag) {
+	int k = 0;
+	str[0] = '\0';
+	for (int code = 0; code < NUM_DIAGNOSTICS; code++) {
+		if ((diag & (1 << code)) == 0) continue;
+		int n = snprintf(str + k, nlen - k, "%s%s", (k > 0) ? "," : "", diagnostic_names[code]);
+		if (n < 0 || n >= nlen - k) break;	// no more space
+		k += n;
+	}
+}
+
+// Run statistics (-stats): time spent in each stage of decoding or encoding (time stamp
+// counter, converted to ns at the end), heap allocations and diagnostics. Only the main
+// thread is counted (-alloccheck counts a thread of its own). Build with NOSTATS defined
+// to leave all of it out.
+
+enum stats_stages { STAGE_INPUT, STAGE_HEADER, STAGE_LCI, STAGE_Z, STAGE_USAGE, STAGE_COLOCATED, STAGE_OUTPUT,
+					NUM_STAGES };
+
+const char *stats_stage_names[NUM_STAGES] = {
+	"input", "header", "lci", "z", "usage", "colocated", "output",
+};
+
+enum alloc_calls { ALLOC_MALLOC, ALLOC_CALLOC, ALLOC_REALLOC, ALLOC_STRNDUP, ALLOC_FREE, NUM_ALLOC_CALLS };
+
+const char *alloc_call_names[NUM_ALLOC_CALLS] = {
+	"malloc", "calloc", "realloc", "strndup", "free",
+};
+
+long long INLINE nanoclock (void) {	// (monotonic, ns)
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+#ifndef NOSTATS
+
+struct RunStats {
+	unsigned long long ticks[NUM_STAGES];
+	long long calls[NUM_STAGES];
+	long long records;
+	long long allocations, allocated, frees;	// (allocated in bytes)
+	long long calls_by_kind[NUM_ALLOC_CALLS];	// (allocations and frees split up)
+	long long diagcounts[NUM_DIAGNOSTICS];
+	unsigned long long startticks;
+	long long startns;
+};
+
+thread_local RunStats *runstats = NULL;		// (while counting)
+
+unsigned long long INLINE statsticks (void) {
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return nanoclock();
+#endif
+}
+
+void INLINE statsadd (int stage, unsigned long long start) {
+	runstats->ticks[stage] += statsticks() - start;
+	runstats->calls[stage]++;
+}
+
+void statsdiagnostics (int diag) {
+	for (int code = 0; code < NUM_DIAGNOSTICS; code++)
+		if (diag & (1 << code)) runstats->diagcounts[code]++;
+}
+
+// allocation hooks (calls in this file are routed here by the macros below)
+
+void INLINE statsalloc (int call, size_t nlen) {
+	runstats->allocations++;
+	runstats->allocated += nlen;
+	runstats->calls_by_kind[call]++;
+}
+
+void *statsmalloc (size_t nlen) {
+	if (runstats != NULL) statsalloc(ALLOC_MALLOC, nlen);
+	return (malloc)(nlen);
+}
+
+void *statscalloc (size_t count, size_t nlen) {
+	if (runstats != NULL) statsalloc(ALLOC_CALLOC, count * nlen);
+	return (calloc)(count, nlen);
+}
+
+void *statsrealloc (void *ptr, size_t nlen) {
+	if (runstats != NULL) statsalloc(ALLOC_REALLOC, nlen);
+	return (realloc)(ptr, nlen);
+}
+
+void statsfree (void *ptr) {
+	if (runstats != NULL && ptr != NULL) {
+		runstats->frees++;
+		runstats->calls_by_kind[ALLOC_FREE]++;
+	}
+	(free)(ptr);
+}
+
+#define malloc(nlen) statsmalloc(nlen)
+#define calloc(count, nlen) statscalloc(count, nlen)
+#define realloc(ptr, nlen) statsrealloc(ptr, nlen)
+#define free(ptr) statsfree(ptr)
+
+#define STATS_START(var) unsigned long long var = (runstats != NULL) ? statsticks() : 0
+#define STATS_STOP(var, stage) do { if (runstats != NULL) statsadd(stage, var); } while (0)
+#define STATS_RECORD(diag) do { if (runstats != NULL) { runstats->records++; statsdiagnostics(diag); } } while (0)
+#define STATS_ACTIVE (runstats != NULL)
+#define STATS_ALLOC(call, nlen) do { if (runstats != NULL) statsalloc(call, nlen); } while (0)
+
+void startstats (void) {
+	runstats = (RunStats *) calloc(1, sizeof(RunStats));
+	if (runstats == NULL) exit(1);
+	runstats->startns = nanoclock();
+	runstats->startticks = statsticks();
+}
+
+void showstats (void) {
+	if (runstats == NULL) return;
+	RunStats *stats = runstats;
+	runstats = NULL;
+	double ns = (double)(nanoclock() - stats->startns);
+	unsigned long long ticks = statsticks() - stats->startticks;
+	double nspertick = (ticks > 0) ? ns / ticks : 1.0;
+	printf("# stats: %lld record%s in %.3f ms", stats->records, (stats->records == 1) ? "" : "s", ns * 1e-6);
+	if (stats->records > 0) printf(" (%.0f ns per record)", ns / stats->records);
+	printf("\n# %-10s %10s %12s %10s %7s\n", "stage", "calls", "ms", "ns/call", "share");
+	double staged = 0;
+	for (int stage = 0; stage < NUM_STAGES; stage++) {
+		double stagens = stats->ticks[stage] * nspertick;
+		staged += stagens;
+		printf("# %-10s %10lld %12.3f %10.1f %6.1f%%\n", stats_stage_names[stage], stats->calls[stage], stagens * 1e-6,
+			   (stats->calls[stage] > 0) ? stagens / stats->calls[stage] : 0.0, (ns > 0) ? 100 * stagens / ns : 0.0);
+	}
+	printf("# %-10s %10s %12.3f %10s %6.1f%%  (caches, reading input, start up)\n", "other", "",
+		   (ns - staged) * 1e-6, "", (ns > 0) ? 100 * (ns - staged) / ns : 0.0);
+	printf("# allocations: %lld (%lld bytes) frees: %lld  (", stats->allocations, stats->allocated, stats->frees);
+	for (int call = 0; call < NUM_ALLOC_CALLS; call++)
+		printf("%s%s %lld", (call > 0) ? " " : "", alloc_call_names[call], stats->calls_by_kind[call]);
+	printf(")\n");
+	printf("# diagnostics:");
+	int ndiag = 0;
+	for (int code = 0; code < NUM_DIAGNOSTICS; code++) {
+		if (stats->diagcounts[code] == 0) continue;
+		printf(" %s=%lld", diagnostic_names[code], stats->diagcounts[code]);
+		ndiag++;
+	}
+	printf("%s\n", (ndiag > 0) ? "" : " none");
+	free(stats);
+}
+
+#else
+
+#define STATS_START(var)
+#define STATS_STOP(var, stage)
+#define STATS_RECORD(diag)
+#define STATS_ACTIVE 0
+#define STATS_ALLOC(call, nlen)
+
+void startstats (void) {
+	printf("ERROR: -stats not available (built with NOSTATS)\n");
+}
+
+void showstats (void) {
+}
+
+#endif
+
 ///////////////////////////////////////////////////////////////////////////////
 
 // Global variables used when encoding an LCI string - set from command line.
 // Also, variables set by decoding a LCI string given on the command line (-lci=...)
+// NOTE: each thread has its own copy, so worker threads can encode and decode in parallel
 
 // Needed for LCI subelement:
 
-double latitude=0, longitude=0, altitude=0;
-double latitude_uncertainty=0, longitude_uncertainty=0, altitude_uncertainty=0;
+thread_local double latitude=0, longitude=0, altitude=0;
+thread_local double latitude_uncertainty=0, longitude_uncertainty=0, altitude_uncertainty=0;
 
 // Altitude_Type: 0 -> unknown, 1 -> meters, 2 -> floors, 3 -> height above ground in meters 
-int Altitude_Type = 1;	// default
+thread_local int Altitude_Type = 1;	// default
 
 // Datum 1 -> WGS84, 2 -> NAD83_NAVD88, 3 -> NAD93_MLLWVD, otherwise unknown...
-int datum = 1;		// default		
+thread_local int datum = 1;		// default		
 
 // The RegLoc Agreement field is set to 1 to report that the STA is operating within a 
 // national policy area or an international agreement area near a national border; 
-int RegLoc_Agreement = 0;
+thread_local int RegLoc_Agreement = 0;
 
 // The RegLoc DSE field is set to 1 to report that the enabling STA is enabling
 // the operation of STAs with DSE (dynamic station enablement).
-int RegLoc_DSE = 0;
+thread_local int RegLoc_DSE = 0;
 
 // The Dependent STA field is set to 1 to report that the STA is operating with the
 // enablement of the enabling STA whose LCI is being reported; 
-int Dependent_STA = 0;
+thread_local int Dependent_STA = 0;
 
 // The Version field is a 2-bit field defined in IETF RFC 6225.
-int LCI_version = LCI_VERSION_1;	// the only value currently defined in IETF RFC 6225.
+thread_local int LCI_version = LCI_VERSION_1;	// the only value currently defined in IETF RFC 6225.
 
 // Needed for Z subelement:
 
-int expected_to_move = 0;	// 2 bits - must be zero for Android getResponderLocation()
-double sta_floor = 0, sta_height_above_floor = 0, sta_height_above_floor_uncertainty = 0;
+thread_local int expected_to_move = 0;	// 2 bits - must be zero for Android getResponderLocation()
+thread_local double sta_floor = 0, sta_height_above_floor = 0, sta_height_above_floor_uncertainty = 0;
 
 // Needed for Usage Rules/Policy subelement:
 
-int	retransmission_allowed = 1;		// must be 1 for Android getResponderLocation()
-int retention_expires_present = 0;	// must be 0 for Android getResponderLocation()
-int STA_location_policy = 0;
-int expiration = 0;		// expiration time (hours) (should be 0 unless retention_expires_present)
+thread_local int	retransmission_allowed = 1;		// must be 1 for Android getResponderLocation()
+thread_local int retention_expires_present = 0;	// must be 0 for Android getResponderLocation()
+thread_local int STA_location_policy = 0;
+thread_local int expiration = 0;		// expiration time (hours) (should be 0 unless retention_expires_present)
 
 //////////////////////////////////////////////////////////////////////////////////////////////
 
 char const * lcistring = NULL;		// lci string to decode if given on command line using -lci=...
 
-int bssid_index = 0;				// points to next available slot in BSSIDS array
+thread_local int bssid_index = 0;				// points to next available slot in BSSIDS array
 
-int max_bssids = 10;
+thread_local int max_bssids = 10;
 
-char const **BSSIDS = NULL;			// array of strings of BSSIDs
+thread_local char const **BSSIDS = NULL;			// array of strings of BSSIDs
+
+#define BSSID_TEXT 18		// room for BSSID string "00:11:22:33:44:55" (and its 0)
+
+thread_local char (*bssidtext)[BSSID_TEXT] = NULL;	// where the strings live: BSSIDS[k] is bssidtext[k]
 
 // Each Address field contains a 48-bit address as defined in Clause 8 of IEEE Std 802-2014.
 
@@ -189,7 +519,8 @@ char const **BSSIDS = NULL;			// array of strings of BSSIDs
 // Utility functions
 
 const char INLINE *strndup(const char *str, int nlen) {
-	char *strnew = (char *) malloc(nlen+1);
+	STATS_ALLOC(ALLOC_STRNDUP, nlen+1);
+	char *strnew = (char *) (malloc)(nlen+1);	// (counted as strndup, not malloc)
 //	strncpy(strnew, str, nlen);	// generic C version
 	strncpy_s(strnew, nlen+1, str, nlen);	// Windows "safe" version
 	strnew[nlen]='\0';	// null terminate
@@ -207,13 +538,13 @@ int INLINE hextoint(int c) {	// hex character to integer
 	if (c >= '0' && c <= '9') return (c & 0x0F);
 	else if (c >= 'A' && c <= 'F') return (c & 0x0F) + 9;
 	else if (c >= 'a' && c <= 'f') return (c & 0x0F) + 9;
-	printf("ERROR in conversion from hexadecimal char to int: char %d\n", c);
+	diagnose(DIAG_HEX_DIGIT, "ERROR in conversion from hexadecimal char to int: char %d\n", c);
 	return 0;
 }
 
 int INLINE inttohex(int k) {	// integer to hex character (lc)
 	if (k >= 0 && k <= 15) return "0123456789abcdef"[k]; 
-	printf("ERROR in conversion from int to hexadecimal char: int %d\n", k);
+	diagnose(DIAG_HEX_DIGIT, "ERROR in conversion from int to hexadecimal char: int %d\n", k);
 	return 0;
 }
 
@@ -311,21 +642,74 @@ int isValidBSSID (const char *str) {	// check MAC address format
 	else return 0;	// bad format
 }
 
+// convert BSSID string (either format) to six octets --- returns 0 if format is invalid
+
+int parseBSSID (const char *str, unsigned char *mac) {
+	if (! isValidBSSID(str)) return 0;
+	int step = (strlen(str) == 6*3-1) ? 3 : 2;
+	for (int k = 0; k < 6; k++)
+		mac[k] = (unsigned char)((hextoint(str[k*step]) << 4) | hextoint(str[k*step+1]));
+	return 1;
+}
+
+void formatBSSID (char *str, const unsigned char *mac) {	// 00:11:22:33:44:55 format
+	for (int k = 0; k < 6; k++) {
+		str[k*3] = (char)inttohex(mac[k] >> 4);
+		str[k*3+1] = (char)inttohex(mac[k] & 0x0F);
+		str[k*3+2] = (k < 5) ? ':' : '\0';
+	}
+}
+
+// make sure BSSIDS array has a slot at index indx (allocating it, in threads other than main).
+// The strings are kept in fixed size slots that are reused, so decoding and encoding
+// records does not allocate once there are enough slots.
+
+void reserveBSSIDs (int indx) {
+	if (BSSIDS != NULL && indx < max_bssids) return;
+	while (max_bssids <= indx) max_bssids *= 2;
+	BSSIDS = (const char **) realloc(BSSIDS, (max_bssids+1) * sizeof(const char *));
+	bssidtext = (char (*)[BSSID_TEXT]) realloc(bssidtext, (max_bssids+1) * BSSID_TEXT);
+	if (BSSIDS == NULL || bssidtext == NULL) exit(1);
+	for (int k = 0; k <= max_bssids; k++) BSSIDS[k] = bssidtext[k];	// (slots may have moved)
+}
+
+// copy BSSID string (at most nlen characters of str) into slot k --- returns 0 if too long
+
+int setBSSID (int k, const char *str, int nlen) {
+	int n = 0;
+	for (; n < nlen && str[n] != '\0'; n++) {
+		if (n == BSSID_TEXT-1) return 0;
+		bssidtext[k][n] = str[n];
+	}
+	bssidtext[k][n] = '\0';	// null terminate
+	return 1;
+}
+
+// forget the BSSID strings (the slots are kept for the next list)
+
+void clearColocatedBSSIDs (void) {
+	bssid_index = 0;
+}
+
+// release the BSSIDS array and slots (at end of thread)
+
+void freeColocatedBSSIDs (void) {
+	free(BSSIDS);
+	free(bssidtext);
+	BSSIDS = NULL;
+	bssidtext = NULL;
+	bssid_index = 0;
+}
+
 // extract array of BSSID strings from comma-separated list on command line
 
 void extractBSSID (const char *str) {
-	const char *BSSID;
 	while (*str != '\0') {
-		if (bssid_index >= max_bssids) {
-			max_bssids *= 2;
-			BSSIDS = (const char **) realloc(BSSIDS, (max_bssids+1) * sizeof(const char *));
-			if (BSSIDS == NULL) exit(1);
-		}
+		reserveBSSIDs(bssid_index);
 		const char *strend = strchr(str, ',');
 		if (strend == NULL) strend = str + strlen(str);
-		BSSID = strndup(str, strend-str);
-		if (isValidBSSID(BSSID)) BSSIDS[bssid_index++] = BSSID;
-		else printf("ERROR: invalid colocated BSSID %s\n", BSSID);
+		if (setBSSID(bssid_index, str, (int)(strend-str)) && isValidBSSID(BSSIDS[bssid_index])) bssid_index++;
+		else printf("ERROR: invalid colocated BSSID %.*s\n", (int)(strend-str), str);
 		if (*strend == '\0') break;
 		str = strend+1;
 	}
@@ -352,18 +736,18 @@ double INLINE decodebinarydot(int n, int m) {	// 2^{m-n}
 int INLINE encodebinarydot(double val, int m) {
 	double eps= 0.000001;	// to prevent coding/decoding disparity (round trip equality)
 	if (val <= 0) {
-		printf("ERROR: uncertainty %lg non-positive (while taking log2)\n", val);
+		diagnose(DIAG_UNCERTAINTY_VALUE, "ERROR: uncertainty %lg non-positive (while taking log2)\n", val);
 		return 0;
 	}
 	if (debugflag) printf("val %10.9f log2(val) %10.9f ceil(log2(val)) %6.3f\n",
 						  val, log2(val), ceil(log2(val)));
 	int res = m - (int)ceil(log2(val)-eps);
 	if (res <= 0) {
-		printf("WARNING: uncertainty %lg way too large (i.e. resulting code non-positive)\n", val);
+		diagnose(DIAG_UNCERTAINTY_VALUE, "WARNING: uncertainty %lg way too large (i.e. resulting code non-positive)\n", val);
 		return 1;	//  give smallest possible code (other than zero, which is code for unknown)
 	}
 	else if (res > MAX_LCI_UNCERTAINTY) {
-		printf("WARNING: uncertainty %lg too small (i.e. resulting code too large %d > %d)\n",
+		diagnose(DIAG_UNCERTAINTY_VALUE, "WARNING: uncertainty %lg too small (i.e. resulting code too large %d > %d)\n",
 			   val, res, MAX_LCI_UNCERTAINTY);
 		return MAX_LCI_UNCERTAINTY;
 	}
@@ -422,14 +806,15 @@ char *expected_to_move_string (int expected_to_moves) {	// expected_to_move stri
 //		2. Expiration after a period of time.
 
 void checksettings (void) {
+	if (androidpolicy == ANDROID_OFF) return;
 	if (!retransmission_allowed) 
-		printf("WARNING: Android will not provide location information because retransmission_allowed is false\n");
+		diagnose(DIAG_ANDROID, "WARNING: Android will not provide location information because retransmission_allowed is false\n");
 	if (retention_expires_present)
-		printf("WARNING: Android will not provide location information because retention_expires_present is true\n");
+		diagnose(DIAG_ANDROID, "WARNING: Android will not provide location information because retention_expires_present is true\n");
 	if (expiration != 0)
-		printf("WARNING: Android will not provide location information because expiration time != 0\n");
+		diagnose(DIAG_ANDROID, "WARNING: Android will not provide location information because expiration time != 0\n");
 	if (expected_to_move)
-		printf("WARNING: Android will not provide location information because expected_to_move is true\n");
+		diagnose(DIAG_ANDROID, "WARNING: Android will not provide location information because expected_to_move is true\n");
 }
 
 /////////////////////////////////////////////////////////////////////////////////////////
@@ -545,14 +930,14 @@ int encodeUsageField(char *str, int nbyt) {
 	int nlen = retention_expires_present ? 3 : 1; // default length of expiration field 
 	if (retention_expires_present) {
 		if (expiration == 0) {
-			printf("WARNING: Inconsistency: Retention_expires_present true but expiration == 0\n");
+			diagnose(DIAG_USAGE_INCONSISTENT, "WARNING: Inconsistency: Retention_expires_present true but expiration == 0\n");
 			retention_expires_present = false;	// override
 			nlen = 1;
 		}
 	}
 	else {
 		if (expiration != 0) {
-			printf("WARNING: Inconsistency: Retention_expires_present false but expiration != 0\n");
+			diagnose(DIAG_USAGE_INCONSISTENT, "WARNING: Inconsistency: Retention_expires_present false but expiration != 0\n");
 			retention_expires_present = true;	// override
 			nlen = 3;
 		}
@@ -609,7 +994,7 @@ int placeBSSID (char *str, int nbyt, const char *bssid) {
 			str[nbyt*2+1] = bssid[k*2+1];
 		}
 	}
-	else printf("ERROR: invalid BSSID format %s\n", bssid);
+	else diagnose(DIAG_BSSID, "ERROR: invalid BSSID format %s\n", bssid);
 	return nbyt;
 }
 
@@ -629,19 +1014,21 @@ int encodeColocatedBSSID(char *str, int nbyt, int nbssids) {
 int decodeColocatedBSSID(const char *str, int nbyt, int nlen) {	// str points past ID and length octets
 	int maxBSSIDindicator = getoctet(str, nbyt++);
 	if (maxBSSIDindicator != 0) {
-		printf("WARNING: maxBSSIDindicator %d != 0\n",
+		diagnose(DIAG_MAXBSSID_INDICATOR, "WARNING: maxBSSIDindicator %d != 0\n",
 			   maxBSSIDindicator);	// official value (9.4.2.22.10 Fig.	9-224)
 		if (maxBSSIDindicator != (nlen-1)/6)
-			printf("WARNING: maxBSSIDindicator %d != %d\n",
+			diagnose(DIAG_MAXBSSID_INDICATOR, "WARNING: maxBSSIDindicator %d != %d\n",
 				   maxBSSIDindicator, (nlen-1)/6);	// current Android implementation
 	}
 	// Note: base the number of BSSIDs on length of field, not maxBSSIDindicator,
 	// since maxBSSIDindicator is *supposed* to be zero
 	int nBSSID = (nlen-1)/6;
+	clearColocatedBSSIDs();		// replaces any previous list
+	reserveBSSIDs(nBSSID);
 	for (int k = 0; k < nBSSID; k++) {
-		BSSIDS[k] = strndup(str+nbyt*2, 6*2);
+		setBSSID(k, str+nbyt*2, 6*2);
 		nbyt += 6;
-		if (! isValidBSSID(BSSIDS[k])) printf("ERROR: invalid BSSID %s\n", BSSIDS[k]);
+		if (! isValidBSSID(BSSIDS[k])) diagnose(DIAG_BSSID, "ERROR: invalid BSSID %s\n", BSSIDS[k]);
 	}
 	bssid_index = nBSSID;	// k
 	return nbyt;
@@ -673,7 +1060,7 @@ int decodeLCIfield(const char *str, int indx) {
 	int Latitude_Uncertainty = (int)getbits(str, indx, 6);
 	indx += 6;	// advance 6 bits
 	if (Latitude_Uncertainty > MAX_LCI_UNCERTAINTY) {
-		printf("ERROR: latitude uncertainty code %d > %d\n", Latitude_Uncertainty, MAX_LCI_UNCERTAINTY);
+		diagnose(DIAG_UNCERTAINTY, "ERROR: latitude uncertainty code %d > %d\n", Latitude_Uncertainty, MAX_LCI_UNCERTAINTY);
 		Latitude_Uncertainty = MAX_LCI_UNCERTAINTY;
 	}
 	// latitude uncertainty code zero means "unknown"
@@ -688,7 +1075,7 @@ int decodeLCIfield(const char *str, int indx) {
 	int Longitude_Uncertainty = (int)getbits(str, indx, 6);
 	indx += 6;
 	if (Longitude_Uncertainty > MAX_LCI_UNCERTAINTY) {
-		printf("ERROR: longitude uncertainty code %d> %d\n", Longitude_Uncertainty, MAX_LCI_UNCERTAINTY);
+		diagnose(DIAG_UNCERTAINTY, "ERROR: longitude uncertainty code %d> %d\n", Longitude_Uncertainty, MAX_LCI_UNCERTAINTY);
 		Longitude_Uncertainty = MAX_LCI_UNCERTAINTY;
 	}
 	// longitude uncertainty code zero means "unknown"
@@ -706,7 +1093,7 @@ int decodeLCIfield(const char *str, int indx) {
 	int Altitude_Uncertainty = (int)getbits(str, indx, 6);
 	indx += 6;
 	if (Altitude_Uncertainty > MAX_LCI_UNCERTAINTY) {
-		printf("ERROR: Altitude uncertainty code %d > %d\n", Altitude_Uncertainty, MAX_LCI_UNCERTAINTY);
+		diagnose(DIAG_UNCERTAINTY, "ERROR: Altitude uncertainty code %d > %d\n", Altitude_Uncertainty, MAX_LCI_UNCERTAINTY);
 		Altitude_Uncertainty = MAX_LCI_UNCERTAINTY;
 	}
 	// altitude uncertainty code zero means unknown
@@ -714,7 +1101,7 @@ int decodeLCIfield(const char *str, int indx) {
 	else altitude_uncertainty = decodebinarydot(Altitude_Uncertainty, 21);
 //	NOTE: actually, Altitude_Uncertainty only applies to Altitude_Type == 1
 
-	int Altitude = (int) getbits(str, indx, 30);
+	int Altitude = (int) propagate_sign(getbits(str, indx, 30), 30);	// (two's complement)
 	indx += 30;
 	altitude = Altitude / 256.0; // coded as 8-bit fraction
 
@@ -740,7 +1127,7 @@ int decodeLCIfield(const char *str, int indx) {
 	LCI_version = (int)getbits(str, indx, 2);
 	indx += 2;
 	if (LCI_version != LCI_VERSION_1)
-		printf("ERROR: LCI Version %d is not %d\n", LCI_version, LCI_VERSION_1);
+		diagnose(DIAG_LCI_VERSION, "ERROR: LCI Version %d is not %d\n", LCI_version, LCI_VERSION_1);
 
 	if (traceflag) {	
 		printf("Datum %d -> %s\n", datum, datum_string(datum));
@@ -766,21 +1153,24 @@ void decodeLCIstring (const char *str) {
 	int nbyt = 0;
 	int slen = strlen(str) / 2;	// how many bytes represented by hex string
 	if (traceflag) printf("slen %d str %s\n", slen, str);
+	STATS_START(headerstart);
 	int a = getoctet(str, nbyt++);	// 01 MEASUREMENT_REPORT ?
 	int b = getoctet(str, nbyt++);	// 00
 	int c = getoctet(str, nbyt++);	// 08 (LCI_TYPE) (Measurement Type Table 9-107)
 	if (debugflag) printf("%0x %0x %0x byte %d\n", a, b, c, nbyt);
 	if (a != MEASURE_TOKEN || b != MEASURE_REQUEST_MODE || c != LCI_TYPE)
-		printf("ERROR: Bad Measurement Element Type %0x %0x %0x\n", a, b, c);
+		diagnose(DIAG_HEADER, "ERROR: Bad Measurement Element Type %0x %0x %0x\n", a, b, c);
+	STATS_STOP(headerstart, STAGE_HEADER);
 	
 //	Now look for the subelements and parse them
 	while (nbyt < slen && str[nbyt*2] != '\0') {
 		int indx;
+		STATS_START(stagestart);
 		int ID = getoctet(str, nbyt++);		// subelement ID
 		int nlen = getoctet(str, nbyt++);	// subelement field length
 		if (traceflag) printf("ID %d nlen %d byte %d (slen %d)\n", ID, nlen, nbyt, slen);
 		if (nbyt + nlen > slen) {	// don't try and parse past end of string
-			printf("ERROR: bad length code ID %d nlen %d (nbyt %d slen %d)\n", ID, nlen, nbyt, slen);
+			diagnose(DIAG_LENGTH, "ERROR: bad length code ID %d nlen %d (nbyt %d slen %d)\n", ID, nlen, nbyt, slen);
 			break;
 		}
 		switch (ID) {
@@ -792,12 +1182,12 @@ void decodeLCIstring (const char *str) {
 			if (verboseflag) printf("LCI subelement: ID %d length %d (byte %d)\n", ID, nlen, nbyt);
 			if (nlen == 0) break;	// nothing to do
 			if (nlen != 16) {
-				printf("ERROR: Unexpected length %d for LCI element\n", nlen);
+				diagnose(DIAG_LCI_LENGTH, "ERROR: Unexpected length %d for LCI element\n", nlen);
 				nbyt += nlen;
 				break;	// don't even try to decode it...
 			}
 			indx = decodeLCIfield(str+nbyt*2, 0);
-			if (indx != 128) printf("ERROR: length of LCI subelement wrong %d bits (should be 128 bits)\n", indx);
+			if (indx != 128) diagnose(DIAG_LCI_LENGTH, "ERROR: length of LCI subelement wrong %d bits (should be 128 bits)\n", indx);
 			nbyt += indx >> 3;	// advance 16 bytes
 			if (debugflag) printf("DecodeLCIstring bit indx %d byte %d (slen %d)\n", indx, nbyt, slen);
 			if (verboseflag) printf("\n");
@@ -808,7 +1198,7 @@ void decodeLCIstring (const char *str) {
 		//	The format of the STA Floor Info field is defined in Figure	9-219.
 		case Z_CODE:
 			if (verboseflag) printf("Z subelement: ID %d length %d (byte %d)\n", ID, nlen, nbyt);
-			if (nlen != 6) 	printf("ERROR: Unexpected length %d for Z subelement\n", nlen);
+			if (nlen != 6) 	diagnose(DIAG_Z_LENGTH, "ERROR: Unexpected length %d for Z subelement\n", nlen);
 //			if (nlen != 6) { 
 			if (nlen != 6 && nlen != 5) { 	// allow for buggy Z subelements ?
 				nbyt += nlen;
@@ -817,7 +1207,7 @@ void decodeLCIstring (const char *str) {
 			STA_Floor_Info = getnumber(str, nbyt, 2);
 			nbyt += 2;
 			expected_to_move = STA_Floor_Info & 0x03;		// two LSB bits
-			sta_floor = (double)(STA_Floor_Info >> 2) / 16.0;	// 14 MSB bits - units of 1/16 floors
+			sta_floor = (double) propagate_sign(STA_Floor_Info >> 2, 14) / 16.0;	// 14 MSB bits - units of 1/16 floors
 			// The following have not been dealt with explicitly here
 			// -8192 => unknown STA floor
 			// -8191 => STA -8191/16 floors or less
@@ -828,7 +1218,7 @@ void decodeLCIstring (const char *str) {
 				nbyt += 2;
 			}
 			else {
-				STA_Height_Above_Floor = getnumber(str, nbyt, 3);	// correct
+				STA_Height_Above_Floor = (int) propagate_sign(getnumber(str, nbyt, 3), 24);	// correct
 				nbyt += 3;
 			}
 			// The following have not been dealt with explicitly  here
@@ -840,7 +1230,7 @@ void decodeLCIstring (const char *str) {
 			STA_Height_Above_Floor_Uncertainty = getoctet(str, nbyt++);
 			// NOTE: 0 here means height above floor uncertainty unknown 
 			if (STA_Height_Above_Floor_Uncertainty > MAX_Z_UNCERTAINTY)
-					printf("ERROR: STA_Height_Above_Floor_Uncertainty %d > %d\n",
+					diagnose(DIAG_Z_UNCERTAINTY, "ERROR: STA_Height_Above_Floor_Uncertainty %d > %d\n",
 						  STA_Height_Above_Floor_Uncertainty, MAX_Z_UNCERTAINTY);
 			if (STA_Height_Above_Floor_Uncertainty > 0)
 				sta_height_above_floor_uncertainty = decodebinarydot(STA_Height_Above_Floor_Uncertainty, 11);
@@ -862,7 +1252,7 @@ void decodeLCIstring (const char *str) {
 		case USAGE_CODE:
 			if (verboseflag) printf("Usage Rules/Policy subelement: ID %d length %d (byte %d)\n", ID, nlen, nbyt);
 			if (nlen != 1 && nlen != 3) {
-				printf("ERROR: Unexpected length %d for Usage Rules/Policy subelement\n", nlen);
+				diagnose(DIAG_USAGE_LENGTH, "ERROR: Unexpected length %d for Usage Rules/Policy subelement\n", nlen);
 				nbyt += nlen;
 				break;	// don't even try to decode it...
 			}
@@ -887,10 +1277,10 @@ void decodeLCIstring (const char *str) {
 			}
 //			else printf("ERROR: length of Usage field %d octets (not 1 or 3)\n", nlen); 
 			if (retention_expires_present && nlen != 3)
-				printf("WARNING: Inconsistent fields: retention_expires_present true with nlen %d != 3\n", nlen);
+				diagnose(DIAG_USAGE_INCONSISTENT, "WARNING: Inconsistent fields: retention_expires_present true with nlen %d != 3\n", nlen);
 //			if (!retention_expires_present && nlen != 1)
 			if (!retention_expires_present && nlen != 1 && expiration != 0)
-				printf("WARNING: Inconsistent fields: retention_expires_present false with nlen %d != 1\n", nlen);
+				diagnose(DIAG_USAGE_INCONSISTENT, "WARNING: Inconsistent fields: retention_expires_present false with nlen %d != 1\n", nlen);
 			// NOTE: If the Usage rights subelement (06) does not have an expiration bit set, 
 			// then there should be no expiration time field. 
 			// NOTE:the above ignores the common error of nlen == 3 and expiration == 0
@@ -900,18 +1290,20 @@ void decodeLCIstring (const char *str) {
 
 		case COLOCATED_BSSID:
 			if (verboseflag) printf("Colocated BSSIDS subelement: ID %d length %d (byte %d)\n", ID, nlen, nbyt);
-			if ((nlen-1) % 6 != 0) printf("ERROR: length %d\n", nlen);
+			if ((nlen-1) % 6 != 0) diagnose(DIAG_COLOCATED_LENGTH, "ERROR: length %d\n", nlen);
 			nbyt = decodeColocatedBSSID(str, nbyt, nlen);
-			if (bssid_index > 0) showColocatedBSSIDs();
+			if (bssid_index > 0 && ! quietflag) showColocatedBSSIDs();
 			if (traceflag) printf("bssid_index %d nbyt %d \n", bssid_index, nbyt);
 			if (verboseflag) printf("\n");
 			break;
 			
 		default:
-			printf("ERROR: Unrecognized subelement: ID %d length %d at octet %d\n", ID, nlen, nbyt-2);
+			diagnose(DIAG_SUBELEMENT, "ERROR: Unrecognized subelement: ID %d length %d at octet %d\n", ID, nlen, nbyt-2);
 			nbyt += nlen;
 			break;
 		}
+		STATS_STOP(stagestart, (ID == LCI_CODE) ? STAGE_LCI : (ID == Z_CODE) ? STAGE_Z : (ID == USAGE_CODE) ?
+				   STAGE_USAGE : (ID == COLOCATED_BSSID) ? STAGE_COLOCATED : STAGE_HEADER);
 		if (traceflag) printf("\n");
 	}
 	checksettings();
@@ -919,55 +1311,342 @@ void decodeLCIstring (const char *str) {
 	if (debugflag) printf("\n");
 }
 
-char *encodeLCIstring (void) {
+int INLINE encodeLCIlength (void) {	// hexadecimal characters in LCI string
 	int nbyt = 3;		// space for Measurement Report header 
 	nbyt += (2 + 16);	// space for LCI subelement
 	nbyt += (2 + 6);	// space for Usage subelement
 	nbyt += (2 + 3);	// space for Z subelement
 	nbyt += (2 + 6 * bssid_index + 1);	// space for colocated BSSID subelement 
-	int nlen = nbyt * 2;	// number of hexadecimal characters in string
-	if (debugflag) printf("Allocating %d bytes\n", nlen+1);
-	char *str = (char *) malloc(nlen+1);
-	if (str == NULL) exit(1);
+	return nbyt * 2;
+}
+
+// encode into str (of size slen) --- returns length of LCI string, or -1 if it does not fit
+
+int encodeLCIbuffer (char *str, int slen) {
+	int nlen = encodeLCIlength();	// number of hexadecimal characters in string
+	if (nlen >= slen) return -1;
 	memset(str, '0', nlen);
 	str[nlen] = '\0';
-	nbyt = 0;
+	int nbyt = 0;
+	STATS_START(headerstart);
 	checksettings();
 //	Measurement Report Type header first
 	putoctet(str, nbyt++, MEASURE_TOKEN);			// 1
 	putoctet(str, nbyt++, MEASURE_REQUEST_MODE);	// 0
 	putoctet(str, nbyt++, LCI_TYPE);				// 08 (LCI_TYPE) (Measurement Type Table 9-107)
 	if (debugflag) printf("After header byte %d\n", nbyt);
+	STATS_STOP(headerstart, STAGE_HEADER);
 //	Subelements within an element are ordered by nondecreasing Subelement ID. See 10.27.9.
 	int needLCIflag = (latitude != 0 || longitude != 0 || altitude != 0);
 //	if (wantLCIflag && needLCIflag) {
 	if (wantLCIflag) {
+		STATS_START(lcistart);
 		nbyt = encodeLCIfield(str, nbyt);
+		STATS_STOP(lcistart, STAGE_LCI);
 		if (traceflag) printf("str %s byte %d\n", str, nbyt);
 	}
 	int needZflag = (sta_floor != 0 || sta_height_above_floor != 0 || sta_height_above_floor_uncertainty != 0);
 //	if (wantZflag && needZflag) {
 	if (wantZflag) {
+		STATS_START(zstart);
 		nbyt = encodeZfield(str, nbyt);
+		STATS_STOP(zstart, STAGE_Z);
 		if (traceflag) printf("str %s byte %d\n", str, nbyt);
 	}
 	int needBSSIDflag = (bssid_index > 0);
 //	if (wantColocatedflag) {
 	if (wantColocatedflag && needBSSIDflag) {
+		STATS_START(colocatedstart);
 		nbyt = encodeColocatedBSSID(str, nbyt, bssid_index);
+		STATS_STOP(colocatedstart, STAGE_COLOCATED);
 		if (traceflag) printf("str %s byte %d\n", str, nbyt);		
 	}
 	int needUsageFlag = (needLCIflag || needZflag || needBSSIDflag);
 //	if (wantUsageflag) {
 	if (wantUsageflag && needUsageFlag) {
+		STATS_START(usagestart);
 		nbyt = encodeUsageField(str, nbyt);
+		STATS_STOP(usagestart, STAGE_USAGE);
 		if (traceflag) printf("str %s byte %d\n", str, nbyt);
 	}
+	return nlen;
+}
+
+char *encodeLCIstring (void) {	// (caller frees it)
+	int nlen = encodeLCIlength();
+	if (debugflag) printf("Allocating %d bytes\n", nlen+1);
+	char *str = (char *) malloc(nlen+1);
+	if (str == NULL) exit(1);
+	encodeLCIbuffer(str, nlen+1);
 	return str;
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////////////
 
+// An LciRecord holds everything needed to encode one LCI string (i.e. a snapshot
+// of the global variables above), so that a whole fleet of APs can be kept in memory.
+
+#define MAX_COLOCATED 42	// (255 - 1) / 6 BSSIDs fit in one Colocated BSSID subelement
+
+struct LciRecord {
+	double latitude, longitude, altitude;
+	double latitude_uncertainty, longitude_uncertainty, altitude_uncertainty;
+	int Altitude_Type, datum, RegLoc_Agreement, RegLoc_DSE, Dependent_STA, LCI_version;
+	int expected_to_move;
+	double sta_floor, sta_height_above_floor, sta_height_above_floor_uncertainty;
+	int retransmission_allowed, retention_expires_present, STA_location_policy, expiration;
+	int ncolocated;
+	unsigned char colocated[MAX_COLOCATED][6];	// binary MAC addresses
+};
+
+// copy global variables into record (after decodeLCIstring, say)
+
+void saveLciRecord (LciRecord *rec) {
+	memset(rec, 0, sizeof(LciRecord));	// so that padding and unused BSSID slots are zero
+	rec->latitude = latitude;
+	rec->longitude = longitude;
+	rec->altitude = altitude;
+	rec->latitude_uncertainty = latitude_uncertainty;
+	rec->longitude_uncertainty = longitude_uncertainty;
+	rec->altitude_uncertainty = altitude_uncertainty;
+	rec->Altitude_Type = Altitude_Type;
+	rec->datum = datum;
+	rec->RegLoc_Agreement = RegLoc_Agreement;
+	rec->RegLoc_DSE = RegLoc_DSE;
+	rec->Dependent_STA = Dependent_STA;
+	rec->LCI_version = LCI_version;
+	rec->expected_to_move = expected_to_move;
+	rec->sta_floor = sta_floor;
+	rec->sta_height_above_floor = sta_height_above_floor;
+	rec->sta_height_above_floor_uncertainty = sta_height_above_floor_uncertainty;
+	rec->retransmission_allowed = retransmission_allowed;
+	rec->retention_expires_present = retention_expires_present;
+	rec->STA_location_policy = STA_location_policy;
+	rec->expiration = expiration;
+	for (int k = 0; k < bssid_index && rec->ncolocated < MAX_COLOCATED; k++) {
+		if (parseBSSID(BSSIDS[k], rec->colocated[rec->ncolocated])) rec->ncolocated++;
+	}
+}
+
+// copy record into global variables (before encodeLCIstring, say)
+
+void loadLciRecord (const LciRecord *rec) {
+	latitude = rec->latitude;
+	longitude = rec->longitude;
+	altitude = rec->altitude;
+	latitude_uncertainty = rec->latitude_uncertainty;
+	longitude_uncertainty = rec->longitude_uncertainty;
+	altitude_uncertainty = rec->altitude_uncertainty;
+	Altitude_Type = rec->Altitude_Type;
+	datum = rec->datum;
+	RegLoc_Agreement = rec->RegLoc_Agreement;
+	RegLoc_DSE = rec->RegLoc_DSE;
+	Dependent_STA = rec->Dependent_STA;
+	LCI_version = rec->LCI_version;
+	expected_to_move = rec->expected_to_move;
+	sta_floor = rec->sta_floor;
+	sta_height_above_floor = rec->sta_height_above_floor;
+	sta_height_above_floor_uncertainty = rec->sta_height_above_floor_uncertainty;
+	retransmission_allowed = rec->retransmission_allowed;
+	retention_expires_present = rec->retention_expires_present;
+	STA_location_policy = rec->STA_location_policy;
+	expiration = rec->expiration;
+	clearColocatedBSSIDs();
+	reserveBSSIDs(rec->ncolocated);
+	for (int k = 0; k < rec->ncolocated; k++) {
+		char *BSSID = bssidtext[k];
+		for (int i = 0; i < 6; i++) putoctet(BSSID, i, rec->colocated[k][i]);
+		BSSID[6*2] = '\0';
+	}
+	bssid_index = rec->ncolocated;
+}
+
+// Records as text: white space separated name=value fields, named as the corresponding
+// command line flags, e.g. "lat=-33.857009530067444 lon=151.21520054340363 alt=11.19921875 ..."
+// The same table drives packing of records into compact canonical byte strings.
+
+enum field_types { FIELD_DOUBLE, FIELD_INT, FIELD_BSSIDS };
+
+struct LciField {
+	const char *name;
+	int type;
+	int offset;		// of member in LciRecord
+};
+
+const LciField lcifields[] = {
+	{ "lat",		FIELD_DOUBLE,	offsetof(LciRecord, latitude) },
+	{ "lon",		FIELD_DOUBLE,	offsetof(LciRecord, longitude) },
+	{ "alt",		FIELD_DOUBLE,	offsetof(LciRecord, altitude) },
+	{ "latunc",		FIELD_DOUBLE,	offsetof(LciRecord, latitude_uncertainty) },
+	{ "lonunc",		FIELD_DOUBLE,	offsetof(LciRecord, longitude_uncertainty) },
+	{ "altunc",		FIELD_DOUBLE,	offsetof(LciRecord, altitude_uncertainty) },
+	{ "altitude_type",	FIELD_INT,	offsetof(LciRecord, Altitude_Type) },
+	{ "datum",		FIELD_INT,		offsetof(LciRecord, datum) },
+	{ "RegLoc_Agreement",	FIELD_INT,	offsetof(LciRecord, RegLoc_Agreement) },
+	{ "RegLoc_DSE",	FIELD_INT,		offsetof(LciRecord, RegLoc_DSE) },
+	{ "Dependent_STA",	FIELD_INT,	offsetof(LciRecord, Dependent_STA) },
+	{ "version",	FIELD_INT,		offsetof(LciRecord, LCI_version) },
+	{ "movable",	FIELD_INT,		offsetof(LciRecord, expected_to_move) },
+	{ "floor",		FIELD_DOUBLE,	offsetof(LciRecord, sta_floor) },
+	{ "height",		FIELD_DOUBLE,	offsetof(LciRecord, sta_height_above_floor) },
+	{ "heightunc",	FIELD_DOUBLE,	offsetof(LciRecord, sta_height_above_floor_uncertainty) },
+	{ "Retransmission_Allowed",		FIELD_INT,	offsetof(LciRecord, retransmission_allowed) },
+	{ "Retention_Expires_Present",	FIELD_INT,	offsetof(LciRecord, retention_expires_present) },
+	{ "STA_Location_Policy",	FIELD_INT,	offsetof(LciRecord, STA_location_policy) },
+	{ "expiration",	FIELD_INT,		offsetof(LciRecord, expiration) },
+	{ "BSSID",		FIELD_BSSIDS,	offsetof(LciRecord, ncolocated) },
+};
+
+#define NUM_LCIFIELDS ((int)(sizeof(lcifields) / sizeof(lcifields[0])))
+
+// longest packed record: 9 doubles, 12 ints (including ncolocated), and the BSSIDs
+#define PACKED_RECORD_MAX (9*8 + 12*4 + MAX_COLOCATED*6)
+
+double INLINE *fielddouble(const LciRecord *rec, const LciField *field) {
+	return (double *)((char *) rec + field->offset);
+}
+
+int INLINE *fieldint(const LciRecord *rec, const LciField *field) {
+	return (int *)((char *) rec + field->offset);
+}
+
+// shortest printed form that reads back as the same double
+
+int formatdouble (char *str, int nlen, double val) {
+	int n = 0;
+	for (int digits = 15; digits <= 17; digits++) {
+		n = snprintf(str, nlen, "%.*g", digits, val);
+		if (n < 0 || n >= nlen || strtod(str, NULL) == val) break;
+	}
+	return n;
+}
+
+// write record as text (all fields) --- returns length, or -1 if it does not fit
+
+int formatLciRecord (char *str, int nlen, const LciRecord *rec) {
+	int k = 0;
+	for (int f = 0; f < NUM_LCIFIELDS; f++) {
+		const LciField *field = &lcifields[f];
+		if (field->type == FIELD_BSSIDS && rec->ncolocated == 0) continue;
+		int n = snprintf(str + k, nlen - k, "%s%s=", (k > 0) ? " " : "", field->name);
+		if (n < 0 || n >= nlen - k) return -1;
+		k += n;
+		if (field->type == FIELD_DOUBLE) n = formatdouble(str + k, nlen - k, *fielddouble(rec, field));
+		else if (field->type == FIELD_INT) n = snprintf(str + k, nlen - k, "%d", *fieldint(rec, field));
+		else {
+			n = 0;
+			for (int b = 0; b < rec->ncolocated; b++) {
+				if (k + n + 6*3 >= nlen) return -1;
+				if (b > 0) str[k + n++] = ',';
+				formatBSSID(str + k + n, rec->colocated[b]);
+				n += 6*3-1;
+			}
+		}
+		if (n < 0 || n >= nlen - k) return -1;
+		k += n;
+	}
+	return k;
+}
+
+// set one field of record from name=value token --- returns 0 if not recognized
+
+int parseLciField (LciRecord *rec, const char *token) {
+	const char *value = strchr(token, '=');
+	if (value == NULL) return 0;
+	int nlen = (int)(value - token);
+	value++;
+	for (int f = 0; f < NUM_LCIFIELDS; f++) {
+		const LciField *field = &lcifields[f];
+		if ((int)strlen(field->name) != nlen || _strnicmp(token, field->name, nlen) != 0) continue;
+		if (field->type == FIELD_DOUBLE) {
+			char *end;
+			double val = strtod(value, &end);
+			if (end == value || *end != '\0') return 0;
+			*fielddouble(rec, field) = val;
+		}
+		else if (field->type == FIELD_INT) {
+			char *end;
+			long val = strtol(value, &end, 10);
+			if (end == value || *end != '\0') return 0;
+			*fieldint(rec, field) = (int) val;
+		}
+		else {	// comma separated list of BSSIDs
+			char BSSID[6*3];
+			rec->ncolocated = 0;
+			while (*value != '\0') {
+				const char *end = strchr(value, ',');
+				if (end == NULL) end = value + strlen(value);
+				if (end - value >= (int)sizeof(BSSID) || rec->ncolocated >= MAX_COLOCATED) return 0;
+				memcpy(BSSID, value, end - value);
+				BSSID[end - value] = '\0';
+				if (! parseBSSID(BSSID, rec->colocated[rec->ncolocated])) return 0;
+				rec->ncolocated++;
+				value = (*end == ',') ? end + 1 : end;
+			}
+		}
+		return 1;
+	}
+	return 0;
+}
+
+// Pack record into a compact canonical byte string (zero padding and unused BSSID
+// slots are left out, -0 becomes 0) --- returns number of bytes (at most PACKED_RECORD_MAX)
+
+int packLciRecord (const LciRecord *rec, unsigned char *buf) {
+	int k = 0;
+	for (int f = 0; f < NUM_LCIFIELDS; f++) {
+		const LciField *field = &lcifields[f];
+		if (field->type == FIELD_DOUBLE) {
+			double val = *fielddouble(rec, field) + 0.0;	// -0 + 0 = +0
+			memcpy(buf + k, &val, sizeof(double));
+			k += sizeof(double);
+		}
+		else if (field->type == FIELD_INT) {
+			memcpy(buf + k, fieldint(rec, field), sizeof(int));
+			k += sizeof(int);
+		}
+		else {
+			memcpy(buf + k, &rec->ncolocated, sizeof(int));
+			k += sizeof(int);
+			memcpy(buf + k, rec->colocated, rec->ncolocated * 6);
+			k += rec->ncolocated * 6;
+		}
+	}
+	return k;
+}
+
+// ...and the inverse --- returns number of bytes used, or 0 if buf is not a packed record
+
+int unpackLciRecord (LciRecord *rec, const unsigned char *buf, int nlen) {
+	int k = 0;
+	memset(rec, 0, sizeof(LciRecord));
+	for (int f = 0; f < NUM_LCIFIELDS; f++) {
+		const LciField *field = &lcifields[f];
+		if (field->type == FIELD_DOUBLE) {
+			if (k + (int)sizeof(double) > nlen) return 0;
+			memcpy(fielddouble(rec, field), buf + k, sizeof(double));
+			k += sizeof(double);
+		}
+		else if (field->type == FIELD_INT) {
+			if (k + (int)sizeof(int) > nlen) return 0;
+			memcpy(fieldint(rec, field), buf + k, sizeof(int));
+			k += sizeof(int);
+		}
+		else {
+			if (k + (int)sizeof(int) > nlen) return 0;
+			memcpy(&rec->ncolocated, buf + k, sizeof(int));
+			k += sizeof(int);
+			if (rec->ncolocated < 0 || rec->ncolocated > MAX_COLOCATED ||
+				k + rec->ncolocated * 6 > nlen) return 0;
+			memcpy(rec->colocated, buf + k, rec->ncolocated * 6);
+			k += rec->ncolocated * 6;
+		}
+	}
+	return k;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
 // Test code - buggy examples originally from hostapd.conf
 
 // const char *lci1 = "010008001052834d12efd2b08b9b4bf1cc2c000041060300000004050000000012";	// original (broken)
@@ -984,6 +1663,108 @@ const char *lci2 = "010008001052834d12efd2b08b9b4bf1cc2c000041040600000000001206
 
 const char *lci3 = "01000800101298c0b512926666f6c2f1001c00004104050000c00012";	// broken
 
+// const char *civic3 = "01000b0011223344556677889900998877665544332211aabbccddeeff";	// (same file: civic, not LCI)
+
+// Golden corpus (-golden): the LCI strings above (broken ones included, they are what is out
+// there; the civic one pins down what is made of a report that is not LCI at all), the
+// sample, Stata Center and Compulab strings in the comments at the end of this file, each
+// with what decoding it gives and what encoding that record gives (as -decode and -encode
+// print them, diagnostics included) --- and the command line examples there, encoded.
+// When a change is meant to alter the output, the mismatches -golden prints are the new
+// expected lines.
+
+struct GoldenVector {
+	const char *name;
+	const char *lci;		// (NULL: record given, only encoded)
+	const char *record;		// decoding lci gives
+	const char *again;		// encoding record gives
+};
+
+const GoldenVector goldenvectors[] = {
+	{ "lci1 (hostapd.conf original, broken)",
+	  "010008001052834d12efd2b08b9b4bf1cc2c000041060300000004050000000012",
+	  "lat=-33.85700950026512 lon=151.2152005136013 alt=11.19921875 latunc=0.0009765625 "
+	  "lonunc=0.0009765625 altunc=64 altitude_type=1 datum=1 RegLoc_Agreement=0 RegLoc_DSE=0 "
+	  "Dependent_STA=0 version=1 movable=0 floor=0 height=0 heightunc=0.0078125 "
+	  "Retransmission_Allowed=0 Retention_Expires_Present=0 STA_Location_Policy=0 expiration=0 "
+	  "diagnostics=z_length,android",
+	  "lci=010008001052834d12efd2b08b9b4bf1cc2c0000410406000000000012060100 diagnostics=android" },
+	{ "lci1a (hostapd testgas.py, bad)",
+	  "010008001052834d12efd2b08b9b4bf1cc2c00004104050000000000060100",
+	  "lat=-33.85700950026512 lon=151.2152005136013 alt=11.19921875 latunc=0.0009765625 "
+	  "lonunc=0.0009765625 altunc=64 altitude_type=1 datum=1 RegLoc_Agreement=0 RegLoc_DSE=0 "
+	  "Dependent_STA=0 version=1 movable=0 floor=0 height=0 heightunc=0 Retransmission_Allowed=0 "
+	  "Retention_Expires_Present=0 STA_Location_Policy=0 expiration=0 diagnostics=z_length,android",
+	  "lci=010008001052834d12efd2b08b9b4bf1cc2c0000410406000000000000060100 diagnostics=android" },
+	{ "lci2 (Sydney Opera House, fixed)",
+	  "010008001052834d12efd2b08b9b4bf1cc2c0000410406000000000012060101",
+	  "lat=-33.85700950026512 lon=151.2152005136013 alt=11.19921875 latunc=0.0009765625 "
+	  "lonunc=0.0009765625 altunc=64 altitude_type=1 datum=1 RegLoc_Agreement=0 RegLoc_DSE=0 "
+	  "Dependent_STA=0 version=1 movable=0 floor=0 height=0 heightunc=0.0078125 "
+	  "Retransmission_Allowed=1 Retention_Expires_Present=0 STA_Location_Policy=0 expiration=0",
+	  "lci=010008001052834d12efd2b08b9b4bf1cc2c0000410406000000000012060101" },
+	{ "lci2a (bad: 0603010000)",
+	  "010008001052834d12efd2b08b9b4bf1cc2c00004106030100000406000000000012",
+	  "lat=-33.85700950026512 lon=151.2152005136013 alt=11.19921875 latunc=0.0009765625 "
+	  "lonunc=0.0009765625 altunc=64 altitude_type=1 datum=1 RegLoc_Agreement=0 RegLoc_DSE=0 "
+	  "Dependent_STA=0 version=1 movable=0 floor=0 height=0 heightunc=0.0078125 "
+	  "Retransmission_Allowed=1 Retention_Expires_Present=0 STA_Location_Policy=0 expiration=0",
+	  "lci=010008001052834d12efd2b08b9b4bf1cc2c0000410406000000000012060101" },
+	{ "lci3 (hwsim test_rrm.py, broken)",
+	  "01000800101298c0b512926666f6c2f1001c00004104050000c00012",
+	  "lat=37.41993999481201 lon=-122.07499998807907 alt=7 latunc=0.0009765625 lonunc=0.0009765625 "
+	  "altunc=64 altitude_type=1 datum=1 RegLoc_Agreement=0 RegLoc_DSE=0 Dependent_STA=0 version=1 "
+	  "movable=0 floor=0 height=12 heightunc=0.0078125 Retransmission_Allowed=1 "
+	  "Retention_Expires_Present=0 STA_Location_Policy=0 expiration=0 diagnostics=z_length",
+	  "lci=01000800101298c0b512926666f6c2f1001c0000410406000000c00012060101" },
+	{ "civic3 (hwsim test_rrm.py, civic location, not LCI)",
+	  "01000b0011223344556677889900998877665544332211aabbccddeeff",
+	  "lat=0 lon=0 alt=0 latunc=0 lonunc=0 altunc=0 altitude_type=1 datum=1 RegLoc_Agreement=0 RegLoc_DSE=0 "
+	  "Dependent_STA=0 version=1 movable=0 floor=0 height=0 heightunc=0 Retransmission_Allowed=1 "
+	  "Retention_Expires_Present=0 STA_Location_Policy=0 expiration=0 diagnostics=header,length,lci_length",
+	  "lci=0100080010000000000000000000000100000000410406000000000000" },
+	{ "sample decoding usage",
+	  "010008001052834d12efd2b08b9b4bf1cc2c0000410406000000000010060101",
+	  "lat=-33.85700950026512 lon=151.2152005136013 alt=11.19921875 latunc=0.0009765625 "
+	  "lonunc=0.0009765625 altunc=64 altitude_type=1 datum=1 RegLoc_Agreement=0 RegLoc_DSE=0 "
+	  "Dependent_STA=0 version=1 movable=0 floor=0 height=0 heightunc=0.03125 Retransmission_Allowed=1 "
+	  "Retention_Expires_Present=0 STA_Location_Policy=0 expiration=0",
+	  "lci=010008001052834d12efd2b08b9b4bf1cc2c0000410406000000000010060101" },
+	{ "MIT CSAIL Stata Center",
+	  "010008001052234a2e15923c6674dc1101500000410406000000000000060101",
+	  "lat=42.36163750290871 lon=-71.09062999486923 alt=20 latunc=0.0009765625 lonunc=0.0009765625 "
+	  "altunc=16 altitude_type=1 datum=1 RegLoc_Agreement=0 RegLoc_DSE=0 Dependent_STA=0 version=1 "
+	  "movable=0 floor=0 height=0 heightunc=0 Retransmission_Allowed=1 Retention_Expires_Present=0 "
+	  "STA_Location_Policy=0 expiration=0",
+	  "lci=010008001052234a2e15923c6674dc1101500000410406000000000000060101" },
+	{ "Compulab",
+	  "010008001053ba6654109371c58c111101c80000410406000000000000060101",
+	  "lat=32.65938499569893 lon=35.09977549314499 alt=50 latunc=0.00048828125 lonunc=0.00048828125 "
+	  "altunc=16 altitude_type=1 datum=1 RegLoc_Agreement=0 RegLoc_DSE=0 Dependent_STA=0 version=1 "
+	  "movable=0 floor=0 height=0 heightunc=0 Retransmission_Allowed=1 Retention_Expires_Present=0 "
+	  "STA_Location_Policy=0 expiration=0",
+	  "lci=010008001053ba6654109371c58c111101c80000410406000000000000060101" },
+	{ "MIT CSAIL Stata Center (command line)",
+	  NULL,
+	  "lat=42.3616375 lon=-71.09063 alt=20 latunc=0.00063 lonunc=0.00078 altunc=15",
+	  "lci=010008001052234a2e15923c6674dc1101500000410406000000000000060101" },
+	{ "Compulab (command line)",
+	  NULL,
+	  "lat=32.659385 lon=35.0997755 alt=50 latunc=0.00028 lonunc=0.00040 altunc=10",
+	  "lci=010008001053ba6654109371c58c111101c80000410406000000000000060101" },
+	{ "Sydney Opera House (with uncertainties)",
+	  NULL,
+	  "lat=-33.8570095 lon=151.2152005 alt=11.1992 latunc=0.000976563 lonunc=0.000976563 altunc=64 "
+	  "floor=0 height=0 heightunc=0.03125",
+	  "lci=010008001052834d12efd2b08b9b4bf1cc2c0000410406000000000010060101" },
+	{ "Sydney Opera House (without uncertainties)",
+	  NULL,
+	  "lat=-33.8570095 lon=151.2152005 alt=11.1992",
+	  "lci=010008001040834d12efc0b08b9b4b01cc2c0000410406000000000000060101" },
+};
+
+#define NUM_GOLDEN ((int)(sizeof(goldenvectors) / sizeof(goldenvectors[0])))
+
 ///////////////////////////////////////////////////////////////////////////////
 
 // bits of test code
@@ -1071,97 +1852,6898 @@ void do_US_MTV(void) {
 
 /////////////////////////////////////////////////////////////////////////////////////////////////
 
-void showusage(void) {
-	printf("-v\t\tFlip verbose mode %s\n", verboseflag ? "off":"on");
-	printf("-t\t\tFlip trace mode %s\n", traceflag ? "off":"on");
-	printf("-d\t\tFlip debug mode %s\n", debugflag ? "off":"on");
-	printf("-c\t\tFlip checking mode %s\n", checkflag ? "off":"on");
-	printf("\n");
-	printf("-lci=...\tDecode given LCI string\n");
-	printf("\n");
-	printf("To encode an LCI string use the following:\n");
-	printf("\n");
-	printf("-lat=...\tLatitude  (degrees)\n");
-	printf("-lon=...\tLongitude (degrees)\n");
-	printf("-alt=...\tAltitude  (%s)\n", altitude_type_string(Altitude_Type));
-	printf("\n");
-	printf("-latunc=...\tLatitude  uncertainty (degrees)\n");
-	printf("-lonunc=...\tLongitude uncertainty (degrees)\n");
-	printf("-altunc=...\tAltitude  uncertainty (%s)\n", altitude_type_string(Altitude_Type));
-	printf("\n");
-	printf("-smallest\tZero uncertainty means smallest (as opposed to unknown)\n"); 
-	printf("\n");
-	printf("-floor=...\tFloor number\n");
-	printf("-height=...\tHeight above floor (m)\n");
-	printf("-heightunc=...\tHeight above floor uncertainty (m)\n");
-	printf("\n");
-	printf("-BSSID=... \tMac Addresses of colocated BSSIDs (comma separated list)\n");
-	printf("\n");
-	printf("-datum=...\tCoordinate Datum   (default %d -> \"%s\")\n", datum, datum_string(datum));
-	printf("-altitude_type=\tAltitude Type Code (default %d -> \"%s\")\n",
-		   Altitude_Type, altitude_type_string(Altitude_Type));
-	printf("\n");
-	if (debugflag) { //	Shouldn't really fiddle with the following 
-		printf("-Retransmission_Allowed\t\tRetransmission allowed (default %d)\n", retransmission_allowed);
-		printf("-Retention_Expires_Present\tRetention Expires Present (default %d)\n", retention_expires_present);
-		printf("-expiration=...\t\t\tExpiration (default %d hours)\n", expiration);
-		printf("-STA_Location_Policy\t\tSTA Location Policy (default %d)\n", STA_location_policy);
-		printf("-movable=...\t\t\tExpected to move (default %d)\n",	expected_to_move); // ?
-		printf("\n");
+// Fleet files: one AP per line --- its BSSID followed by its LCI string, e.g.
+//	00:11:22:33:44:55 lci=010008001052834d12efd2b08b9b4bf1cc2c0000410406000000000012060101
+// optionally followed by opclass=... channel=... phytype=... bssidinfo=... (for neighbor reports).
+// Blank lines and lines starting with # are ignored.
+
+#define MAX_LINE 4096
+
+struct FleetAP {
+	unsigned char bssid[6];
+	char name[6*3];			// BSSID in 00:11:22:33:44:55 format
+	char *lci;				// LCI string (lower case hex) as given in fleet file
+	unsigned int bssidinfo;	// BSSID Information field for neighbor report
+	int opclass, channel, phytype;
+	LciRecord rec;			// decoded LCI string
+	int diag;				// diagnostics from decoding
+	double xyz[3];			// local coordinates (m) --- east, north, up
+	char *nr;				// neighbor report advertising this AP (shared by all APs listing it)
+};
+
+int ishexstring (const char *str) {	// non-empty, even number of hexadecimal digits
+	int nlen = strlen(str);
+	if (nlen == 0 || (nlen & 1)) return 0;
+	for (int k = 0; k < nlen; k++) {
+		if (! ishexdigit(str[k])) return 0;
 	}
-	printf("-sample\t\tShow example decoding / encoding\n");
-	printf("-?\t\tPrint this command line argument summary\n");
-	printf("-version=...\t%s\n", version);
-	fflush(stdout);
-	exit(1);
+	return 1;
 }
 
-int commandline(int argc, const char *argv[]) {
-	int firstarg = 1;
-	while (firstarg < argc && *argv[firstarg] == '-') {
-		const char *arg = argv[firstarg];
-		if (strcmp(arg, "-v") == 0) verboseflag = !verboseflag;
-		else if (strcmp(arg, "-t") == 0) traceflag = !traceflag;
-		else if (strcmp(arg, "-d") == 0) debugflag = !debugflag;
-		else if (strcmp(arg, "-c") == 0) checkflag = !checkflag;
-		else if (strcmp(arg, "-smallest") == 0) smallestflag = !smallestflag;
-		else if (strcmp(arg, "-sample") == 0) sampleflag = !sampleflag;
-		else if (_strnicmp(arg, "-lci=", 5) == 0)		// string to decode (uc or lc)
-			lcistring = arg + 5;
-//		parameters for construction of LCI subelement 
-		else if (strncmp(arg, "-lat=", 5) == 0) {	// in degrees
-			if (sscanf_s(arg + 5, "%lg", &latitude) < 1) printf("ERROR: %s\n", arg);
-		}
-		else if (strncmp(arg, "-latitude=", 10) == 0) {
-			if (sscanf_s(arg + 10, "%lg", &latitude) < 1) printf("ERROR: %s\n", arg);
-		}
-		else if (strncmp(arg, "-lon=", 5) == 0) {	// in degrees
-			if (sscanf_s(arg + 5, "%lg", &longitude) < 1) printf("ERROR: %s\n", arg);
-		}
-		else if (strncmp(arg, "-longitude=", 11) == 0) {
-			if (sscanf_s(arg + 11, "%lg", &longitude) < 1) printf("ERROR: %s\n", arg);
-		}
-		else if (strncmp(arg, "-alt=", 5) == 0) {	// in meters
-			if (sscanf_s(arg + 5, "%lg", &altitude) < 1) printf("ERROR: %s\n", arg);
-		}
-		else if (strncmp(arg, "-altitude=", 10) == 0) {
-			if (sscanf_s(arg + 10, "%lg", &altitude) < 1) printf("ERROR: %s\n", arg);
+int INLINE isblankchar(int c) {
+	return (c == ' ' || c == '\t' || c == '\r' || c == '\n');
+}
+
+// split off next white space delimited token (modifies line) --- NULL if none left
+
+char *nexttoken (char **line) {
+	char *str = *line;
+	while (isblankchar(*str)) str++;
+	if (*str == '\0') return NULL;
+	char *token = str;
+	while (*str != '\0' && ! isblankchar(*str)) str++;
+	if (*str != '\0') *str++ = '\0';
+	*line = str;
+	return token;
+}
+
+// decode LCI string into record, starting from defaults so that subelements absent
+// from the string are not inherited from the previous one (uses global variables)
+
+void decodeLciRecord (const char *str, const LciRecord *defaults, LciRecord *rec) {
+	loadLciRecord(defaults);
+	decodeLCIstring(str);
+	saveLciRecord(rec);
+}
+
+FleetAP *readFleet (const char *filename, int *nfleet) {
+	FILE *fp;
+	*nfleet = 0;
+	if (fopen_s(&fp, filename, "r") != 0) {
+		printf("ERROR: unable to open fleet file %s\n", filename);
+		return NULL;
+	}
+	LciRecord defaults;
+	saveLciRecord(&defaults);
+	int oldverboseflag = verboseflag;
+	verboseflag = 0;
+	int maxfleet = 1024, n = 0, lineno = 0;
+	FleetAP *fleet = (FleetAP *) malloc(maxfleet * sizeof(FleetAP));
+	if (fleet == NULL) exit(1);
+	char line[MAX_LINE];
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		lineno++;
+		char *rest = line;
+		char *token = nexttoken(&rest);
+		if (token == NULL || *token == '#') continue;
+		if (n >= maxfleet) {
+			maxfleet *= 2;
+			fleet = (FleetAP *) realloc(fleet, maxfleet * sizeof(FleetAP));
+			if (fleet == NULL) exit(1);
 		}
-		else if (strncmp(arg, "-latunc=", 8) == 0) {	// in degrees
-			if (sscanf_s(arg + 8, "%lg", &latitude_uncertainty) < 1) printf("ERROR: %s\n", arg);
+		FleetAP *ap = &fleet[n];
+		memset(ap, 0, sizeof(FleetAP));
+		if (! parseBSSID(token, ap->bssid)) {
+			printf("ERROR: line %d: invalid BSSID %s\n", lineno, token);
+			continue;
 		}
-		else if (strncmp(arg, "-lonunc=", 8) == 0) {	// in degrees
-			if (sscanf_s(arg + 8, "%lg", &longitude_uncertainty) < 1) printf("ERROR: %s\n", arg);
+		const char *lci = NULL;
+		while ((token = nexttoken(&rest)) != NULL) {
+			if (_strnicmp(token, "lci=", 4) == 0) lci = token + 4;
+			else if (strncmp(token, "opclass=", 8) == 0) {
+				if (sscanf_s(token + 8, "%d", &ap->opclass) < 1) printf("ERROR: line %d: %s\n", lineno, token);
+			}
+			else if (strncmp(token, "channel=", 8) == 0) {
+				if (sscanf_s(token + 8, "%d", &ap->channel) < 1) printf("ERROR: line %d: %s\n", lineno, token);
+			}
+			else if (strncmp(token, "phytype=", 8) == 0) {
+				if (sscanf_s(token + 8, "%d", &ap->phytype) < 1) printf("ERROR: line %d: %s\n", lineno, token);
+			}
+			else if (strncmp(token, "bssidinfo=", 10) == 0) {
+				if (sscanf_s(token + 10, "%x", &ap->bssidinfo) < 1) printf("ERROR: line %d: %s\n", lineno, token);
+			}
+			else if (lci == NULL && ishexstring(token)) lci = token;	// bare LCI string
+			else printf("ERROR: line %d: %s\n", lineno, token);
 		}
-		else if (strncmp(arg, "-altunc=", 8) == 0) {	// in meters
-			if (sscanf_s(arg + 8, "%lg", &altitude_uncertainty) < 1) printf("ERROR: %s\n", arg);
+		if (lci == NULL || ! ishexstring(lci)) {
+			printf("ERROR: line %d: missing or invalid LCI string\n", lineno);
+			continue;
 		}
-//		parameters for construction of Z subelement 
-		else if (strncmp(arg, "-floor=", 7) == 0) {	// need not be integer
-			if (sscanf_s(arg + 7, "%lg", &sta_floor) < 1) printf("ERROR: %s\n", arg);
+		char *str = (char *) strndup(lci, strlen(lci));
+		for (char *s = str; *s != '\0'; s++) {
+			if (*s >= 'A' && *s <= 'F') *s += 'a' - 'A';
 		}
-		else if (strncmp(arg, "-height=", 8) == 0) { 
-			if (sscanf_s(arg + 8, "%lg", &sta_height_above_floor) < 1) printf("ERROR: %s\n", arg);
+		ap->lci = str;
+		formatBSSID(ap->name, ap->bssid);
+		if (traceflag) printf("line %d BSSID %s\n", lineno, ap->name);
+		diagnostics = 0;
+		decodeLciRecord(ap->lci, &defaults, &ap->rec);
+		ap->diag = diagnostics;
+		n++;
+	}
+	fclose(fp);
+	verboseflag = oldverboseflag;
+	loadLciRecord(&defaults);	// leave global variables as they were
+	*nfleet = n;
+	return fleet;
+}
+
+void freeFleet (FleetAP *fleet, int nfleet) {
+	if (fleet == NULL) return;
+	for (int k = 0; k < nfleet; k++) {
+		free(fleet[k].lci);
+		free(fleet[k].nr);
+	}
+	free(fleet);
+}
+
+int getnthreads (void) {	// number of worker threads to use
+	if (nthreads > 0) return nthreads;
+	int n = (int) std::thread::hardware_concurrency();
+	return (n > 0) ? n : 1;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Neighbor reports: each AP advertises its k nearest peers (including their LCI)
+
+#define EARTH_RADIUS 6371008.8	// mean radius (m)
+
+#define DEGREES_TO_RADIANS (3.14159265358979323846 / 180.0)
+
+double apheight (const LciRecord *rec) {	// height (m) of AP, with floors stacked floorheight apart
+	switch (rec->Altitude_Type) {
+		case ALTITUDE_METERS:
+		case ALTITUDE_ABOVE_GROUND: return rec->altitude;
+		case ALTITUDE_FLOORS: return rec->altitude * floorheight;
+		default: return rec->sta_floor * floorheight + rec->sta_height_above_floor;	// use Z subelement
+	}
+}
+
+// Place fleet in a local east/north/up frame (m) centered on the fleet
+// (a flat earth approximation --- good enough at the scale of a campus)
+
+void fleetcoordinates (FleetAP *fleet, int nfleet) {
+	double lat0 = 0, lon0 = 0;
+	for (int k = 0; k < nfleet; k++) {
+		lat0 += fleet[k].rec.latitude;
+		lon0 += fleet[k].rec.longitude;
+	}
+	lat0 /= nfleet;
+	lon0 /= nfleet;
+	double scale = EARTH_RADIUS * DEGREES_TO_RADIANS;	// m per degree (of latitude)
+	double coslat0 = cos(lat0 * DEGREES_TO_RADIANS);
+	for (int k = 0; k < nfleet; k++) {
+		fleet[k].xyz[0] = (fleet[k].rec.longitude - lon0) * scale * coslat0;
+		fleet[k].xyz[1] = (fleet[k].rec.latitude - lat0) * scale;
+		fleet[k].xyz[2] = apheight(&fleet[k].rec);
+	}
+}
+
+// Spatial index: a balanced k-d tree stored implicitly in an array --- the node for the
+// range [lo, hi) sits at its middle, (lo + hi) / 2, with its two subtrees on either side.
+
+struct KdTree {
+	int n;
+	int *perm;				// fleet index of node
+	double (*pt)[3];		// coordinates of node (copied here for locality)
+	unsigned char *axis;	// splitting axis of node
+};
+
+void kdbuild (KdTree *tree, const FleetAP *fleet, int lo, int hi) {
+	if (hi - lo <= 0) return;
+	double lower[3], upper[3];
+	for (int a = 0; a < 3; a++) lower[a] = upper[a] = fleet[tree->perm[lo]].xyz[a];
+	for (int k = lo + 1; k < hi; k++) {
+		for (int a = 0; a < 3; a++) {
+			double val = fleet[tree->perm[k]].xyz[a];
+			if (val < lower[a]) lower[a] = val;
+			if (val > upper[a]) upper[a] = val;
+		}
+	}
+	int ax = 0;		// split along axis with widest extent
+	for (int a = 1; a < 3; a++) {
+		if (upper[a] - lower[a] > upper[ax] - lower[ax]) ax = a;
+	}
+	int mid = (lo + hi) / 2;
+	std::nth_element(tree->perm + lo, tree->perm + mid, tree->perm + hi,
+		[fleet, ax](int i, int j) { return fleet[i].xyz[ax] < fleet[j].xyz[ax]; });
+	tree->axis[mid] = (unsigned char)ax;
+	kdbuild(tree, fleet, lo, mid);
+	kdbuild(tree, fleet, mid + 1, hi);
+}
+
+void makeKdTree (KdTree *tree, const FleetAP *fleet, int nfleet) {
+	tree->n = nfleet;
+	tree->perm = (int *) malloc(nfleet * sizeof(int));
+	tree->pt = (double (*)[3]) malloc(nfleet * sizeof(double[3]));
+	tree->axis = (unsigned char *) malloc(nfleet);
+	if (tree->perm == NULL || tree->pt == NULL || tree->axis == NULL) exit(1);
+	for (int k = 0; k < nfleet; k++) tree->perm[k] = k;
+	kdbuild(tree, fleet, 0, nfleet);
+	for (int k = 0; k < nfleet; k++) {
+		for (int a = 0; a < 3; a++) tree->pt[k][a] = fleet[tree->perm[k]].xyz[a];
+	}
+}
+
+void freeKdTree (KdTree *tree) {
+	free(tree->perm);
+	free(tree->pt);
+	free(tree->axis);
+}
+
+struct KdNearest {		// nearest candidates found so far, sorted by distance
+	int k, count;
+	int *indx;
+	double *dist2;
+};
+
+void kdinsert (KdNearest *best, int indx, double dist2) {
+	if (best->count == best->k && dist2 >= best->dist2[best->count - 1]) return;
+	int j = (best->count < best->k) ? best->count++ : best->count - 1;
+	for (; j > 0 && best->dist2[j - 1] > dist2; j--) {
+		best->indx[j] = best->indx[j - 1];
+		best->dist2[j] = best->dist2[j - 1];
+	}
+	best->indx[j] = indx;
+	best->dist2[j] = dist2;
+}
+
+// k nearest neighbors of point q, excluding fleet index self
+
+void kdsearch (const KdTree *tree, int lo, int hi, const double *q, int self, KdNearest *best) {
+	if (hi - lo <= 0) return;
+	int mid = (lo + hi) / 2;
+	const double *p = tree->pt[mid];
+	if (tree->perm[mid] != self) {
+		double dx = p[0] - q[0], dy = p[1] - q[1], dz = p[2] - q[2];
+		kdinsert(best, tree->perm[mid], dx * dx + dy * dy + dz * dz);
+	}
+	int ax = tree->axis[mid];
+	double diff = q[ax] - p[ax];
+	int nearlo = (diff < 0) ? lo : mid + 1, nearhi = (diff < 0) ? mid : hi;
+	int farlo = (diff < 0) ? mid + 1 : lo, farhi = (diff < 0) ? hi : mid;
+	kdsearch(tree, nearlo, nearhi, q, self, best);
+	if (best->count < best->k || diff * diff < best->dist2[best->count - 1])
+		kdsearch(tree, farlo, farhi, q, self, best);
+}
+
+// find k nearest neighbors for APs lo to hi-1 (one worker thread's share)
+
+void findneighbors (const KdTree *tree, const FleetAP *fleet, int lo, int hi, int k, int *neighbors) {
+	KdNearest best;
+	best.k = k;
+	best.indx = (int *) malloc(k * sizeof(int));
+	best.dist2 = (double *) malloc(k * sizeof(double));
+	if (best.indx == NULL || best.dist2 == NULL) exit(1);
+	for (int i = lo; i < hi; i++) {
+		best.count = 0;
+		kdsearch(tree, 0, tree->n, fleet[i].xyz, i, &best);
+		for (int j = 0; j < k; j++) neighbors[i * k + j] = (j < best.count) ? best.indx[j] : -1;
+	}
+	free(best.indx);
+	free(best.dist2);
+}
+
+#define NR_MEASUREMENT_REPORT 39	// Neighbor Report subelement ID for Measurement Report
+
+// Neighbor Report element body (as in hostapd SET_NEIGHBOR ... nr=...): BSSID, BSSID Information,
+// Operating Class, Channel Number, PHY Type, then Measurement Report subelement holding the LCI.
+// Note: the LCI string already starts with Measurement Token, Mode and Type, so it is used as is.
+
+void makeNeighborReport (FleetAP *ap) {
+	int lcibytes = strlen(ap->lci) / 2;
+	int fits = (lcibytes <= 255);
+	if (! fits) printf("ERROR: LCI of %s too long (%d octets) for neighbor report\n", ap->name, lcibytes);
+	int nbyt = 6 + 4 + 3 + (fits ? 2 + lcibytes : 0);
+	char *str = (char *) malloc(nbyt*2 + 1);
+	if (str == NULL) exit(1);
+	int k = 0;
+	for (int i = 0; i < 6; i++) k = putoctet(str, k, ap->bssid[i]);
+	for (int i = 0; i < 4; i++) k = putoctet(str, k, (ap->bssidinfo >> (i*8)) & 0xFF);	// little-endian
+	k = putoctet(str, k, ap->opclass & 0xFF);
+	k = putoctet(str, k, ap->channel & 0xFF);
+	k = putoctet(str, k, ap->phytype & 0xFF);
+	if (fits) {
+		k = putoctet(str, k, NR_MEASUREMENT_REPORT);
+		k = putoctet(str, k, lcibytes);
+		memcpy(str + k*2, ap->lci, lcibytes*2);
+		k += lcibytes;
+	}
+	str[k*2] = '\0';
+	ap->nr = str;
+}
+
+// For each AP in fleet file, print a line "AP neighbor nr=..." for each of its nearest neighbors
+
+void neighborreports (const char *filename) {
+	int nfleet;
+	FleetAP *fleet = readFleet(filename, &nfleet);
+	if (verboseflag) printf("# %d APs in %s\n", nfleet, filename);
+	int k = (nearestk < nfleet - 1) ? nearestk : nfleet - 1;
+	if (k <= 0) {
+		freeFleet(fleet, nfleet);
+		return;
+	}
+	fleetcoordinates(fleet, nfleet);
+	for (int i = 0; i < nfleet; i++) makeNeighborReport(&fleet[i]);	// once per AP, not per pair
+	KdTree tree;
+	makeKdTree(&tree, fleet, nfleet);
+	int *neighbors = (int *) malloc(nfleet * k * sizeof(int));
+	if (neighbors == NULL) exit(1);
+	int nworkers = getnthreads();
+	if (nworkers > nfleet) nworkers = nfleet;
+	std::thread *workers = new std::thread[nworkers];
+	for (int t = 0; t < nworkers; t++) {
+		int lo = (int)((long long)nfleet * t / nworkers), hi = (int)((long long)nfleet * (t + 1) / nworkers);
+		workers[t] = std::thread(findneighbors, &tree, fleet, lo, hi, k, neighbors);
+	}
+	for (int t = 0; t < nworkers; t++) workers[t].join();
+	delete [] workers;
+	for (int i = 0; i < nfleet; i++) {
+		for (int j = 0; j < k; j++) {
+			int nb = neighbors[i * k + j];
+			if (nb >= 0) printf("%s %s nr=%s\n", fleet[i].name, fleet[nb].name, fleet[nb].nr);
+		}
+	}
+	free(neighbors);
+	freeKdTree(&tree);
+	freeFleet(fleet, nfleet);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Memoizing cache for encoding and decoding: keys are the packed record or the normalized
+// LCI string (after the fingerprint of the settings, which affect the result); values are
+// the LCI string or the packed record, along with the diagnostics produced the first time.
+
+// The cache is split into shards (each with its own lock, used only by writers), and is
+// set associative within a shard --- CACHE_WAYS slots per bucket, with CLOCK replacement.
+// Readers take no locks: each slot has a sequence counter that is odd while the slot is
+// being written, and a reader retries (misses) if the counter changed while it was copying.
+
+#define CACHE_SHARDS 64		// (top 6 bits of hash select shard)
+#define CACHE_WAYS 8
+#define CACHE_DATA 1000		// bytes for key plus value in a slot
+
+struct CacheSlot {
+	std::atomic<unsigned int> seq;			// odd while slot is being written
+	std::atomic<unsigned char> referenced;	// CLOCK bit, set by hits
+	std::atomic<unsigned short> keylen, vallen;
+	std::atomic<unsigned long long> hash;	// 0 => empty
+	char data[CACHE_DATA];					// key followed by value
+};
+
+struct alignas(64) CacheShard {
+	std::mutex lock;		// held by writers
+	CacheSlot *slots;		// nbuckets * CACHE_WAYS
+	unsigned char *hand;	// CLOCK hand of each bucket
+	std::atomic<long long> hits, misses, evictions;
+};
+
+CacheShard cacheshards[CACHE_SHARDS];
+
+int cachebuckets = 0;	// buckets per shard (0 => cache not in use)
+
+// 64 bit hash of byte string (never 0, which marks empty slots)
+
+unsigned long long hashbytes (const void *data, int nlen) {
+	const unsigned char *str = (const unsigned char *) data;
+	unsigned long long h = 0x9E3779B97F4A7C15ULL ^ (unsigned long long) nlen;
+	unsigned long long w;
+	for (; nlen >= 8; str += 8, nlen -= 8) {
+		memcpy(&w, str, 8);
+		h = (h ^ w) * 0xFF51AFD7ED558CCDULL;
+		h ^= h >> 32;
+	}
+	w = 0;
+	memcpy(&w, str, nlen);
+	h = (h ^ w) * 0xC4CEB9FE1A85EC53ULL;
+	h ^= h >> 29;
+	h *= 0xFF51AFD7ED558CCDULL;
+	h ^= h >> 32;
+	return (h != 0) ? h : 1;
+}
+
+void makeCache (int megabytes) {
+	long long nslots = ((long long) megabytes << 20) / sizeof(CacheSlot);
+	cachebuckets = (int)(nslots / (CACHE_SHARDS * CACHE_WAYS));
+	if (cachebuckets < 1) cachebuckets = 1;
+	for (int s = 0; s < CACHE_SHARDS; s++) {
+		CacheShard *shard = &cacheshards[s];
+		// Note: all zero is a valid (empty) state for slots, so calloc is enough
+		shard->slots = (CacheSlot *) calloc((size_t) cachebuckets * CACHE_WAYS, sizeof(CacheSlot));
+		shard->hand = (unsigned char *) calloc(cachebuckets, 1);
+		if (shard->slots == NULL || shard->hand == NULL) exit(1);
+		shard->hits = shard->misses = shard->evictions = 0;
+	}
+	if (debugflag) printf("Cache of %d MB: %d shards of %d buckets of %d slots\n",
+						  megabytes, CACHE_SHARDS, cachebuckets, CACHE_WAYS);
+}
+
+void freeCache (void) {
+	if (cachebuckets == 0) return;
+	for (int s = 0; s < CACHE_SHARDS; s++) {
+		free(cacheshards[s].slots);
+		free(cacheshards[s].hand);
+		cacheshards[s].slots = NULL;
+		cacheshards[s].hand = NULL;
+	}
+	cachebuckets = 0;
+}
+
+// look up key --- copies value into val and returns its length, or returns -1 if not found
+
+int cachelookup (unsigned long long hash, const char *key, int keylen, char *val, int maxlen) {
+	CacheShard *shard = &cacheshards[hash >> 58];
+	CacheSlot *bucket = shard->slots + (hash % cachebuckets) * CACHE_WAYS;
+	for (int w = 0; w < CACHE_WAYS; w++) {
+		CacheSlot *slot = &bucket[w];
+		if (slot->hash.load(std::memory_order_acquire) != hash) continue;
+		unsigned int seq = slot->seq.load(std::memory_order_acquire);
+		if (seq & 1) continue;	// being written right now
+		int klen = slot->keylen.load(std::memory_order_relaxed);
+		int vlen = slot->vallen.load(std::memory_order_relaxed);
+		int found = (klen == keylen && vlen <= maxlen && klen + vlen <= CACHE_DATA &&
+					 memcmp(slot->data, key, keylen) == 0);
+		if (found) memcpy(val, slot->data + keylen, vlen);
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (! found || slot->seq.load(std::memory_order_relaxed) != seq) continue;
+		if (! slot->referenced.load(std::memory_order_relaxed))	// avoid needless writes
+			slot->referenced.store(1, std::memory_order_relaxed);
+		shard->hits.fetch_add(1, std::memory_order_relaxed);
+		return vlen;
+	}
+	shard->misses.fetch_add(1, std::memory_order_relaxed);
+	return -1;
+}
+
+void cacheinsert (unsigned long long hash, const char *key, int keylen, const char *val, int vallen) {
+	if (keylen + vallen > CACHE_DATA) return;	// too big to cache
+	CacheShard *shard = &cacheshards[hash >> 58];
+	int nbucket = (int)(hash % cachebuckets);
+	CacheSlot *bucket = shard->slots + (long long) nbucket * CACHE_WAYS;
+	std::lock_guard<std::mutex> guard(shard->lock);
+	int victim = -1;
+	for (int w = 0; w < CACHE_WAYS; w++) {
+		unsigned long long h = bucket[w].hash.load(std::memory_order_relaxed);
+		if (h == hash && bucket[w].keylen.load(std::memory_order_relaxed) == keylen &&
+			memcmp(bucket[w].data, key, keylen) == 0) return;	// someone else got here first
+		if (h == 0 && victim < 0) victim = w;
+	}
+	if (victim < 0) {	// CLOCK: give recently used slots a second chance
+		for (;;) {
+			int w = shard->hand[nbucket];
+			shard->hand[nbucket] = (unsigned char)((w + 1) % CACHE_WAYS);
+			if (bucket[w].referenced.load(std::memory_order_relaxed))
+				bucket[w].referenced.store(0, std::memory_order_relaxed);
+			else {
+				victim = w;
+				break;
+			}
+		}
+		shard->evictions.fetch_add(1, std::memory_order_relaxed);
+	}
+	CacheSlot *slot = &bucket[victim];
+	unsigned int seq = slot->seq.load(std::memory_order_relaxed);
+	slot->seq.store(seq + 1, std::memory_order_relaxed);	// odd: readers stay away
+	std::atomic_thread_fence(std::memory_order_release);
+	slot->hash.store(hash, std::memory_order_relaxed);
+	slot->keylen.store((unsigned short) keylen, std::memory_order_relaxed);
+	slot->vallen.store((unsigned short) vallen, std::memory_order_relaxed);
+	memcpy(slot->data, key, keylen);
+	memcpy(slot->data + keylen, val, vallen);
+	slot->referenced.store(0, std::memory_order_relaxed);
+	slot->seq.store(seq + 2, std::memory_order_release);
+}
+
+void cachestats (long long *hits, long long *misses, long long *evictions) {
+	*hits = *misses = *evictions = 0;
+	for (int s = 0; s < CACHE_SHARDS; s++) {
+		*hits += cacheshards[s].hits.load(std::memory_order_relaxed);
+		*misses += cacheshards[s].misses.load(std::memory_order_relaxed);
+		*evictions += cacheshards[s].evictions.load(std::memory_order_relaxed);
+	}
+}
+
+void showcachestats (void) {
+	long long hits, misses, evictions;
+	cachestats(&hits, &misses, &evictions);
+	long long total = hits + misses;
+	printf("# cache: %lld hits %lld misses %lld evictions (%.1f%% hit rate)\n",
+		   hits, misses, evictions, total > 0 ? 100.0 * hits / total : 0.0);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Request coalescing (server only): when several threads miss in the caches on the same key
+// at the same time, one of them (the leader) does the work and the others wait for it, then
+// read the result from the leader's buffer, which is freed when the last of them is done.
+
+#define FLIGHT_BUCKETS 16		// per shard (flights in progress are few)
+
+struct Flight {
+	Flight *next;
+	unsigned long long hash;
+	std::atomic<int> refs;		// leader's, plus one per waiter
+	int done;					// (under shard lock)
+	int keylen, vallen;			// (vallen < 0 => leader gave up)
+	char data[CACHE_DATA];		// key followed by value
+};
+
+struct alignas(64) FlightShard {
+	std::mutex lock;
+	std::condition_variable landed;
+	Flight *buckets[FLIGHT_BUCKETS];
+};
+
+FlightShard flightshards[CACHE_SHARDS];
+int coalesceflag = 0;			// (set by server)
+std::atomic<long long> coalesced(0);
+
+// Join computation of key --- returns NULL if caller is to compute it (and then call
+// landflight with *mine), otherwise returns the finished flight (call dropflight when done)
+
+Flight *joinflight (unsigned long long hash, const char *key, int keylen, Flight **mine) {
+	*mine = NULL;
+	FlightShard *shard = &flightshards[hash >> 58];
+	Flight **bucket = &shard->buckets[(hash >> 32) % FLIGHT_BUCKETS];
+	std::unique_lock<std::mutex> guard(shard->lock);
+	for (Flight *flight = *bucket; flight != NULL; flight = flight->next) {
+		if (flight->hash != hash || flight->keylen != keylen || memcmp(flight->data, key, keylen) != 0) continue;
+		flight->refs++;
+		while (! flight->done) shard->landed.wait(guard);
+		coalesced++;
+		return flight;
+	}
+	Flight *flight = new Flight;
+	flight->refs = 1;
+	flight->hash = hash;
+	flight->done = 0;
+	flight->keylen = keylen;
+	flight->vallen = -1;
+	memcpy(flight->data, key, keylen);
+	flight->next = *bucket;
+	*bucket = flight;
+	*mine = flight;
+	return NULL;
+}
+
+void dropflight (Flight *flight) {
+	if (flight->refs.fetch_sub(1) == 1) delete flight;
+}
+
+// leader: publish value (vallen < 0 if there is none) and wake up waiters
+
+void landflight (Flight *flight, const char *val, int vallen) {
+	FlightShard *shard = &flightshards[flight->hash >> 58];
+	if (vallen > CACHE_DATA - flight->keylen) vallen = -1;
+	if (vallen > 0) memcpy(flight->data + flight->keylen, val, vallen);
+	{
+		std::lock_guard<std::mutex> guard(shard->lock);
+		flight->vallen = vallen;
+		flight->done = 1;
+		Flight **prev = &shard->buckets[(flight->hash >> 32) % FLIGHT_BUCKETS];
+		while (*prev != flight) prev = &(*prev)->next;
+		*prev = flight->next;		// (later requests find it in cache)
+	}
+	shard->landed.notify_all();
+	dropflight(flight);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Memory mapped files
+
+struct MappedFile {
+	char *base;
+	long long size;
+#ifdef _WIN32
+	HANDLE file, mapping;
+#else
+	int fd;
+#endif
+};
+
+// map file for reading and writing, creating it or extending it to (at least) size bytes
+// (size 0 => use existing file as is); exclusive => first lock it against other processes
+// doing the same (until unmapped) --- returns 0 on failure, -1 if another process has it
+
+int mapfile (MappedFile *map, const char *filename, long long size, int exclusive) {
+	memset(map, 0, sizeof(MappedFile));
+#ifdef _WIN32
+	map->file = CreateFileA(filename, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+							NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (map->file == INVALID_HANDLE_VALUE) return 0;
+	OVERLAPPED overlapped;
+	memset(&overlapped, 0, sizeof(overlapped));
+	overlapped.Offset = 0xFFFFFFFF;		// (lock a byte far past the end, so as not to stop reading)
+	overlapped.OffsetHigh = 0x7FFFFFFF;
+	if (exclusive && ! LockFileEx(map->file, LOCKFILE_EXCLUSIVE_LOCK | LOCKFILE_FAIL_IMMEDIATELY, 0, 1, 0, &overlapped) &&
+		GetLastError() == ERROR_LOCK_VIOLATION) {
+		CloseHandle(map->file);
+		return -1;
+	}
+	LARGE_INTEGER filesize;
+	GetFileSizeEx(map->file, &filesize);
+	if (size < filesize.QuadPart) size = filesize.QuadPart;
+	if (size == 0) {
+		CloseHandle(map->file);
+		return 0;
+	}
+	map->mapping = CreateFileMappingA(map->file, NULL, PAGE_READWRITE,
+									  (DWORD)(size >> 32), (DWORD)(size & 0xFFFFFFFF), NULL);
+	if (map->mapping == NULL) {
+		CloseHandle(map->file);
+		return 0;
+	}
+	map->base = (char *) MapViewOfFile(map->mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+	if (map->base == NULL) {
+		CloseHandle(map->mapping);
+		CloseHandle(map->file);
+		return 0;
+	}
+#else
+	map->fd = open(filename, O_RDWR | O_CREAT, 0644);
+	if (map->fd < 0) return 0;
+	if (exclusive && flock(map->fd, LOCK_EX | LOCK_NB) != 0 && errno == EWOULDBLOCK) {	// (else no locking there)
+		close(map->fd);
+		return -1;
+	}
+	struct stat st;
+	if (fstat(map->fd, &st) != 0) st.st_size = 0;
+	if (size < st.st_size) size = st.st_size;
+	if (size == 0 || (size > st.st_size && ftruncate(map->fd, size) != 0)) {	// (sparse)
+		close(map->fd);
+		return 0;
+	}
+	map->base = (char *) mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, map->fd, 0);
+	if (map->base == (char *) MAP_FAILED) {
+		close(map->fd);
+		return 0;
+	}
+#endif
+	map->size = size;
+	return 1;
+}
+
+void unmapfile (MappedFile *map) {
+	if (map->base == NULL) return;
+#ifdef _WIN32
+	UnmapViewOfFile(map->base);
+	CloseHandle(map->mapping);
+	CloseHandle(map->file);
+#else
+	munmap(map->base, map->size);
+	close(map->fd);
+#endif
+	map->base = NULL;
+}
+
+// put finished file tempname in place of filename (readers see old file or new, never a part
+// written one; ones that have the old file mapped keep it) --- returns 0 on failure
+
+int replacefile (const char *tempname, const char *filename) {
+#ifdef _WIN32
+	return MoveFileExA(tempname, filename, MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+	return rename(tempname, filename) == 0;
+#endif
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Persistent decode cache: an open addressing hash table (linear probing) in a memory mapped
+// file, so a restarted process has all earlier decoding results at hand right away.
+// Layout: header, table of slots (hash and offset of entry), then data area of entries
+// (key length, value length, key, value) --- keys and values are as for the memory cache.
+// Entries are only ever added: an entry is written at the end of the data area, then the
+// end of data is advanced, and only then is a slot pointed at it, setting the hash last.
+// A crash at any point leaves at worst some unused space, never a slot with a bad entry.
+// NOTE: writers within one process are serialized; the file is locked while in use, so only one
+// process has it (any other goes without).
+
+#define PERSIST_MAGIC "LCICACHE"
+#define PERSIST_VERSION 3	// (bump whenever decoding gives different records --- older files start afresh)
+#define PERSIST_BYTEORDER 0x01020304
+
+struct PersistHeader {
+	char magic[8];
+	unsigned int version;
+	unsigned int byteorder;			// PERSIST_BYTEORDER as written by machine that made file
+	unsigned int recordsize;		// PACKED_RECORD_MAX (changes when record layout changes)
+	unsigned int reserved;
+	unsigned long long nslots;		// (power of two)
+	unsigned long long slotstart;	// offset of table of slots
+	unsigned long long datastart;	// offset of data area
+	unsigned long long dataend;		// end of data area
+	std::atomic<unsigned long long> used;	// end of data written so far
+	std::atomic<unsigned long long> count;	// number of entries
+};
+
+struct PersistSlot {
+	std::atomic<unsigned long long> hash;	// 0 => empty (written last)
+	std::atomic<unsigned long long> offset;	// of entry in file
+};
+
+struct PersistEntry {	// followed by key and value (padded to multiple of 8 bytes)
+	unsigned int keylen, vallen;
+};
+
+MappedFile persistmap;
+PersistHeader *persistcache = NULL;		// (NULL => not in use)
+std::mutex persistlock;					// held by writers
+std::atomic<long long> persisthits(0), persistmisses(0);
+
+PersistSlot INLINE *persistslots (void) {
+	return (PersistSlot *)((char *) persistcache + persistcache->slotstart);
+}
+
+void initPersist (PersistHeader *header, long long filesize) {
+	memset((void *) header, 0, sizeof(PersistHeader));
+	unsigned long long nslots = 1;	// slot table gets about 1/8 of file
+	while (nslots * 2 * sizeof(PersistSlot) <= (unsigned long long) filesize / 8) nslots *= 2;
+	header->version = PERSIST_VERSION;
+	header->byteorder = PERSIST_BYTEORDER;
+	header->recordsize = PACKED_RECORD_MAX;
+	header->nslots = nslots;
+	header->slotstart = (sizeof(PersistHeader) + 63) & ~63ULL;
+	header->datastart = header->slotstart + nslots * sizeof(PersistSlot);
+	header->dataend = filesize;
+	header->used = header->datastart;
+	header->count = 0;
+	memset((char *) header + header->slotstart, 0, nslots * sizeof(PersistSlot));
+	memcpy(header->magic, PERSIST_MAGIC, 8);	// last, marks file as complete
+}
+
+// do regions header describes fit in file of size bytes ? (the file may be damaged)
+
+int persistlayoutok (const PersistHeader *header, long long size) {
+	unsigned long long filesize = (unsigned long long) size, nslots = header->nslots;
+	if (nslots == 0 || (nslots & (nslots - 1)) != 0) return 0;
+	if (header->slotstart < sizeof(PersistHeader) || header->slotstart > filesize ||
+		nslots > (filesize - header->slotstart) / sizeof(PersistSlot)) return 0;
+	unsigned long long used = header->used.load(), count = header->count.load();
+	return header->datastart >= header->slotstart + nslots * sizeof(PersistSlot) &&
+		   header->datastart <= used && used <= header->dataend && header->dataend <= filesize && count <= nslots;
+}
+
+int openPersist (const char *filename, int megabytes) {
+	FILE *fp;
+	if (fopen_s(&fp, filename, "rb") == 0) {	// check existing file before extending it
+		char magic[8];
+		int nlen = (int) fread(magic, 1, 8, fp);
+		fclose(fp);
+		if (nlen > 0 && (nlen < 8 || memcmp(magic, PERSIST_MAGIC, 8) != 0)) {
+			printf("ERROR: %s is not a decode cache file\n", filename);
+			return 0;
+		}
+	}
+	int mapped = mapfile(&persistmap, filename, (long long) megabytes << 20, 1);
+	if (mapped < 0) {		// (so it is never started afresh under another process)
+		printf("WARNING: decode cache file %s is in use by another process --- not using it\n", filename);
+		return 0;
+	}
+	if (! mapped) {
+		printf("ERROR: unable to map decode cache file %s\n", filename);
+		return 0;
+	}
+	PersistHeader *header = (PersistHeader *) persistmap.base;
+	if (memcmp(header->magic, PERSIST_MAGIC, 8) != 0) initPersist(header, persistmap.size);	// new file
+	else if (header->version != PERSIST_VERSION || header->byteorder != PERSIST_BYTEORDER ||
+			 header->recordsize != PACKED_RECORD_MAX || ! persistlayoutok(header, persistmap.size)) {
+		printf("WARNING: decode cache file %s has a different layout --- starting afresh\n", filename);
+		memset(header->magic, 0, 8);
+		initPersist(header, persistmap.size);
+	}
+	persistcache = header;
+	if (verboseflag) printf("# decode cache %s: %llu entries\n", filename, header->count.load());
+	return 1;
+}
+
+void closePersist (void) {
+	if (persistcache == NULL) return;
+	unmapfile(&persistmap);
+	persistcache = NULL;
+}
+
+// look up key --- copies value into val and returns its length, or returns -1 if not found
+
+int persistlookup (unsigned long long hash, const char *key, int keylen, char *val, int maxlen) {
+	PersistSlot *slots = persistslots();
+	unsigned long long mask = persistcache->nslots - 1;
+	unsigned long long used = persistcache->used.load(std::memory_order_acquire);
+	for (unsigned long long i = hash & mask, probe = 0; probe <= mask; i = (i + 1) & mask, probe++) {
+		unsigned long long h = slots[i].hash.load(std::memory_order_acquire);
+		if (h == 0) break;	// not present
+		if (h != hash) continue;
+		unsigned long long offset = slots[i].offset.load(std::memory_order_relaxed);
+		if (offset < persistcache->datastart || offset + sizeof(PersistEntry) > used) continue;
+		const PersistEntry *entry = (const PersistEntry *)((char *) persistcache + offset);
+		const char *data = (const char *)(entry + 1);
+		if ((int) entry->keylen != keylen || (int) entry->vallen > maxlen ||
+			offset + sizeof(PersistEntry) + entry->keylen + entry->vallen > used ||
+			memcmp(data, key, keylen) != 0) continue;
+		memcpy(val, data + keylen, entry->vallen);
+		persisthits.fetch_add(1, std::memory_order_relaxed);
+		return entry->vallen;
+	}
+	persistmisses.fetch_add(1, std::memory_order_relaxed);
+	return -1;
+}
+
+void persistinsert (unsigned long long hash, const char *key, int keylen, const char *val, int vallen) {
+	std::lock_guard<std::mutex> guard(persistlock);
+	PersistHeader *header = persistcache;
+	if (header->count.load() >= header->nslots / 4 * 3) return;		// (table full enough)
+	unsigned long long offset = header->used.load(std::memory_order_relaxed);
+	unsigned long long nlen = (sizeof(PersistEntry) + keylen + vallen + 7) & ~7ULL;
+	if (offset + nlen > header->dataend) return;	// (data area full)
+	PersistSlot *slots = persistslots();
+	unsigned long long mask = header->nslots - 1, i = hash & mask;
+	for (;; i = (i + 1) & mask) {	// (terminates since table is never full)
+		unsigned long long h = slots[i].hash.load(std::memory_order_relaxed);
+		if (h == 0) break;
+		if (h != hash) continue;
+		unsigned long long at = slots[i].offset.load(std::memory_order_relaxed);
+		if (at < header->datastart || at + sizeof(PersistEntry) + keylen > offset) continue;	// (damaged)
+		const PersistEntry *entry = (const PersistEntry *)((char *) header + at);
+		if ((int) entry->keylen == keylen && memcmp(entry + 1, key, keylen) == 0) return;	// present
+	}
+	PersistEntry *entry = (PersistEntry *)((char *) header + offset);	// (1) append
+	entry->keylen = keylen;
+	entry->vallen = vallen;
+	memcpy((char *)(entry + 1), key, keylen);
+	memcpy((char *)(entry + 1) + keylen, val, vallen);
+	header->used.store(offset + nlen, std::memory_order_release);		// (2) extend data
+	slots[i].offset.store(offset, std::memory_order_relaxed);			// (3) publish
+	slots[i].hash.store(hash, std::memory_order_release);
+	header->count.fetch_add(1);
+}
+
+void showpersiststats (void) {
+	long long hits = persisthits.load(), misses = persistmisses.load();
+	printf("# decode cache file: %lld hits %lld misses (%.1f%% hit rate) %llu entries\n", hits, misses,
+		   (hits + misses) > 0 ? 100.0 * hits / (hits + misses) : 0.0, persistcache->count.load());
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Decode LCI string into record (starting from defaults) --- using caches if in use.
+// Returns diagnostics found while decoding.
+// NOTE: defaults must be the ones codecprofilekey was made from (see applyprofile)
+
+int cachedDecode (const char *str, const LciRecord *defaults, LciRecord *rec) {
+	char key[CACHE_DATA];
+	unsigned char val[4 + PACKED_RECORD_MAX];
+	int slen = strlen(str);
+	int keylen = 5 + slen;
+	if ((cachebuckets == 0 && persistcache == NULL && ! coalesceflag) || keylen + (int)sizeof(val) > CACHE_DATA) {
+		diagnostics = 0;
+		decodeLciRecord(str, defaults, rec);
+		return diagnostics;
+	}
+	key[0] = 'D';
+	memcpy(key + 1, &codecprofilekey, 4);	// (defaults fill in what string lacks)
+	for (int k = 0; k < slen; k++) {	// normalize to lower case
+		int c = str[k];
+		key[k+5] = (char)((c >= 'A' && c <= 'F') ? c + 'a' - 'A' : c);
+	}
+	unsigned long long hash = hashbytes(key, keylen);
+	int vlen = -1, diag;
+	if (cachebuckets > 0) vlen = cachelookup(hash, key, keylen, (char *) val, sizeof(val));
+	if (vlen < 0 && persistcache != NULL) vlen = persistlookup(hash, key, keylen, (char *) val, sizeof(val));
+	if (vlen > 4 && unpackLciRecord(rec, val + 4, vlen - 4) > 0) {
+		memcpy(&diag, val, 4);
+		return diag;
+	}
+	Flight *flight = NULL;
+	if (coalesceflag) {		// someone else already decoding it ?
+		Flight *done = joinflight(hash, key, keylen, &flight);
+		if (done != NULL) {
+			const unsigned char *dval = (const unsigned char *) done->data + keylen;
+			int ok = (done->vallen > 4 && unpackLciRecord(rec, dval + 4, done->vallen - 4) > 0);
+			if (ok) memcpy(&diag, dval, 4);
+			dropflight(done);
+			if (ok) return diag;
+		}
+	}
+	diagnostics = 0;
+	decodeLciRecord(str, defaults, rec);
+	diag = diagnostics;
+	memcpy(val, &diag, 4);
+	vlen = 4 + packLciRecord(rec, val + 4);
+	if (cachebuckets > 0) cacheinsert(hash, key, keylen, (const char *) val, vlen);
+	if (persistcache != NULL) persistinsert(hash, key, keylen, (const char *) val, vlen);
+	if (flight != NULL) landflight(flight, (const char *) val, vlen);
+	return diag;
+}
+
+// Encode record into LCI string str (of size nlen) --- using cache if in use.
+// Returns diagnostics found while encoding.
+
+int cachedEncode (const LciRecord *rec, char *str, int nlen) {
+	char key[5 + PACKED_RECORD_MAX];
+	char val[CACHE_DATA];
+	int keylen = 0, diag;
+	unsigned long long hash = 0;
+	Flight *flight = NULL;
+	if (cachebuckets > 0 || coalesceflag) {
+		key[0] = 'E';
+		memcpy(key + 1, &codecprofilekey, 4);	// (flags affect encoding)
+		keylen = 5 + packLciRecord(rec, (unsigned char *) key + 5);
+		hash = hashbytes(key, keylen);
+		int vlen = (cachebuckets > 0) ? cachelookup(hash, key, keylen, val, sizeof(val)) : -1;
+		if (vlen > 4 && vlen - 4 < nlen) {
+			memcpy(&diag, val, 4);
+			memcpy(str, val + 4, vlen - 4);
+			str[vlen - 4] = '\0';
+			return diag;
+		}
+		Flight *done = coalesceflag ? joinflight(hash, key, keylen, &flight) : NULL;
+		if (done != NULL) {		// someone else encoded it
+			int ok = (done->vallen > 4 && done->vallen - 4 < nlen);
+			if (ok) {
+				memcpy(&diag, done->data + keylen, 4);
+				memcpy(str, done->data + keylen + 4, done->vallen - 4);
+				str[done->vallen - 4] = '\0';
+			}
+			dropflight(done);
+			if (ok) return diag;
+		}
+	}
+	loadLciRecord(rec);
+	diagnostics = 0;
+	int slen = encodeLCIbuffer(str, nlen);	// (no allocation)
+	diag = diagnostics;
+	if (slen < 0) {		// (should not happen)
+		slen = 0;
+		str[0] = '\0';
+	}
+	int vlen = -1;
+	if (4 + slen <= (int) sizeof(val)) {
+		memcpy(val, &diag, 4);
+		memcpy(val + 4, str, slen);
+		vlen = 4 + slen;
+		if (cachebuckets > 0) cacheinsert(hash, key, keylen, val, vlen);
+	}
+	if (flight != NULL) landflight(flight, val, vlen);
+	return diag;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Epoch-based reclamation, for data the server replaces while threads are reading it
+// (published through atomic pointers): readers announce the epoch they are reading in,
+// writers retire what they replaced, which is only freed once no reader is left from
+// before it was replaced. Readers never wait, and neither do writers.
+
+#define MAX_READERS 256		// threads reading at one time
+
+struct alignas(64) EpochSlot {
+	std::atomic<int> inuse;
+	std::atomic<unsigned long long> epoch;	// epoch being read in (0 => not reading)
+};
+
+struct Retired {
+	Retired *next;
+	unsigned long long epoch;	// in which it was replaced
+	void (*release)(void *);
+	void *ptr;
+};
+
+EpochSlot epochslots[MAX_READERS];
+std::atomic<unsigned long long> globalepoch(1);
+std::mutex retiredlock;
+Retired *retiredlist = NULL;
+
+struct EpochReader {	// this thread's slot (given back when thread ends)
+	int slot;
+	EpochReader () : slot(-1) {}
+	~EpochReader () {
+		if (slot >= 0) epochslots[slot].inuse = 0;
+	}
+};
+
+thread_local EpochReader epochreader;
+
+// Reader side: what is read through published pointers is safe to use until epochleave()
+
+void epochenter (void) {
+	if (epochreader.slot < 0) {		// first time in this thread
+		for (int k = 0; k < MAX_READERS && epochreader.slot < 0; k++) {
+			int expected = 0;
+			if (epochslots[k].inuse.compare_exchange_strong(expected, 1)) epochreader.slot = k;
+		}
+		if (epochreader.slot < 0) {
+			printf("ERROR: more than %d threads reading at once\n", MAX_READERS);
+			exit(1);
+		}
+	}
+	epochslots[epochreader.slot].epoch.store(globalepoch.load());	// (before reading pointers)
+}
+
+void epochleave (void) {
+	epochslots[epochreader.slot].epoch.store(0, std::memory_order_release);
+}
+
+// Writer side: ptr is no longer reachable (has been replaced) --- release(ptr) once
+// readers are done with it
+
+void retire (void *ptr, void (*release)(void *)) {
+	Retired *retired = new Retired;
+	retired->ptr = ptr;
+	retired->release = release;
+	std::lock_guard<std::mutex> guard(retiredlock);
+	retired->epoch = globalepoch.fetch_add(1);	// (readers in this epoch or before may have it)
+	retired->next = retiredlist;
+	retiredlist = retired;
+}
+
+// free what no reader can still be using (never waits)
+
+void reclaim (void) {
+	std::unique_lock<std::mutex> guard(retiredlock, std::try_to_lock);
+	if (! guard.owns_lock() || retiredlist == NULL) return;
+	unsigned long long oldest = globalepoch.load();
+	for (int k = 0; k < MAX_READERS; k++) {
+		unsigned long long epoch = epochslots[k].epoch.load();
+		if (epoch != 0 && epoch < oldest) oldest = epoch;
+	}
+	for (Retired **prev = &retiredlist; *prev != NULL; ) {
+		Retired *retired = *prev;
+		if (retired->epoch < oldest) {	// (readers from then on see what replaced it)
+			*prev = retired->next;
+			retired->release(retired->ptr);
+			delete retired;
+		}
+		else prev = &retired->next;
+	}
+}
+
+void reclaimall (void) {	// (no readers left)
+	std::lock_guard<std::mutex> guard(retiredlock);
+	while (retiredlist != NULL) {
+		Retired *retired = retiredlist;
+		retiredlist = retired->next;
+		retired->release(retired->ptr);
+		delete retired;
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Encoding profiles: the settings encoding and decoding depend on (flags, Android policy,
+// and the default record) collected in one immutable snapshot. The server publishes the
+// current one (currentprofile) and replaces it --- SIGHUP rereads -profile=..., OP_PROFILE
+// changes settings --- without stopping requests in progress (see above).
+// Cache keys include the profile fingerprint, so nothing needs flushing.
+
+struct CodecProfile {
+	int smallestflag, wantLCIflag, wantZflag, wantUsageflag, wantColocatedflag;
+	int androidpolicy;
+	LciRecord defaults;			// fields not given in request (or LCI string)
+	unsigned int key;			// fingerprint of the above
+	unsigned int generation;
+};
+
+std::atomic<CodecProfile *> currentprofile(NULL);
+std::mutex profilelock;				// (writers)
+const char *profilefile = NULL;		// -profile=... file of settings (reread on SIGHUP)
+
+thread_local const CodecProfile *activeprofile = NULL;
+
+unsigned int profilefingerprint (const CodecProfile *profile) {
+	unsigned char buf[6*4 + PACKED_RECORD_MAX];
+	int flags[6] = { profile->smallestflag, profile->wantLCIflag, profile->wantZflag,
+					 profile->wantUsageflag, profile->wantColocatedflag, profile->androidpolicy };
+	memcpy(buf, flags, sizeof(flags));
+	int nlen = sizeof(flags) + packLciRecord(&profile->defaults, buf + sizeof(flags));
+	return (unsigned int) hashbytes((const char *) buf, nlen);
+}
+
+// current settings of this thread (from command line in main thread)
+
+void captureprofile (CodecProfile *profile) {
+	memset((void *) profile, 0, sizeof(CodecProfile));
+	profile->smallestflag = smallestflag;
+	profile->wantLCIflag = wantLCIflag;
+	profile->wantZflag = wantZflag;
+	profile->wantUsageflag = wantUsageflag;
+	profile->wantColocatedflag = wantColocatedflag;
+	profile->androidpolicy = androidpolicy;
+	saveLciRecord(&profile->defaults);
+	profile->key = profilefingerprint(profile);
+}
+
+// make this thread encode and decode according to profile
+
+void applyprofile (const CodecProfile *profile) {
+	smallestflag = profile->smallestflag;
+	wantLCIflag = profile->wantLCIflag;
+	wantZflag = profile->wantZflag;
+	wantUsageflag = profile->wantUsageflag;
+	wantColocatedflag = profile->wantColocatedflag;
+	androidpolicy = profile->androidpolicy;
+	codecprofilekey = profile->key;
+	activeprofile = profile;
+}
+
+// one setting from name=value token (flags as on command line, or record field)
+// --- returns 0 if not recognized
+
+int parseProfileField (CodecProfile *profile, const char *token) {
+	struct { const char *name; int *flag; } flags[] = {
+		{ "smallest=", &profile->smallestflag }, { "want_LCI=", &profile->wantLCIflag },
+		{ "want_Z=", &profile->wantZflag }, { "want_Usage=", &profile->wantUsageflag },
+		{ "want_Colocated=", &profile->wantColocatedflag },
+	};
+	for (int k = 0; k < (int)(sizeof(flags) / sizeof(flags[0])); k++) {
+		int n = strlen(flags[k].name);
+		if (_strnicmp(token, flags[k].name, n) != 0) continue;
+		if (strcmp(token + n, "0") != 0 && strcmp(token + n, "1") != 0) return 0;
+		*flags[k].flag = token[n] - '0';
+		return 1;
+	}
+	if (_strnicmp(token, "android=", 8) == 0) {
+		for (int k = 0; k < NUM_ANDROID_POLICIES; k++) {
+			if (strcmp(token + 8, android_policy_names[k]) != 0) continue;
+			profile->androidpolicy = k;
+			return 1;
+		}
+		return 0;
+	}
+	return parseLciField(&profile->defaults, token);
+}
+
+// apply settings (name=value tokens, # starts comment to end of line) to profile
+// --- returns 0 (after complaining) if any are not recognized
+
+int parseProfile (CodecProfile *profile, char *text) {
+	int ok = 1;
+	while (*text != '\0') {
+		char *line = text;
+		while (*text != '\0' && *text != '\n') text++;
+		if (*text == '\n') *text++ = '\0';
+		char *comment = strchr(line, '#');
+		if (comment != NULL) *comment = '\0';
+		char *token;
+		while ((token = nexttoken(&line)) != NULL) {
+			if (parseProfileField(profile, token)) continue;
+			printf("ERROR: bad profile setting %s\n", token);
+			ok = 0;
+		}
+	}
+	profile->key = profilefingerprint(profile);
+	return ok;
+}
+
+// read settings from file on top of profile --- returns 0 if unable to
+
+int readProfile (CodecProfile *profile, const char *filename) {
+	FILE *fp;
+	if (fopen_s(&fp, filename, "r") != 0) {
+		printf("ERROR: unable to open %s\n", filename);
+		return 0;
+	}
+	char text[65536];
+	int nlen = fread(text, 1, sizeof(text) - 1, fp);
+	fclose(fp);
+	text[nlen] = '\0';
+	return parseProfile(profile, text);
+}
+
+void releaseprofile (void *ptr) {
+	delete (CodecProfile *) ptr;
+}
+
+// Writer side: make new profile (copy of current one, with settings in text applied, or
+// reread from file if text is NULL) the current one --- returns its generation, or 0 if
+// settings were bad (and current profile stays)
+
+unsigned int updateprofile (const CodecProfile *base, char *text) {
+	std::lock_guard<std::mutex> guard(profilelock);
+	CodecProfile *current = currentprofile.load();
+	CodecProfile *profile = new CodecProfile;
+	*profile = (text == NULL || current == NULL) ? *base : *current;
+	int ok = (text != NULL) ? parseProfile(profile, text) :
+			 (profilefile == NULL || readProfile(profile, profilefile));
+	if (! ok) {
+		delete profile;
+		return 0;
+	}
+	profile->generation = (current != NULL) ? current->generation + 1 : 1;
+	currentprofile.store(profile);
+	if (current != NULL) retire(current, releaseprofile);
+	return profile->generation;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Tracing (-trace-out=file.json): threads record spans --- reading a chunk of input, coding
+// a batch, waiting on a queue, writing (flushing) output --- each into its own ring (the
+// oldest overwritten when full), so recording takes no locks and shares no cache lines.
+// The rings are written out at exit in Chrome trace event format (chrome://tracing, Perfetto).
+// A ring outlives its thread: a later thread of the same name takes it over (so threads started
+// for each client don't each add one), its spans following those of the threads before it.
+
+enum trace_spans { SPAN_READ, SPAN_CODEC, SPAN_WAIT, SPAN_FLUSH, NUM_SPANS };
+
+const char *trace_span_names[NUM_SPANS] = { "read chunk", "codec batch", "queue wait", "write flush" };
+const char *trace_span_args[NUM_SPANS] = { "bytes", "records", "items", "bytes" };	// (what arg counts)
+
+#define TRACE_EVENTS 65536	// per thread (power of 2)
+
+struct TraceEvent {
+	long long start, dur;	// (ns)
+	long long arg;			// (-1 if none)
+	int span;
+};
+
+struct TraceRing {
+	TraceRing *next;		// (all rings, kept after their threads end)
+	const char *name;		// (of thread)
+	int tid;
+	int inuse;				// (by a thread)
+	unsigned long long count;	// spans recorded (last TRACE_EVENTS kept)
+	TraceEvent events[TRACE_EVENTS];
+};
+
+TraceRing *alltraces = NULL;
+std::mutex tracelock;		// (adding or taking rings)
+long long tracestart = 0;	// (ns)
+thread_local TraceRing *threadtrace = NULL;	// (NULL unless tracing)
+
+// start recording this thread's spans (if tracing) --- threads call this as they start
+
+void tracethread (const char *name) {
+	if (tracefile == NULL) return;
+	if (threadtrace != NULL) {		// (renamed)
+		threadtrace->name = name;
+		return;
+	}
+	std::lock_guard<std::mutex> guard(tracelock);
+	TraceRing *ring = alltraces;
+	while (ring != NULL && (ring->inuse || strcmp(ring->name, name) != 0)) ring = ring->next;
+	if (ring == NULL) {
+		ring = (TraceRing *) malloc(sizeof(TraceRing));
+		if (ring == NULL) exit(1);
+		ring->name = name;
+		ring->count = 0;
+		ring->tid = (alltraces == NULL) ? 1 : alltraces->tid + 1;
+		ring->next = alltraces;
+		alltraces = ring;
+	}
+	ring->inuse = 1;
+	threadtrace = ring;
+}
+
+void traceleave (void) {	// (thread ending --- its ring is free for another)
+	if (threadtrace == NULL) return;
+	std::lock_guard<std::mutex> guard(tracelock);
+	threadtrace->inuse = 0;
+	threadtrace = NULL;
+}
+
+long long INLINE tracebegin (void) {	// start of span (0 if not tracing)
+	return (threadtrace != NULL) ? nanoclock() : 0;
+}
+
+void INLINE traceend (int span, long long start, long long arg) {
+	if (threadtrace == NULL) return;
+	TraceEvent *event = &threadtrace->events[threadtrace->count++ & (TRACE_EVENTS - 1)];
+	event->start = start;
+	event->dur = nanoclock() - start;
+	event->arg = arg;
+	event->span = span;
+}
+
+void starttrace (void) {
+	tracestart = nanoclock();
+	tracethread("main");
+}
+
+// write out spans of all threads (none still running) and release the rings
+
+void writetrace (void) {
+	if (alltraces == NULL) return;
+	threadtrace = NULL;
+	FILE *fp;
+	if (fopen_s(&fp, tracefile, "w") != 0) printf("ERROR: unable to open %s\n", tracefile);
+	else {
+		long long dropped = 0;
+		fprintf(fp, "{\"traceEvents\":[\n");
+		for (TraceRing *ring = alltraces; ring != NULL; ring = ring->next) {
+			fprintf(fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+					(ring == alltraces) ? "" : ",\n", ring->tid, ring->name);
+			unsigned long long first = (ring->count > TRACE_EVENTS) ? ring->count - TRACE_EVENTS : 0;
+			dropped += first;
+			for (unsigned long long k = first; k < ring->count; k++) {
+				const TraceEvent *event = &ring->events[k & (TRACE_EVENTS - 1)];
+				fprintf(fp, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%d",
+						trace_span_names[event->span], (event->start - tracestart) * 1e-3, event->dur * 1e-3, ring->tid);
+				if (event->arg >= 0) fprintf(fp, ",\"args\":{\"%s\":%lld}", trace_span_args[event->span], event->arg);
+				fprintf(fp, "}");
+			}
+		}
+		fprintf(fp, "\n],\"displayTimeUnit\":\"ns\"}\n");
+		fclose(fp);
+		if (dropped > 0) printf("# trace: %lld oldest spans dropped (%d kept per thread)\n", dropped, TRACE_EVENTS);
+	}
+	while (alltraces != NULL) {
+		TraceRing *ring = alltraces;
+		alltraces = ring->next;
+		free(ring);
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Spatial index file (-spatialindex=file): fleet APs in a k-d tree for radius and bounding box
+// queries, built once (from -fleet=...) and then memory mapped by any number of processes.
+// Keys are the fixed point values the LCI carries --- Latitude and Longitude (25 bits after
+// the binary point) and floor (4 bits after it) --- so comparisons are exact integer ones.
+// Nodes are stored as for the neighbor report tree (node for [lo, hi) at its middle), but
+// ranges of at most SPATIAL_LEAF nodes are left unsplit and are scanned straight through.
+// APs whose floor is not known (no Z subelement, altitude not in floors) get floor
+// SPATIAL_FLOOR_UNKNOWN, below any other, so only queries that do not bound floors find them.
+// Layout: header, nodes (hot: keys only), then AP entries and their LCI strings (cold).
+
+#define SPATIAL_MAGIC "LCISPATL"
+#define SPATIAL_VERSION 2
+#define SPATIAL_FLOOR_UNKNOWN INT_MIN
+#define SPATIAL_LEAF 16			// nodes in a leaf (scanned, not split)
+#define SPATIAL_PARALLEL 65536	// nodes worth handing subtree to another thread
+
+enum spatial_axes { SPATIAL_LAT, SPATIAL_LON, SPATIAL_FLOOR, NUM_SPATIAL_AXES };
+
+struct SpatialHeader {
+	char magic[8];
+	unsigned int version;
+	unsigned int byteorder;			// PERSIST_BYTEORDER as written by machine that made file
+	unsigned int nodesize, entrysize;	// (change when layout changes)
+	long long count;				// number of APs
+	long long nodestart;			// offset of nodes
+	long long entrystart;			// offset of AP entries
+	long long textstart;			// offset of LCI strings (null terminated)
+	long long size;					// of file
+};
+
+struct SpatialNode {		// (32 bytes --- two to a cache line)
+	long long lat, lon;		// Latitude, Longitude as in LCI field
+	int floor;				// in 1/16 floors, as in Z subelement
+	int alt;				// altitude in 1/256 units, as in LCI field
+	int ap;					// index of AP entry
+	int axis;				// splitting axis (not used in leaves)
+};
+
+struct SpatialEntry {
+	unsigned char bssid[6];
+	unsigned char opclass, channel;
+	unsigned int bssidinfo;
+	long long lci;			// offset of LCI string from textstart
+	unsigned char phytype;
+	unsigned char reserved[7];
+};
+
+struct SpatialIndex {
+	MappedFile map;
+	const SpatialHeader *header;
+	const SpatialNode *nodes;
+	const SpatialEntry *entries;
+	const char *text;
+};
+
+long long INLINE spatialkey (const SpatialNode *node, int axis) {
+	return (axis == SPATIAL_LAT) ? node->lat : (axis == SPATIAL_LON) ? node->lon : node->floor;
+}
+
+// Build tree over nodes [lo, hi), splitting along axis with widest extent (in meters, using
+// scale of each axis). Subtrees of large ranges go to other threads while threads are left.
+
+void spatialbuild (SpatialNode *nodes, int lo, int hi, const double *scale, int threads) {
+	if (hi - lo <= SPATIAL_LEAF) return;
+	long long lower[NUM_SPATIAL_AXES], upper[NUM_SPATIAL_AXES];
+	for (int a = 0; a < NUM_SPATIAL_AXES; a++) {
+		lower[a] = LLONG_MAX;
+		upper[a] = LLONG_MIN;
+	}
+	for (int k = lo; k < hi; k++) {
+		for (int a = 0; a < NUM_SPATIAL_AXES; a++) {
+			long long val = spatialkey(&nodes[k], a);
+			if (a == SPATIAL_FLOOR && val == SPATIAL_FLOOR_UNKNOWN) continue;	// (not an extent in meters)
+			if (val < lower[a]) lower[a] = val;
+			if (val > upper[a]) upper[a] = val;
+		}
+	}
+	if (lower[SPATIAL_FLOOR] > upper[SPATIAL_FLOOR]) lower[SPATIAL_FLOOR] = upper[SPATIAL_FLOOR] = 0;	// (none known)
+	int ax = 0;
+	for (int a = 1; a < NUM_SPATIAL_AXES; a++) {
+		if ((upper[a] - lower[a]) * scale[a] > (upper[ax] - lower[ax]) * scale[ax]) ax = a;
+	}
+	int mid = (lo + hi) / 2;
+	std::nth_element(nodes + lo, nodes + mid, nodes + hi,
+		[ax](const SpatialNode &p, const SpatialNode &q) { return spatialkey(&p, ax) < spatialkey(&q, ax); });
+	nodes[mid].axis = ax;
+	if (threads > 1 && hi - lo > SPATIAL_PARALLEL) {
+		std::thread worker(spatialbuild, nodes, lo, mid, scale, threads / 2);
+		spatialbuild(nodes, mid + 1, hi, scale, threads - threads / 2);
+		worker.join();
+	}
+	else {
+		spatialbuild(nodes, lo, mid, scale, 1);
+		spatialbuild(nodes, mid + 1, hi, scale, 1);
+	}
+}
+
+int haszsubelement (const char *str) {	// does LCI string carry a Z subelement ?
+	int slen = strlen(str) / 2;
+	for (int nbyt = 3; nbyt + 2 <= slen; ) {	// (after measurement report header)
+		int ID = getoctet(str, nbyt++), nlen = getoctet(str, nbyt++);
+		if (nbyt + nlen > slen) return 0;
+		if (ID == Z_CODE) return nlen >= 5;		// (as decoding allows)
+		nbyt += nlen;
+	}
+	return 0;
+}
+
+int INLINE apfloor (const LciRecord *rec, const char *lci) {	// floor of AP in 1/16 floors (if known)
+	if (rec->Altitude_Type == ALTITUDE_FLOORS) return (int)(rec->altitude * 16.0);
+	return haszsubelement(lci) ? (int)(rec->sta_floor * 16.0) : SPATIAL_FLOOR_UNKNOWN;
+}
+
+// Build spatial index file from fleet file --- returns 0 on failure
+
+int buildspatialindex (const char *indexname, const char *fleetname) {
+	long long start = nanoclock();
+	int nfleet, oldquietflag = quietflag;
+	quietflag = 1;		// (problems decoding are kept in diag, not printed for each AP)
+	FleetAP *fleet = readFleet(fleetname, &nfleet);
+	quietflag = oldquietflag;
+	if (fleet == NULL) return 0;
+	SpatialNode *nodes = (SpatialNode *) malloc((nfleet + 1) * sizeof(SpatialNode));
+	SpatialEntry *entries = (SpatialEntry *) malloc((nfleet + 1) * sizeof(SpatialEntry));
+	if (nodes == NULL || entries == NULL) exit(1);
+	memset(nodes, 0, nfleet * sizeof(SpatialNode));
+	memset(entries, 0, nfleet * sizeof(SpatialEntry));
+	double meanlat = 0;
+	long long textsize = 0;
+	for (int k = 0; k < nfleet; k++) {
+		const LciRecord *rec = &fleet[k].rec;
+		nodes[k].lat = (long long)roundl(rec->latitude * (1 << 25));	// (as when encoding)
+		nodes[k].lon = (long long)roundl(rec->longitude * (1 << 25));
+		nodes[k].floor = apfloor(rec, fleet[k].lci);
+		nodes[k].alt = (int)(rec->altitude * 256.0);
+		nodes[k].ap = k;
+		memcpy(entries[k].bssid, fleet[k].bssid, 6);
+		entries[k].opclass = (unsigned char) fleet[k].opclass;
+		entries[k].channel = (unsigned char) fleet[k].channel;
+		entries[k].phytype = (unsigned char) fleet[k].phytype;
+		entries[k].bssidinfo = fleet[k].bssidinfo;
+		entries[k].lci = textsize;
+		textsize += strlen(fleet[k].lci) + 1;
+		meanlat += rec->latitude;
+	}
+	if (nfleet > 0) meanlat /= nfleet;
+	double scale[NUM_SPATIAL_AXES];		// meters per unit of each axis
+	scale[SPATIAL_LAT] = EARTH_RADIUS * DEGREES_TO_RADIANS / (1 << 25);
+	scale[SPATIAL_LON] = scale[SPATIAL_LAT] * cos(meanlat * DEGREES_TO_RADIANS);
+	scale[SPATIAL_FLOOR] = floorheight / 16.0;
+	spatialbuild(nodes, 0, nfleet, scale, getnthreads());
+	long long build = nanoclock();
+
+	SpatialHeader header;
+	memset(&header, 0, sizeof(header));
+	header.version = SPATIAL_VERSION;
+	header.byteorder = PERSIST_BYTEORDER;
+	header.nodesize = sizeof(SpatialNode);
+	header.entrysize = sizeof(SpatialEntry);
+	header.count = nfleet;
+	header.nodestart = (sizeof(SpatialHeader) + 63) & ~63LL;	// (nodes aligned to cache lines)
+	header.entrystart = header.nodestart + nfleet * (long long) sizeof(SpatialNode);
+	header.textstart = header.entrystart + nfleet * (long long) sizeof(SpatialEntry);
+	header.size = header.textstart + textsize;
+	int ok = 0;
+	FILE *fp;
+	char tempname[MAX_LINE];	// (written aside, then renamed, so an open index is never truncated)
+	snprintf(tempname, sizeof(tempname), "%s.tmp", indexname);
+	if (fopen_s(&fp, tempname, "wb") != 0) printf("ERROR: unable to open %s\n", tempname);
+	else {
+		char pad[64];
+		memset(pad, 0, sizeof(pad));
+		ok = (fwrite(&header, sizeof(header), 1, fp) == 1);
+		ok = ok && fwrite(pad, 1, header.nodestart - sizeof(header), fp) == header.nodestart - sizeof(header);
+		ok = ok && fwrite(nodes, sizeof(SpatialNode), nfleet, fp) == (size_t) nfleet;
+		ok = ok && fwrite(entries, sizeof(SpatialEntry), nfleet, fp) == (size_t) nfleet;
+		for (int k = 0; ok && k < nfleet; k++) {
+			ok = (fwrite(fleet[k].lci, 1, strlen(fleet[k].lci) + 1, fp) == strlen(fleet[k].lci) + 1);
+		}
+		if (ok) {	// magic last, marks file as complete
+			ok = (fseek(fp, 0, SEEK_SET) == 0 && fwrite(SPATIAL_MAGIC, 1, 8, fp) == 8);
+		}
+		if (fclose(fp) != 0) ok = 0;
+		if (! ok) printf("ERROR: unable to write %s\n", tempname);
+		else if (! replacefile(tempname, indexname)) {
+			printf("ERROR: unable to replace %s\n", indexname);
+			ok = 0;
+		}
+		if (! ok) remove(tempname);
+	}
+	if (ok && verboseflag) {
+		printf("# spatial index %s: %d APs, %lld bytes, built in %.3f ms (%d threads), written in %.3f ms\n",
+			   indexname, nfleet, header.size, (build - start) * 1e-6, getnthreads(), (nanoclock() - build) * 1e-6);
+	}
+	free(nodes);
+	free(entries);
+	freeFleet(fleet, nfleet);
+	return ok;
+}
+
+int openspatialindex (SpatialIndex *index, const char *filename) {
+	FILE *fp;
+	memset(index, 0, sizeof(SpatialIndex));
+	if (fopen_s(&fp, filename, "rb") != 0) {	// (mapfile would create it)
+		printf("ERROR: unable to open spatial index %s\n", filename);
+		return 0;
+	}
+	fclose(fp);
+	if (! mapfile(&index->map, filename, 0, 0)) {
+		printf("ERROR: unable to map spatial index %s\n", filename);
+		return 0;
+	}
+	const SpatialHeader *header = (const SpatialHeader *) index->map.base;
+	if (index->map.size < (long long) sizeof(SpatialHeader) || memcmp(header->magic, SPATIAL_MAGIC, 8) != 0) {
+		printf("ERROR: %s is not a spatial index file\n", filename);
+		unmapfile(&index->map);
+		return 0;
+	}
+	if (header->version != SPATIAL_VERSION || header->byteorder != PERSIST_BYTEORDER ||
+		header->nodesize != sizeof(SpatialNode) || header->entrysize != sizeof(SpatialEntry) ||
+		header->size > index->map.size) {
+		printf("ERROR: spatial index %s has a different layout --- rebuild it\n", filename);
+		unmapfile(&index->map);
+		return 0;
+	}
+	if (header->count < 0 || header->count > INT_MAX || header->nodestart < (long long) sizeof(SpatialHeader) ||
+		header->nodestart > header->size ||
+		header->count > (header->size - header->nodestart) / (long long)(sizeof(SpatialNode) + sizeof(SpatialEntry)) ||
+		header->entrystart < header->nodestart + header->count * (long long) sizeof(SpatialNode) ||
+		header->textstart < header->entrystart + header->count * (long long) sizeof(SpatialEntry) ||
+		header->textstart > header->size) {
+		printf("ERROR: spatial index %s is damaged --- rebuild it\n", filename);	// (regions outside file)
+		unmapfile(&index->map);
+		return 0;
+	}
+	index->header = header;
+	index->nodes = (const SpatialNode *)(index->map.base + header->nodestart);
+	index->entries = (const SpatialEntry *)(index->map.base + header->entrystart);
+	index->text = index->map.base + header->textstart;
+	return 1;
+}
+
+void closespatialindex (SpatialIndex *index) {
+	unmapfile(&index->map);
+	index->header = NULL;
+}
+
+// Query box: inclusive bounds of each axis, in its fixed point units
+
+struct SpatialBox {
+	long long lower[NUM_SPATIAL_AXES], upper[NUM_SPATIAL_AXES];
+};
+
+struct SpatialHit {
+	int node;
+	double dist;			// (m) from center of radius query
+};
+
+struct SpatialHits {		// nodes found (grows as needed)
+	int count, max;
+	SpatialHit *hit;
+};
+
+void INLINE spatialhit (SpatialHits *hits, int node) {
+	if (hits->count >= hits->max) {
+		hits->max = (hits->max > 0) ? hits->max * 2 : 256;
+		hits->hit = (SpatialHit *) realloc(hits->hit, hits->max * sizeof(SpatialHit));
+		if (hits->hit == NULL) exit(1);
+	}
+	hits->hit[hits->count].node = node;
+	hits->hit[hits->count++].dist = 0;
+}
+
+int INLINE spatialinside (const SpatialNode *node, const SpatialBox *box) {
+	for (int a = 0; a < NUM_SPATIAL_AXES; a++) {
+		long long val = spatialkey(node, a);
+		if (val < box->lower[a] || val > box->upper[a]) return 0;
+	}
+	return 1;
+}
+
+// nodes [lo, hi) inside box (subtree left of node has keys <= its key, right one keys >= it)
+
+void spatialsearch (const SpatialNode *nodes, int lo, int hi, const SpatialBox *box, SpatialHits *hits) {
+	while (hi - lo > SPATIAL_LEAF) {
+		int mid = (lo + hi) / 2;
+		const SpatialNode *node = &nodes[mid];
+		if (spatialinside(node, box)) spatialhit(hits, mid);
+		long long key = spatialkey(node, node->axis);
+		int left = (box->lower[node->axis] <= key), right = (box->upper[node->axis] >= key);
+		if (left && right) spatialsearch(nodes, lo, mid, box, hits);	// (recurse on one side only)
+		if (right) lo = mid + 1;
+		else if (left) hi = mid;
+		else return;
+	}
+	for (int k = lo; k < hi; k++) {
+		if (spatialinside(&nodes[k], box)) spatialhit(hits, k);
+	}
+}
+
+// APs with latitude in [lat1, lat2], longitude in [lon1, lon2] (degrees), floor in [floor1, floor2]
+// --- a longitude range with lon1 > lon2 is taken to cross the antimeridian
+
+void spatialquery (const SpatialIndex *index, double lat1, double lon1, double lat2, double lon2,
+				   double floor1, double floor2, SpatialHits *hits) {
+	SpatialBox box;
+	box.lower[SPATIAL_LAT] = (long long) ceill(lat1 * (1 << 25));
+	box.upper[SPATIAL_LAT] = (long long) floorl(lat2 * (1 << 25));
+	box.lower[SPATIAL_FLOOR] = (floor1 < -1e9) ? LLONG_MIN : (long long) ceil(floor1 * 16.0);
+	box.upper[SPATIAL_FLOOR] = (floor2 > 1e9) ? LLONG_MAX : (long long) floor(floor2 * 16.0);
+	if (floor1 >= -1e9 && box.lower[SPATIAL_FLOOR] <= SPATIAL_FLOOR_UNKNOWN) box.lower[SPATIAL_FLOOR] = SPATIAL_FLOOR_UNKNOWN + 1LL;
+	int n = (int) index->header->count;
+	if (lon1 > lon2) {
+		box.lower[SPATIAL_LON] = (long long) ceill(lon1 * (1 << 25));
+		box.upper[SPATIAL_LON] = LLONG_MAX;
+		spatialsearch(index->nodes, 0, n, &box, hits);
+		lon1 = -180;
+	}
+	box.lower[SPATIAL_LON] = (long long) ceill(lon1 * (1 << 25));
+	box.upper[SPATIAL_LON] = (long long) floorl(lon2 * (1 << 25));
+	spatialsearch(index->nodes, 0, n, &box, hits);
+}
+
+double greatcircle (double lat1, double lon1, double lat2, double lon2) {	// distance (m) (haversine)
+	double sinlat = sin((lat2 - lat1) * DEGREES_TO_RADIANS / 2), sinlon = sin((lon2 - lon1) * DEGREES_TO_RADIANS / 2);
+	double h = sinlat * sinlat + cos(lat1 * DEGREES_TO_RADIANS) * cos(lat2 * DEGREES_TO_RADIANS) * sinlon * sinlon;
+	return 2 * EARTH_RADIUS * asin(sqrt((h < 1) ? h : 1));
+}
+
+double INLINE spatiallatitude (const SpatialNode *node) { return node->lat / (double)(1 << 25); }
+
+double INLINE spatiallongitude (const SpatialNode *node) { return node->lon / (double)(1 << 25); }
+
+// APs within meters of lat, lon (and on floors floor1 to floor2), nearest first
+
+void spatialradius (const SpatialIndex *index, double lat, double lon, double meters,
+					double floor1, double floor2, SpatialHits *hits) {
+	double angle = meters / EARTH_RADIUS;		// (radians)
+	double dlat = angle / DEGREES_TO_RADIANS;
+	double lat1 = lat - dlat, lat2 = lat + dlat, lon1 = -180, lon2 = 180;
+	if (lat1 > -90 && lat2 < 90 && sin(angle) < cos(lat * DEGREES_TO_RADIANS)) {	// (else a pole is inside)
+		double dlon = asin(sin(angle) / cos(lat * DEGREES_TO_RADIANS)) / DEGREES_TO_RADIANS;
+		lon1 = lon - dlon;
+		lon2 = lon + dlon;
+		if (lon1 < -180) lon1 += 360;	// crosses antimeridian
+		if (lon2 > 180) lon2 -= 360;
+	}
+	int first = hits->count;
+	spatialquery(index, lat1, lon1, lat2, lon2, floor1, floor2, hits);
+	int n = first;
+	for (int k = first; k < hits->count; k++) {		// keep those inside circle
+		const SpatialNode *node = &index->nodes[hits->hit[k].node];
+		double d = greatcircle(lat, lon, spatiallatitude(node), spatiallongitude(node));
+		if (d > meters) continue;
+		hits->hit[n].node = hits->hit[k].node;
+		hits->hit[n++].dist = d;
+	}
+	hits->count = n;
+	std::sort(hits->hit + first, hits->hit + n,
+		[](const SpatialHit &p, const SpatialHit &q) { return p.dist < q.dist || (p.dist == q.dist && p.node < q.node); });
+}
+
+// print AP found as fleet file line (so results can be fed back in as a fleet)
+
+void showspatialhit (const SpatialIndex *index, const SpatialHit *hit, int radius) {
+	const SpatialNode *node = &index->nodes[hit->node];
+	long long textsize = index->header->size - index->header->textstart;
+	if (node->ap < 0 || node->ap >= index->header->count) {
+		printf("ERROR: spatial index node %d has bad AP entry %d\n", hit->node, node->ap);
+		return;
+	}
+	const SpatialEntry *entry = &index->entries[node->ap];
+	if (entry->lci < 0 || entry->lci >= textsize || memchr(index->text + entry->lci, '\0', textsize - entry->lci) == NULL) {
+		printf("ERROR: spatial index AP entry %d has bad LCI string offset %lld\n", node->ap, entry->lci);
+		return;
+	}
+	char name[BSSID_TEXT];
+	formatBSSID(name, entry->bssid);
+	printf("%s lci=%s", name, index->text + entry->lci);
+	if (entry->opclass != 0) printf(" opclass=%d", entry->opclass);
+	if (entry->channel != 0) printf(" channel=%d", entry->channel);
+	if (entry->phytype != 0) printf(" phytype=%d", entry->phytype);
+	if (entry->bssidinfo != 0) printf(" bssidinfo=%x", entry->bssidinfo);
+	printf("\n");
+	if (verboseflag) {
+		printf("#\tlat %.9lg lon %.9lg alt %lg", spatiallatitude(node), spatiallongitude(node), node->alt / 256.0);
+		if (node->floor != SPATIAL_FLOOR_UNKNOWN) printf(" floor %lg", node->floor / 16.0);
+		if (radius) printf(" distance %.3lf m", hit->dist);
+		printf("\n");
+	}
+}
+
+// parse up to max comma separated numbers --- returns how many there were (-1 if bad)
+
+int parsenumbers (const char *str, double *val, int max) {
+	int n = 0;
+	while (n < max) {
+		char *end;
+		val[n++] = strtod(str, &end);
+		if (end == str) return -1;
+		if (*end == '\0') return n;
+		if (*end != ',') return -1;
+		str = end + 1;
+	}
+	return -1;
+}
+
+// Build spatial index (if fleet file given), then answer -radius=... or -bbox=... query
+
+int spatialindex (const char *indexname, const char *fleetname) {
+	if (fleetname != NULL && ! buildspatialindex(indexname, fleetname)) return 1;
+	if (radiusquery == NULL && bboxquery == NULL) {
+		if (fleetname == NULL) printf("ERROR: need -fleet=... to build spatial index, or -radius=... or -bbox=... to query it\n");
+		return (fleetname == NULL);
+	}
+	SpatialIndex index;
+	if (! openspatialindex(&index, indexname)) return 1;
+	SpatialHits hits = { 0, 0, NULL };
+	double val[6];
+	int status = 0;
+	long long start = nanoclock();
+	if (radiusquery != NULL) {
+		int n = parsenumbers(radiusquery, val, 5);
+		if (n != 3 && n != 5) {
+			printf("ERROR: -radius=%s (use lat,lon,meters or lat,lon,meters,floor1,floor2)\n", radiusquery);
+			status = 1;
+		}
+		else spatialradius(&index, val[0], val[1], val[2], (n == 5) ? val[3] : -HUGE_VAL, (n == 5) ? val[4] : HUGE_VAL,
+						   &hits);
+	}
+	else {
+		int n = parsenumbers(bboxquery, val, 6);
+		if (n != 4 && n != 6) {
+			printf("ERROR: -bbox=%s (use lat1,lon1,lat2,lon2 or lat1,lon1,lat2,lon2,floor1,floor2)\n", bboxquery);
+			status = 1;
+		}
+		else spatialquery(&index, val[0], val[1], val[2], val[3], (n == 6) ? val[4] : -HUGE_VAL, (n == 6) ? val[5] : HUGE_VAL,
+						  &hits);
+	}
+	long long stop = nanoclock();
+	for (int k = 0; k < hits.count; k++) showspatialhit(&index, &hits.hit[k], radiusquery != NULL);
+	if (status == 0 && verboseflag) {
+		printf("# %d of %lld APs found in %.3f ms\n", hits.count, index.header->count, (stop - start) * 1e-6);
+	}
+	free(hits.hit);
+	closespatialindex(&index);
+	return status;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Batch modes: decode (or encode) each line of a file, writing one line per record.
+// Lines may start with a BSSID, which is copied to the output (as in fleet files).
+// Decoding: line holds LCI string (lci=... or bare), output is record as text.
+// Encoding: line holds record as text (name=value fields), output is lci=...
+// Fields not given take their values from the command line (or the defaults).
+// The main thread reads the file in chunks of lines and writes out what each chunk gives,
+// in order; with more than one thread (-threads=...) worker threads decode or encode the
+// chunks in between, else the main thread does. The output is the same either way.
+
+#define BATCH_LINES 256		// lines per chunk
+#define BATCH_AHEAD 4		// chunks in flight per worker thread
+
+struct TextBuffer {		// growable output buffer
+	char *str;
+	int len, cap;
+};
+
+void growtext (TextBuffer *buf, int nlen) {		// make room for nlen more bytes (and a 0)
+	if (buf->len + nlen < buf->cap) return;
+	buf->cap = (buf->cap < 256) ? 256 : buf->cap * 2;
+	while (buf->len + nlen >= buf->cap) buf->cap *= 2;
+	buf->str = (char *) realloc(buf->str, buf->cap);
+	if (buf->str == NULL) exit(1);
+}
+
+void appendtext (TextBuffer *buf, const char *format, ...) {
+	for (;;) {
+		va_list args;
+		va_start(args, format);
+		int n = vsnprintf(buf->str + buf->len, buf->cap - buf->len, format, args);
+		va_end(args);
+		if (n < 0) return;
+		if (n < buf->cap - buf->len) {
+			buf->len += n;
+			return;
+		}
+		growtext(buf, n);
+	}
+}
+
+void appendbytes (TextBuffer *buf, const char *data, int nlen) {
+	growtext(buf, nlen);
+	memcpy(buf->str + buf->len, data, nlen);
+	buf->len += nlen;
+}
+
+struct BatchChunk {
+	TextBuffer in;			// lines read (each 0 terminated)
+	TextBuffer out;			// what they give (records, lci=..., ERROR messages)
+	int nlines, firstline;
+	int done;				// (coded --- under BatchQueue lock)
+};
+
+struct BatchQueue {		// chunks in the order read: [written, taken) being coded, [taken, filled) waiting
+	std::mutex lock;
+	std::condition_variable ready, done;	// (chunk to code, chunk coded)
+	BatchChunk *chunks;
+	int nchunks;
+	long long filled, taken, written;
+	int stopping;
+};
+
+void batchline (TextBuffer *buf, const char *bssid, const char *str, int diag) {
+	if (bssid != NULL) appendtext(buf, "%s ", bssid);
+	if (diag == 0) appendtext(buf, "%s\n", str);
+	else {
+		char names[MAX_LINE];
+		formatDiagnostics(names, sizeof(names), diag);
+		appendtext(buf, "%s diagnostics=%s\n", str, names);
+	}
+}
+
+// encoding and decoding used by batch mode (-connect=... hands them to a server instead)
+
+int (*batchdecode)(const char *str, const LciRecord *defaults, LciRecord *rec) = cachedDecode;
+int (*batchencode)(const LciRecord *rec, char *str, int nlen) = cachedEncode;
+
+// read next chunk of lines --- returns number read (0 at end of file)
+
+int batchread (FILE *fp, BatchChunk *chunk, int *lineno) {
+	long long start = tracebegin();
+	char line[MAX_LINE];
+	chunk->in.len = 0;
+	chunk->nlines = 0;
+	chunk->firstline = *lineno + 1;
+	while (chunk->nlines < BATCH_LINES && fgets(line, sizeof(line), fp) != NULL) {
+		appendbytes(&chunk->in, line, (int) strlen(line) + 1);
+		chunk->nlines++;
+	}
+	*lineno += chunk->nlines;
+	traceend(SPAN_READ, start, chunk->in.len);
+	return chunk->nlines;
+}
+
+// decode (or encode) the lines of a chunk, into chunk->out
+
+void batchchunk (BatchChunk *chunk, const LciRecord *defaults, int encodeflag) {
+	long long start = tracebegin();
+	LciRecord rec;
+	char line[MAX_LINE], out[MAX_LINE];
+	const char *next = chunk->in.str;
+	int nrecords = 0;
+	chunk->out.len = 0;
+	for (int k = 0; k < chunk->nlines; k++) {
+		int lineno = chunk->firstline + k;
+		int nlen = (int) strlen(next) + 1;
+		memcpy(line, next, nlen);	// (split into tokens in place)
+		next += nlen;
+		STATS_START(inputstart);
+		char *rest = line;
+		char *token = nexttoken(&rest);
+		if (token == NULL || *token == '#') continue;
+		const char *bssid = NULL;
+		if (isValidBSSID(token)) {
+			bssid = token;
+			token = nexttoken(&rest);
+		}
+		if (encodeflag) {
+			memcpy(&rec, defaults, sizeof(LciRecord));
+			int ok = 1;
+			for (; token != NULL; token = nexttoken(&rest)) {
+				if (strncmp(token, "diagnostics=", 12) == 0) continue;	// (from decoding)
+				if (! parseLciField(&rec, token)) {
+					appendtext(&chunk->out, "ERROR: line %d: %s\n", lineno, token);
+					ok = 0;
+				}
+			}
+			if (! ok) continue;
+			STATS_STOP(inputstart, STAGE_INPUT);
+			int diag = batchencode(&rec, out + 4, sizeof(out) - 4);
+			STATS_RECORD(diag);
+			nrecords++;
+			if (androidpolicy == ANDROID_REJECT && (diag & (1 << DIAG_ANDROID))) {
+				appendtext(&chunk->out, "ERROR: line %d: rejected, Android will not provide location information\n", lineno);
+				continue;
+			}
+			STATS_START(outputstart);
+			memcpy(out, "lci=", 4);
+			batchline(&chunk->out, bssid, out, diag);
+			STATS_STOP(outputstart, STAGE_OUTPUT);
+		}
+		else {
+			if (token != NULL && _strnicmp(token, "lci=", 4) == 0) token += 4;
+			if (token == NULL || ! ishexstring(token)) {
+				appendtext(&chunk->out, "ERROR: line %d: missing or invalid LCI string\n", lineno);
+				continue;
+			}
+			STATS_STOP(inputstart, STAGE_INPUT);
+			int diag = batchdecode(token, defaults, &rec);
+			STATS_RECORD(diag);
+			nrecords++;
+			STATS_START(outputstart);
+			if (formatLciRecord(out, sizeof(out), &rec) < 0) {
+				appendtext(&chunk->out, "ERROR: line %d: record too long\n", lineno);
+				continue;
+			}
+			batchline(&chunk->out, bssid, out, diag);
+			STATS_STOP(outputstart, STAGE_OUTPUT);
+		}
+	}
+	traceend(SPAN_CODEC, start, nrecords);
+}
+
+void batchworker (BatchQueue *queue, const CodecProfile *profile, const LciRecord *defaults, int encodeflag) {
+	tracethread("batch worker");
+	applyprofile(profile);
+	for (;;) {
+		long long start = tracebegin();
+		BatchChunk *chunk;
+		{
+			std::unique_lock<std::mutex> guard(queue->lock);
+			while (queue->taken == queue->filled && ! queue->stopping) queue->ready.wait(guard);
+			if (queue->taken == queue->filled) break;
+			chunk = &queue->chunks[queue->taken++ % queue->nchunks];
+		}
+		traceend(SPAN_WAIT, start, 1);
+		batchchunk(chunk, defaults, encodeflag);
+		{
+			std::lock_guard<std::mutex> guard(queue->lock);
+			chunk->done = 1;
+		}
+		queue->done.notify_one();	// (only the main thread waits for it)
+	}
+	traceleave();
+	freeColocatedBSSIDs();		// (this thread's copy)
+}
+
+void batchcodec (const char *filename, int encodeflag) {
+	FILE *fp;
+	if (fopen_s(&fp, filename, "r") != 0) {
+		printf("ERROR: unable to open %s\n", filename);
+		return;
+	}
+	LciRecord defaults;
+	saveLciRecord(&defaults);
+	CodecProfile profile;
+	captureprofile(&profile);
+	applyprofile(&profile);		// (for cache keys)
+	if (cachemb > 0) makeCache(cachemb);
+	if (persistfile != NULL && ! encodeflag) openPersist(persistfile, persistmb);
+	int oldverboseflag = verboseflag, oldquietflag = quietflag;
+	verboseflag = 0;
+	quietflag = 1;
+	// (one connection to a server, and -stats only counts this thread: no workers then)
+	int nworkers = (getnthreads() > 1 && batchdecode == cachedDecode && ! STATS_ACTIVE) ? getnthreads() : 0;
+	BatchQueue queue;
+	queue.nchunks = (nworkers > 0) ? BATCH_AHEAD * nworkers : 1;
+	queue.chunks = new BatchChunk[queue.nchunks]();
+	queue.filled = queue.taken = queue.written = 0;
+	queue.stopping = 0;
+	std::thread *workers = new std::thread[nworkers];
+	for (int t = 0; t < nworkers; t++)
+		workers[t] = std::thread(batchworker, &queue, &profile, &defaults, encodeflag);
+	int lineno = 0, eof = 0;
+	for (;;) {
+		BatchChunk *chunk = &queue.chunks[queue.written % queue.nchunks];	// (next to write)
+		int ready;
+		{
+			std::lock_guard<std::mutex> guard(queue.lock);
+			ready = (queue.written < queue.filled && chunk->done);
+		}
+		if (! ready && ! eof && queue.filled - queue.written < queue.nchunks) {	// read ahead
+			BatchChunk *next = &queue.chunks[queue.filled % queue.nchunks];
+			if (batchread(fp, next, &lineno) == 0) {
+				eof = 1;
+				continue;
+			}
+			if (nworkers == 0) batchchunk(next, &defaults, encodeflag);
+			{
+				std::lock_guard<std::mutex> guard(queue.lock);
+				next->done = (nworkers == 0);
+				queue.filled++;
+			}
+			queue.ready.notify_one();
+			continue;
+		}
+		if (queue.written == queue.filled) break;	// (all read and written)
+		if (! ready) {
+			long long start = tracebegin();
+			std::unique_lock<std::mutex> guard(queue.lock);
+			while (! chunk->done) queue.done.wait(guard);
+			guard.unlock();
+			traceend(SPAN_WAIT, start, 1);
+		}
+		long long start = tracebegin();
+		if (chunk->out.len > 0) fwrite(chunk->out.str, 1, chunk->out.len, stdout);
+		traceend(SPAN_FLUSH, start, chunk->out.len);
+		queue.written++;
+	}
+	{
+		std::lock_guard<std::mutex> guard(queue.lock);
+		queue.stopping = 1;
+	}
+	queue.ready.notify_all();
+	for (int t = 0; t < nworkers; t++) workers[t].join();
+	delete [] workers;
+	for (int k = 0; k < queue.nchunks; k++) {
+		free(queue.chunks[k].in.str);
+		free(queue.chunks[k].out.str);
+	}
+	delete [] queue.chunks;
+	fclose(fp);
+	verboseflag = oldverboseflag;
+	quietflag = oldquietflag;
+	if (verboseflag && cachebuckets > 0) showcachestats();
+	if (verboseflag && persistcache != NULL) showpersiststats();
+	freeCache();
+	closePersist();
+	loadLciRecord(&defaults);	// leave global variables as they were
+	activeprofile = NULL;
+}
+
+// Whole file of lines in memory, for modes that need all of them at once (-mortonsort=...,
+// -quantization=...)
+
+struct FileLines {
+	TextBuffer text;
+	const char **lines;		// (into text)
+	int nlines;
+};
+
+int readlines (FileLines *file, const char *filename) {	// returns 0 on failure
+	memset(file, 0, sizeof(FileLines));
+	FILE *fp;
+	if (fopen_s(&fp, filename, "r") != 0) {
+		printf("ERROR: unable to open %s\n", filename);
+		return 0;
+	}
+	int maxlines = 1024;
+	int *offsets = (int *) malloc(maxlines * sizeof(int));
+	if (offsets == NULL) exit(1);
+	char line[MAX_LINE];
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (file->nlines == maxlines) {
+			maxlines *= 2;
+			offsets = (int *) realloc(offsets, maxlines * sizeof(int));
+			if (offsets == NULL) exit(1);
+		}
+		offsets[file->nlines++] = file->text.len;
+		appendbytes(&file->text, line, (int) strlen(line) + 1);
+	}
+	fclose(fp);
+	file->lines = (const char **) malloc((file->nlines + 1) * sizeof(const char *));
+	if (file->lines == NULL) exit(1);
+	for (int i = 0; i < file->nlines; i++) file->lines[i] = file->text.str + offsets[i];
+	free(offsets);
+	return 1;
+}
+
+void freelines (FileLines *file) {
+	free(file->lines);
+	free(file->text.str);
+	file->lines = NULL;
+	file->text.str = NULL;
+}
+
+// Split items [0, n) evenly between worker threads, each given the settings and defaults in
+// force now (verbose and quiet output are turned off while they run)
+
+typedef void (*LineWorker)(void *context, const CodecProfile *profile, const LciRecord *defaults, int lo, int hi);
+
+void splitlines (int n, LineWorker worker, void *context) {
+	LciRecord defaults;
+	saveLciRecord(&defaults);
+	CodecProfile profile;
+	captureprofile(&profile);
+	int oldverboseflag = verboseflag, oldquietflag = quietflag;
+	verboseflag = 0;
+	quietflag = 1;
+	int nworkers = getnthreads();
+	if (nworkers > n) nworkers = (n > 0) ? n : 1;
+	std::thread *workers = new std::thread[nworkers];
+	for (int t = 0; t < nworkers; t++) {
+		int lo = (int)((long long)n * t / nworkers), hi = (int)((long long)n * (t + 1) / nworkers);
+		workers[t] = std::thread(worker, context, &profile, &defaults, lo, hi);
+	}
+	for (int t = 0; t < nworkers; t++) workers[t].join();
+	delete [] workers;
+	verboseflag = oldverboseflag;
+	quietflag = oldquietflag;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Morton (Z-order) keys: the bits of longitude and latitude interleaved, so that places near
+// each other mostly get keys near each other --- sorting on the key groups a fleet by area.
+// Made straight from the 34-bit two's complement Latitude and Longitude of the LCI field:
+// each is offset to unsigned (sign bit flipped) and its top 32 bits kept (cells 2^-23
+// degrees square, about 13 mm north to south), longitude going into the odd bits of the key
+// and latitude into the even bits. Spreading the bits is one BMI2 pdep instruction where
+// that is fast (it is microcoded, and slow, on AMD before Zen 3), else a few shifts and masks.
+
+#define LCI_LATITUDE_BIT 6		// bit offsets in LCI field (after uncertainties)
+#define LCI_LONGITUDE_BIT 46
+
+unsigned long long INLINE spreadbits (unsigned long long x) {	// bit k of low 32 bits to bit 2k
+	x &= 0xFFFFFFFFULL;
+	x = (x | (x << 16)) & 0x0000FFFF0000FFFFULL;
+	x = (x | (x << 8)) & 0x00FF00FF00FF00FFULL;
+	x = (x | (x << 4)) & 0x0F0F0F0F0F0F0F0FULL;
+	x = (x | (x << 2)) & 0x3333333333333333ULL;
+	x = (x | (x << 1)) & 0x5555555555555555ULL;
+	return x;
+}
+
+unsigned long long INLINE mortonbits (long long fixed) {	// top 32 bits of 34-bit value, as unsigned
+	return ((((unsigned long long) fixed) ^ (1ULL << 33)) & ((1ULL << 34) - 1)) >> 2;
+}
+
+unsigned long long mortonportable (long long Latitude, long long Longitude) {
+	return (spreadbits(mortonbits(Longitude)) << 1) | spreadbits(mortonbits(Latitude));
+}
+
+#if defined(__x86_64__) && ! defined(_MSC_VER)
+__attribute__((target("bmi2")))
+unsigned long long mortonpdep (long long Latitude, long long Longitude) {
+	return _pdep_u64(mortonbits(Longitude), 0xAAAAAAAAAAAAAAAAULL) | _pdep_u64(mortonbits(Latitude), 0x5555555555555555ULL);
+}
+
+int fastpdep (void) {	// BMI2 present, and not microcoded (AMD family 17h and before)
+	unsigned int eax, ebx, ecx, edx;
+	if (! __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) || ! (ebx & (1 << 8))) return 0;	// (bit 8: BMI2)
+	__get_cpuid(0, &eax, &ebx, &ecx, &edx);
+	if (ebx != 0x68747541) return 1;	// ("Auth" of AuthenticAMD)
+	__get_cpuid(1, &eax, &ebx, &ecx, &edx);
+	int family = ((eax >> 8) & 0xF) + (((eax >> 8) & 0xF) == 0xF ? (eax >> 20) & 0xFF : 0);
+	return family >= 0x19;
+}
+
+unsigned long long (*const mortonkernel)(long long, long long) = fastpdep() ? mortonpdep : mortonportable;
+
+unsigned long long INLINE mortonkey (long long Latitude, long long Longitude) {
+	return mortonkernel(Latitude, Longitude);
+}
+#else
+unsigned long long INLINE mortonkey (long long Latitude, long long Longitude) {
+	return mortonportable(Latitude, Longitude);
+}
+#endif
+
+// Latitude and Longitude (34-bit fixed point) straight from LCI string, without decoding the
+// rest --- returns 0 if the string has no (well formed) LCI subelement
+
+int lcifixedposition (const char *str, long long *Latitude, long long *Longitude) {
+	int slen = (int) strlen(str) / 2;
+	if (slen < 3 || getoctet(str, 0) != MEASURE_TOKEN || getoctet(str, 1) != MEASURE_REQUEST_MODE ||
+		getoctet(str, 2) != LCI_TYPE) return 0;
+	for (int nbyt = 3; nbyt + 2 <= slen; ) {
+		int ID = getoctet(str, nbyt++);
+		int nlen = getoctet(str, nbyt++);
+		if (nbyt + nlen > slen) return 0;
+		if (ID == LCI_CODE && nlen == 16) {
+			*Latitude = propagate_sign(getbits(str + nbyt*2, LCI_LATITUDE_BIT, 34), 34);
+			*Longitude = propagate_sign(getbits(str + nbyt*2, LCI_LONGITUDE_BIT, 34), 34);
+			return 1;
+		}
+		nbyt += nlen;
+	}
+	return 0;
+}
+
+// Sort lines of a file (-mortonsort=...) by Morton key of their location: lines hold LCI strings
+// (lci=... or bare) or records (name=value fields, as for -encode), optionally after a BSSID,
+// so fleet files, and the input and output of -decode and -encode, can all be sorted.
+// Keys are found by worker threads; lines with the same key keep their order.
+
+struct MortonLine {
+	unsigned long long key;
+	int line;
+};
+
+struct MortonSort {		// (what workers fill in)
+	const char **lines;
+	MortonLine *keys;
+	signed char *ok;
+};
+
+void mortonworker (void *context, const CodecProfile *profile, const LciRecord *defaults, int lo, int hi) {
+	const char **lines = ((MortonSort *) context)->lines;
+	MortonLine *keys = ((MortonSort *) context)->keys;
+	signed char *ok = ((MortonSort *) context)->ok;
+	applyprofile(profile);
+	LciRecord rec;
+	char line[MAX_LINE];
+	for (int i = lo; i < hi; i++) {
+		snprintf(line, sizeof(line), "%s", lines[i]);
+		keys[i].line = i;
+		keys[i].key = 0;
+		char *rest = line;
+		char *token = nexttoken(&rest);
+		ok[i] = (token == NULL || *token == '#') ? -1 : 0;		// (-1 => dropped, as in batch modes)
+		if (ok[i] < 0) continue;
+		if (isValidBSSID(token)) token = nexttoken(&rest);
+		if (token == NULL) continue;
+		long long Latitude, Longitude;
+		if (_strnicmp(token, "lci=", 4) == 0 || ishexstring(token)) {
+			if (_strnicmp(token, "lci=", 4) == 0) token += 4;
+			if (! ishexstring(token) || ! lcifixedposition(token, &Latitude, &Longitude)) continue;
+		}
+		else {
+			memcpy(&rec, defaults, sizeof(LciRecord));
+			for (; token != NULL; token = nexttoken(&rest)) {
+				if (strncmp(token, "diagnostics=", 12) != 0 && ! parseLciField(&rec, token)) break;
+			}
+			if (token != NULL) continue;
+			Latitude = (long long)roundl(rec.latitude * (1 << 25));		// (as when encoding)
+			Longitude = (long long)roundl(rec.longitude * (1 << 25));
+		}
+		keys[i].key = mortonkey(Latitude, Longitude);
+		ok[i] = 1;
+	}
+	freeColocatedBSSIDs();		// (this thread's copy)
+}
+
+void mortonsort (const char *filename) {
+	long long start = nanoclock();
+	FileLines file;
+	if (! readlines(&file, filename)) return;
+	int nlines = file.nlines;
+	const char **lines = file.lines;
+	MortonLine *keys = (MortonLine *) malloc((nlines + 1) * sizeof(MortonLine));
+	signed char *ok = (signed char *) malloc(nlines + 1);
+	if (keys == NULL || ok == NULL) exit(1);
+	MortonSort sort = { lines, keys, ok };
+	splitlines(nlines, mortonworker, &sort);
+
+	int n = 0;		// (lines with keys moved to the front)
+	for (int i = 0; i < nlines; i++) {
+		if (ok[i] == 0) printf("ERROR: line %d: missing or invalid LCI string or record\n", i + 1);
+		if (ok[i] > 0) keys[n++] = keys[i];
+	}
+	std::sort(keys, keys + n,
+		[](const MortonLine &p, const MortonLine &q) { return p.key < q.key || (p.key == q.key && p.line < q.line); });
+	for (int k = 0; k < n; k++) {
+		const char *str = lines[keys[k].line];
+		fputs(str, stdout);
+		if (str[strlen(str) - 1] != '\n') putchar('\n');	// (last line of file)
+	}
+	if (verboseflag) printf("# %d of %d lines sorted in %.3f ms\n", n, nlines, (nanoclock() - start) * 1e-6);
+	free(keys);
+	free(ok);
+	freelines(&file);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Fleet table for the server (-fleet=...): BSSID -> decoded LCI of the APs in a fleet file,
+// split into shards, each an open addressing hash table (at most half full) followed by the
+// packed records. The whole table is published through an atomic pointer and read under
+// an epoch (see above), so lookups never wait. Reloading the file (SIGHUP, OP_FLEET) builds
+// a new table; changing one AP (OP_UPDATE) copies just its shard and the array of shard
+// pointers, sharing the rest. Whatever is replaced is retired.
+
+#define FLEET_SHARDS 64		// (top 6 bits of hash select shard)
+
+struct FleetEntry {
+	unsigned long long mac;		// BSSID as 48 bit number plus 1 (0 => empty)
+	int diag;					// diagnostics from decoding
+	int offset, nlen;			// of packed record (in shard's data)
+};
+
+struct FleetShard {
+	int nslots;			// (power of 2)
+	int count, datalen;
+	FleetEntry *slots;
+	unsigned char *data;
+};
+
+struct FleetTable {
+	unsigned int generation;
+	int count;
+	FleetShard *shards[FLEET_SHARDS];
+};
+
+struct FleetItem {		// one AP, while building shards
+	unsigned long long mac;
+	int diag, nlen;
+	const unsigned char *rec;	// packed
+};
+
+std::atomic<FleetTable *> currentfleet(NULL);
+std::mutex fleetlock;			// (writers)
+const char *fleetfile = NULL;	// -fleet=... fleet file to serve lookups from (reread on SIGHUP)
+
+unsigned long long INLINE macnumber (const unsigned char *mac) {
+	unsigned long long val = 0;
+	for (int k = 0; k < 6; k++) val = (val << 8) | mac[k];
+	return val + 1;
+}
+
+unsigned long long INLINE machash (unsigned long long mac) {
+	mac *= 0x9E3779B97F4A7C15ULL;
+	return mac ^ (mac >> 29);
+}
+
+// shard holding items (one allocation, so one free) --- a later item replaces an earlier
+// one with the same BSSID
+
+FleetShard *makeFleetShard (const FleetItem *items, int nitems) {
+	int nslots = 8, datalen = 0;
+	while (nslots < 2 * nitems) nslots *= 2;
+	for (int k = 0; k < nitems; k++) datalen += items[k].nlen;
+	char *block = (char *) malloc(sizeof(FleetShard) + nslots * sizeof(FleetEntry) + datalen);
+	if (block == NULL) exit(1);
+	FleetShard *shard = (FleetShard *) block;
+	shard->nslots = nslots;
+	shard->count = 0;
+	shard->datalen = 0;
+	shard->slots = (FleetEntry *)(block + sizeof(FleetShard));
+	shard->data = (unsigned char *)(shard->slots + nslots);
+	memset(shard->slots, 0, nslots * sizeof(FleetEntry));
+	for (int k = 0; k < nitems; k++) {
+		unsigned int j = (unsigned int) machash(items[k].mac) & (nslots - 1);
+		while (shard->slots[j].mac != 0 && shard->slots[j].mac != items[k].mac) j = (j + 1) & (nslots - 1);
+		FleetEntry *entry = &shard->slots[j];
+		if (entry->mac == 0) shard->count++;
+		entry->mac = items[k].mac;
+		entry->diag = items[k].diag;
+		entry->offset = shard->datalen;		// (replaced record's space is just left unused)
+		entry->nlen = items[k].nlen;
+		memcpy(shard->data + shard->datalen, items[k].rec, items[k].nlen);
+		shard->datalen += items[k].nlen;
+	}
+	return shard;
+}
+
+const FleetEntry *fleetfind (const FleetShard *shard, unsigned long long mac) {
+	unsigned int j = (unsigned int) machash(mac) & (shard->nslots - 1);
+	for (; shard->slots[j].mac != 0; j = (j + 1) & (shard->nslots - 1)) {
+		if (shard->slots[j].mac == mac) return &shard->slots[j];
+	}
+	return NULL;
+}
+
+// look up BSSID in current fleet (caller is in an epoch) --- returns 0 if not found
+
+int fleetlookup (const unsigned char *bssid, LciRecord *rec, int *diag) {
+	const FleetTable *table = currentfleet.load();
+	if (table == NULL) return 0;
+	unsigned long long mac = macnumber(bssid);
+	const FleetShard *shard = table->shards[machash(mac) >> 58];
+	const FleetEntry *entry = fleetfind(shard, mac);
+	if (entry == NULL) return 0;
+	*diag = entry->diag;
+	return unpackLciRecord(rec, shard->data + entry->offset, entry->nlen) > 0;
+}
+
+void releaseFleetShard (void *ptr) {
+	free(ptr);
+}
+
+void releaseFleetTable (void *ptr) {	// (not the shards, which may live on in a newer table)
+	delete (FleetTable *) ptr;
+}
+
+void releaseFleet (void *ptr) {			// table and all its shards
+	FleetTable *table = (FleetTable *) ptr;
+	for (int s = 0; s < FLEET_SHARDS; s++) free(table->shards[s]);
+	delete table;
+}
+
+// read fleet file into new current table (decoding with current profile, which caller
+// has entered) --- returns generation, or 0 if file could not be read
+
+unsigned int loadfleet (const char *filename) {
+	loadLciRecord(&activeprofile->defaults);	// (readFleet decodes starting from these)
+	int nfleet;
+	FleetAP *fleet = readFleet(filename, &nfleet);
+	if (fleet == NULL) return 0;
+	FleetItem *items = (FleetItem *) malloc((nfleet + 1) * sizeof(FleetItem));
+	unsigned char *packed = (unsigned char *) malloc((nfleet + 1) * (size_t) PACKED_RECORD_MAX);
+	int *counts = (int *) calloc(FLEET_SHARDS + 1, sizeof(int));
+	FleetItem *sorted = (FleetItem *) malloc((nfleet + 1) * sizeof(FleetItem));
+	if (items == NULL || packed == NULL || counts == NULL || sorted == NULL) exit(1);
+	for (int i = 0; i < nfleet; i++) {		// (items keep file order within shard)
+		items[i].mac = macnumber(fleet[i].bssid);
+		items[i].diag = fleet[i].diag;
+		items[i].rec = packed + i * (size_t) PACKED_RECORD_MAX;
+		items[i].nlen = packLciRecord(&fleet[i].rec, packed + i * (size_t) PACKED_RECORD_MAX);
+		counts[(machash(items[i].mac) >> 58) + 1]++;
+	}
+	for (int s = 0; s < FLEET_SHARDS; s++) counts[s + 1] += counts[s];
+	for (int i = 0; i < nfleet; i++) sorted[counts[machash(items[i].mac) >> 58]++] = items[i];
+	FleetTable *table = new FleetTable;
+	table->count = 0;
+	for (int s = 0, start = 0; s < FLEET_SHARDS; s++) {		// (counts[s] is now end of shard s)
+		table->shards[s] = makeFleetShard(sorted + start, counts[s] - start);
+		table->count += table->shards[s]->count;
+		start = counts[s];
+	}
+	free(sorted);
+	free(counts);
+	free(packed);
+	free(items);
+	freeFleet(fleet, nfleet);
+	std::lock_guard<std::mutex> guard(fleetlock);
+	FleetTable *current = currentfleet.load();
+	table->generation = (current != NULL) ? current->generation + 1 : 1;
+	currentfleet.store(table);
+	if (current != NULL) retire(current, releaseFleet);
+	return table->generation;
+}
+
+// add, replace (mac with rec) or remove (rec NULL) one AP --- returns generation
+
+unsigned int updatefleet (unsigned long long mac, const LciRecord *rec, int diag) {
+	unsigned char buf[PACKED_RECORD_MAX];
+	std::lock_guard<std::mutex> guard(fleetlock);
+	FleetTable *current = currentfleet.load();
+	FleetTable *table = new FleetTable;
+	if (current != NULL) *table = *current;
+	else {
+		memset((void *) table, 0, sizeof(FleetTable));
+		for (int s = 0; s < FLEET_SHARDS; s++) table->shards[s] = makeFleetShard(NULL, 0);
+	}
+	int s = (int)(machash(mac) >> 58);
+	FleetShard *old = table->shards[s];
+	FleetItem *items = (FleetItem *) malloc((old->count + 1) * sizeof(FleetItem));
+	if (items == NULL) exit(1);
+	int nitems = 0;
+	for (int j = 0; j < old->nslots; j++) {		// copy all but this one
+		const FleetEntry *entry = &old->slots[j];
+		if (entry->mac == 0 || entry->mac == mac) continue;
+		FleetItem *item = &items[nitems++];
+		item->mac = entry->mac;
+		item->diag = entry->diag;
+		item->rec = old->data + entry->offset;
+		item->nlen = entry->nlen;
+	}
+	if (rec != NULL) {
+		FleetItem *item = &items[nitems++];
+		item->mac = mac;
+		item->diag = diag;
+		item->rec = buf;
+		item->nlen = packLciRecord(rec, buf);
+	}
+	table->shards[s] = makeFleetShard(items, nitems);
+	free(items);
+	table->count += table->shards[s]->count - old->count;
+	table->generation = (current != NULL) ? current->generation + 1 : 1;
+	currentfleet.store(table);
+	if (current != NULL) {
+		retire(old, releaseFleetShard);
+		retire(current, releaseFleetTable);
+	}
+	else free(old);		// (never published)
+	return table->generation;
+}
+
+// reread fleet file in background (SIGHUP), so the reactor carries on meanwhile
+
+std::atomic<int> fleetloading(0);
+
+void reloadfleet (void) {
+	epochenter();
+	applyprofile(currentprofile.load());
+	loadfleet(fleetfile);
+	epochleave();
+	freeColocatedBSSIDs();
+	fleetloading = 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+
+// BSSID index file (-bssidindex=file): BSSID -> LCI of the AP it belongs to, whether it is the
+// AP's own BSSID or one of its colocated BSSIDs (COLOCATED_BSSID subelement). Built once (from
+// -fleet=...), then memory mapped, so it is ready as soon as it is opened. An open addressing
+// hash table (linear probing, at most half full) of 16-byte slots, four to a cache line, each
+// holding the BSSID and the offset of its AP's record --- the AP's BSSID and LCI string side
+// by side. A lookup so touches the line with the slot, then the one with the record.
+// An AP's own BSSID takes precedence over it being listed as colocated by another AP; a later
+// AP with the same BSSID replaces an earlier one (as for -fleet=...).
+
+#define BSSIDINDEX_MAGIC "LCIBSSID"
+#define BSSIDINDEX_VERSION 1
+
+struct BssidHeader {
+	char magic[8];
+	unsigned int version;
+	unsigned int byteorder;			// PERSIST_BYTEORDER as written by machine that made file
+	unsigned int slotsize;			// (changes when layout changes)
+	unsigned int reserved;
+	long long nslots;				// (power of two)
+	long long count;				// BSSIDs in table
+	long long naps;					// records (one per AP)
+	long long slotstart;			// offset of table of slots
+	long long recordstart;			// offset of records
+	long long size;					// of file
+};
+
+struct BssidSlot {
+	unsigned long long mac;		// BSSID as 48 bit number plus 1 (0 => empty)
+	unsigned long long offset;	// of record in file
+};
+
+struct BssidRecord {	// followed by LCI string (null terminated), padded to multiple of 8 bytes
+	unsigned char bssid[6];		// of AP
+	unsigned short lcilen;
+};
+
+struct BssidIndex {
+	MappedFile map;
+	const BssidHeader *header;
+	const BssidSlot *slots;
+};
+
+const char INLINE *bssidrecordlci (const BssidRecord *record) {
+	return (const char *)(record + 1);
+}
+
+// put BSSID in table (unless it is there already and replace is 0) --- returns 1 if slot was empty
+
+int bssidinsert (BssidSlot *slots, long long nslots, unsigned long long mac, unsigned long long offset,
+				 int replace, int *probes) {
+	long long j = (long long)(machash(mac) & (nslots - 1));
+	*probes = 1;
+	for (; slots[j].mac != 0 && slots[j].mac != mac; j = (j + 1) & (nslots - 1)) (*probes)++;
+	int empty = (slots[j].mac == 0);
+	if (empty || replace) {
+		slots[j].mac = mac;
+		slots[j].offset = offset;
+	}
+	return empty;
+}
+
+// Build BSSID index file from fleet file --- returns 0 on failure
+
+int buildbssidindex (const char *indexname, const char *fleetname) {
+	long long start = nanoclock();
+	int nfleet, oldquietflag = quietflag;
+	quietflag = 1;		// (problems decoding are kept in diag, not printed for each AP)
+	FleetAP *fleet = readFleet(fleetname, &nfleet);
+	quietflag = oldquietflag;
+	if (fleet == NULL) return 0;
+	long long nbssids = 0, recordsize = 0;
+	for (int k = 0; k < nfleet; k++) {
+		nbssids += 1 + fleet[k].rec.ncolocated;
+		recordsize += (sizeof(BssidRecord) + strlen(fleet[k].lci) + 1 + 7) & ~7LL;
+	}
+	long long nslots = 8;
+	while (nslots < 2 * nbssids) nslots *= 2;
+	BssidHeader header;
+	memset(&header, 0, sizeof(header));
+	header.version = BSSIDINDEX_VERSION;
+	header.byteorder = PERSIST_BYTEORDER;
+	header.slotsize = sizeof(BssidSlot);
+	header.nslots = nslots;
+	header.naps = nfleet;
+	header.slotstart = (sizeof(BssidHeader) + 63) & ~63LL;	// (slots aligned to cache lines)
+	header.recordstart = header.slotstart + nslots * (long long) sizeof(BssidSlot);
+	header.size = header.recordstart + recordsize;
+
+	BssidSlot *slots = (BssidSlot *) calloc(nslots, sizeof(BssidSlot));
+	char *records = (char *) calloc(recordsize + 1, 1);
+	if (slots == NULL || records == NULL) exit(1);
+	long long offset = 0, probes = 0, shadowed = 0, replaced = 0;
+	int nprobes;
+	for (int k = 0; k < nfleet; k++) {		// records, and own BSSIDs
+		BssidRecord *record = (BssidRecord *)(records + offset);
+		int lcilen = (int) strlen(fleet[k].lci);
+		memcpy(record->bssid, fleet[k].bssid, 6);
+		record->lcilen = (unsigned short) lcilen;
+		memcpy(record + 1, fleet[k].lci, lcilen + 1);
+		if (! bssidinsert(slots, nslots, macnumber(fleet[k].bssid), header.recordstart + offset, 1, &nprobes)) replaced++;
+		else header.count++;
+		probes += nprobes;
+		offset += (sizeof(BssidRecord) + lcilen + 1 + 7) & ~7LL;
+	}
+	offset = 0;
+	for (int k = 0; k < nfleet; k++) {		// colocated BSSIDs (own BSSIDs take precedence)
+		for (int c = 0; c < fleet[k].rec.ncolocated; c++) {
+			if (! bssidinsert(slots, nslots, macnumber(fleet[k].rec.colocated[c]), header.recordstart + offset, 0, &nprobes)) shadowed++;
+			else header.count++;
+			probes += nprobes;
+		}
+		offset += (sizeof(BssidRecord) + strlen(fleet[k].lci) + 1 + 7) & ~7LL;
+	}
+	long long build = nanoclock();
+
+	int ok = 0;
+	FILE *fp;
+	char tempname[MAX_LINE];	// (written aside, then renamed, so an open index is never truncated)
+	snprintf(tempname, sizeof(tempname), "%s.tmp", indexname);
+	if (fopen_s(&fp, tempname, "wb") != 0) printf("ERROR: unable to open %s\n", tempname);
+	else {
+		char pad[64];
+		memset(pad, 0, sizeof(pad));
+		ok = (fwrite(&header, sizeof(header), 1, fp) == 1);
+		ok = ok && fwrite(pad, 1, header.slotstart - sizeof(header), fp) == header.slotstart - sizeof(header);
+		ok = ok && fwrite(slots, sizeof(BssidSlot), nslots, fp) == (size_t) nslots;
+		ok = ok && fwrite(records, 1, recordsize, fp) == (size_t) recordsize;
+		if (ok) {	// magic last, marks file as complete
+			ok = (fseek(fp, 0, SEEK_SET) == 0 && fwrite(BSSIDINDEX_MAGIC, 1, 8, fp) == 8);
+		}
+		if (fclose(fp) != 0) ok = 0;
+		if (! ok) printf("ERROR: unable to write %s\n", tempname);
+		else if (! replacefile(tempname, indexname)) {
+			printf("ERROR: unable to replace %s\n", indexname);
+			ok = 0;
+		}
+		if (! ok) remove(tempname);
+	}
+	if (ok && verboseflag) {
+		printf("# BSSID index %s: %lld BSSIDs of %d APs (%lld replaced, %lld colocated shadowed), %lld slots, %.2f probes per BSSID\n",
+			   indexname, header.count, nfleet, replaced, shadowed, nslots, (nbssids > 0) ? (double) probes / nbssids : 0.0);
+		printf("# %lld bytes, built in %.3f ms, written in %.3f ms\n", header.size, (build - start) * 1e-6,
+			   (nanoclock() - build) * 1e-6);
+	}
+	free(slots);
+	free(records);
+	freeFleet(fleet, nfleet);
+	return ok;
+}
+
+int openbssidindex (BssidIndex *index, const char *filename) {
+	FILE *fp;
+	memset(index, 0, sizeof(BssidIndex));
+	if (fopen_s(&fp, filename, "rb") != 0) {	// (mapfile would create it)
+		printf("ERROR: unable to open BSSID index %s\n", filename);
+		return 0;
+	}
+	fclose(fp);
+	if (! mapfile(&index->map, filename, 0, 0)) {
+		printf("ERROR: unable to map BSSID index %s\n", filename);
+		return 0;
+	}
+	const BssidHeader *header = (const BssidHeader *) index->map.base;
+	if (index->map.size < (long long) sizeof(BssidHeader) || memcmp(header->magic, BSSIDINDEX_MAGIC, 8) != 0) {
+		printf("ERROR: %s is not a BSSID index file\n", filename);
+		unmapfile(&index->map);
+		return 0;
+	}
+	if (header->version != BSSIDINDEX_VERSION || header->byteorder != PERSIST_BYTEORDER ||
+		header->slotsize != sizeof(BssidSlot) || header->size > index->map.size ||
+		header->nslots <= 0 || (header->nslots & (header->nslots - 1)) != 0) {
+		printf("ERROR: BSSID index %s has a different layout --- rebuild it\n", filename);
+		unmapfile(&index->map);
+		return 0;
+	}
+	if (header->slotstart < (long long) sizeof(BssidHeader) || header->slotstart > header->size ||
+		header->nslots > (header->size - header->slotstart) / (long long) sizeof(BssidSlot) ||
+		header->recordstart < header->slotstart + header->nslots * (long long) sizeof(BssidSlot) ||
+		header->recordstart > header->size || header->count < 0 || header->count >= header->nslots) {
+		printf("ERROR: BSSID index %s is damaged --- rebuild it\n", filename);	// (regions outside file)
+		unmapfile(&index->map);
+		return 0;
+	}
+	index->header = header;
+	index->slots = (const BssidSlot *)(index->map.base + header->slotstart);
+	return 1;
+}
+
+void closebssidindex (BssidIndex *index) {
+	unmapfile(&index->map);
+	index->header = NULL;
+}
+
+// record of AP that BSSID belongs to --- NULL if not found (or its record is not inside the file)
+
+const BssidRecord *bssidlookup (const BssidIndex *index, const unsigned char *bssid) {
+	const BssidHeader *header = index->header;
+	unsigned long long mac = macnumber(bssid);
+	long long mask = header->nslots - 1, j = (long long)(machash(mac) & mask);
+	for (long long probes = 0; probes < header->nslots && index->slots[j].mac != 0; probes++, j = (j + 1) & mask) {
+		if (index->slots[j].mac != mac) continue;
+		unsigned long long offset = index->slots[j].offset;
+		if (offset < (unsigned long long) header->recordstart ||
+			offset >= (unsigned long long) header->size - sizeof(BssidRecord)) return NULL;
+		const BssidRecord *record = (const BssidRecord *)(index->map.base + offset);
+		if (record->lcilen >= header->size - (long long)(offset + sizeof(BssidRecord)) ||
+			bssidrecordlci(record)[record->lcilen] != '\0') return NULL;
+		return record;
+	}
+	return NULL;
+}
+
+// Build BSSID index (if fleet file given), then look up -lookup=... BSSIDs in it --- prints
+// "BSSID lci=..." for each (with LCI of AP it belongs to) --- returns number not found
+
+int bssidindex (const char *indexname, const char *fleetname) {
+	if (fleetname != NULL && ! buildbssidindex(indexname, fleetname)) return 1;
+	if (lookupquery == NULL) {
+		if (fleetname == NULL) printf("ERROR: need -fleet=... to build BSSID index, or -lookup=... to query it\n");
+		return (fleetname == NULL);
+	}
+	long long start = nanoclock();
+	BssidIndex index;
+	if (! openbssidindex(&index, indexname)) return 1;
+	long long opened = nanoclock();
+	int nfound = 0, nmissing = 0;
+	const char *next = lookupquery;
+	while (*next != '\0') {
+		const char *token = next, *comma = strchr(next, ',');
+		int nlen = (comma != NULL) ? (int)(comma - next) : (int) strlen(next);
+		char name[BSSID_TEXT];
+		unsigned char bssid[6];
+		snprintf(name, sizeof(name), "%.*s", (nlen < BSSID_TEXT) ? nlen : BSSID_TEXT - 1, next);
+		next += nlen + (comma != NULL);
+		if (nlen >= BSSID_TEXT || ! parseBSSID(name, bssid)) {
+			printf("ERROR: invalid BSSID %.*s\n", nlen, token);
+			nmissing++;
+			continue;
+		}
+		const BssidRecord *record = bssidlookup(&index, bssid);
+		if (record == NULL) {
+			printf("ERROR: BSSID %s not in %s\n", name, indexname);
+			nmissing++;
+			continue;
+		}
+		nfound++;
+		formatBSSID(name, bssid);
+		printf("%s lci=%s\n", name, bssidrecordlci(record));
+		if (verboseflag && memcmp(record->bssid, bssid, 6) != 0) {
+			char owner[BSSID_TEXT];
+			formatBSSID(owner, record->bssid);
+			printf("#\tcolocated with %s\n", owner);
+		}
+	}
+	if (verboseflag) {
+		printf("# %d of %d BSSIDs found (index of %lld BSSIDs opened in %.3f ms, looked up in %.3f ms)\n", nfound,
+			   nfound + nmissing, index.header->count, (opened - start) * 1e-6, (nanoclock() - opened) * 1e-6);
+	}
+	closebssidindex(&index);
+	return nmissing;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Server mode (-serve=/run/lcicoder.sock): a long running process answering requests over
+// a Unix domain socket, so clients don't pay for starting a process for each request.
+//
+// Binary protocol --- little-endian, length prefixed frames, with any number of requests
+// in flight on one connection (responses may come back in a different order):
+//	request:	u32 length (of rest of frame), u32 id (echoed in response), u8 op, payload
+//	response:	u32 length, u32 id, u8 op, u8 status, u32 diagnostics (bit mask), payload
+// Operations (LCI strings are hexadecimal ASCII, records are packed as by packLciRecord):
+//	OP_ENCODE	record -> LCI string
+//	OP_DECODE	LCI string -> record
+//	OP_VALIDATE	LCI string -> names of diagnostics (comma separated, empty if none)
+//	OP_PATCH	LCI string, 0 octet, fields to change (name=value ...) -> LCI string
+//	OP_ATTACH	(empty) -> (empty), with shared memory rings (see below)
+//	OP_PROFILE	settings (name=value ...) to change, or empty to reread -profile=... file
+//				-> generation=n (of new profile)
+//	OP_LOOKUP	BSSID -> record of AP in fleet (STATUS_NOT_FOUND if not there)
+//	OP_UPDATE	BSSID and LCI string (as in fleet file) to add or change AP in fleet, or
+//				BSSID alone to remove it -> generation=n (of fleet)
+//	OP_FLEET	(empty) -> generation=n, after rereading -fleet=... file
+//	OP_METRICS	(empty) -> metrics (Prometheus text format, see below; not over shared memory)
+// Encoding (OP_ENCODE, OP_PATCH) fails with STATUS_REJECTED when the profile says android=reject
+// and Android would not provide location information.
+// Reactor threads (epoll) read requests and send responses, worker threads do the work.
+// Compiled as C++20, each connection is read by a coroutine of its own (see connreader).
+
+enum server_ops { OP_ENCODE = 1, OP_DECODE = 2, OP_VALIDATE = 3, OP_PATCH = 4, OP_ATTACH = 5, OP_PROFILE = 6,
+				  OP_LOOKUP = 7, OP_UPDATE = 8, OP_FLEET = 9, OP_METRICS = 10, NUM_OPS };
+
+const char *server_op_names[NUM_OPS] = {
+	"none", "encode", "decode", "validate", "patch", "attach", "profile", "lookup", "update", "fleet",
+	"metrics",
+};
+
+enum server_status { STATUS_OK = 0, STATUS_BAD_REQUEST = 1, STATUS_BAD_OP = 2, STATUS_REJECTED = 3,
+					 STATUS_NOT_FOUND = 4, NUM_STATUS };
+
+const char *server_status_names[NUM_STATUS] = { "ok", "bad_request", "bad_op", "rejected", "not_found" };
+
+#define MAX_FRAME 65536		// longest request accepted
+#define REQUEST_HEADER 9	// length, id, op
+#define RESPONSE_HEADER 14	// length, id, op, status, diagnostics
+
+CodecProfile baseprofile;	// from command line (-profile=... file is read on top of it)
+
+void INLINE putle32 (char *str, unsigned int val) {
+	for (int k = 0; k < 4; k++) str[k] = (char)((val >> (k*8)) & 0xFF);
+}
+
+unsigned int INLINE getle32 (const char *str) {
+	const unsigned char *ustr = (const unsigned char *) str;
+	return ustr[0] | (ustr[1] << 8) | (ustr[2] << 16) | ((unsigned int) ustr[3] << 24);
+}
+
+int INLINE rejected (int diag) {
+	return androidpolicy == ANDROID_REJECT && (diag & (1 << DIAG_ANDROID));
+}
+
+// Carry out one request --- writes response payload into out (of size maxlen, which bounds
+// all output; records need PACKED_RECORD_MAX) and returns its length, along with status and
+// diagnostics. (shmserve passes SHM_PAYLOAD, the socket path a whole frame.)
+// NOTE: caller has entered and applied a profile (activeprofile)
+
+int serverequest (int op, const char *payload, int nlen, char *out, int maxlen, int *status, int *diag) {
+	char str[MAX_LINE];
+	LciRecord rec;
+	*status = STATUS_OK;
+	*diag = 0;
+	if (op == OP_ENCODE) {
+		if (unpackLciRecord(&rec, (const unsigned char *) payload, nlen) != nlen) {
+			*status = STATUS_BAD_REQUEST;
+			return 0;
+		}
+		*diag = cachedEncode(&rec, out, maxlen);
+		if (! rejected(*diag)) return strlen(out);
+		*status = STATUS_REJECTED;
+		return 0;
+	}
+	if (op == OP_PROFILE) {
+		char text[MAX_LINE];
+		if (nlen >= (int)sizeof(text)) {
+			*status = STATUS_BAD_REQUEST;
+			return 0;
+		}
+		memcpy(text, payload, nlen);
+		text[nlen] = '\0';
+		unsigned int generation = updateprofile(&baseprofile, (nlen > 0) ? text : NULL);
+		if (generation == 0) *status = STATUS_BAD_REQUEST;
+		return (generation == 0) ? 0 : snprintf(out, maxlen, "generation=%u", generation);
+	}
+	if (op == OP_LOOKUP || op == OP_UPDATE) {
+		char text[MAX_LINE];
+		unsigned char bssid[6];
+		if (nlen >= (int)sizeof(text)) nlen = 0;
+		memcpy(text, payload, nlen);
+		text[nlen] = '\0';
+		char *rest = text;
+		char *token = nexttoken(&rest);
+		if (token == NULL || ! parseBSSID(token, bssid)) {
+			*status = STATUS_BAD_REQUEST;
+			return 0;
+		}
+		if (op == OP_LOOKUP) {
+			if (fleetlookup(bssid, &rec, diag)) return packLciRecord(&rec, (unsigned char *) out);
+			*status = STATUS_NOT_FOUND;
+			return 0;
+		}
+		const char *lci = nexttoken(&rest);
+		if (lci != NULL && _strnicmp(lci, "lci=", 4) == 0) lci += 4;
+		if (lci != NULL && ! ishexstring(lci)) {
+			*status = STATUS_BAD_REQUEST;
+			return 0;
+		}
+		if (lci != NULL) *diag = cachedDecode(lci, &activeprofile->defaults, &rec);
+		unsigned int generation = updatefleet(macnumber(bssid), (lci != NULL) ? &rec : NULL, *diag);
+		return snprintf(out, maxlen, "generation=%u", generation);
+	}
+	if (op == OP_FLEET) {
+		unsigned int generation = (fleetfile != NULL) ? loadfleet(fleetfile) : 0;
+		if (generation == 0) *status = STATUS_BAD_REQUEST;
+		return (generation == 0) ? 0 : snprintf(out, maxlen, "generation=%u", generation);
+	}
+	if (op != OP_DECODE && op != OP_VALIDATE && op != OP_PATCH) {
+		*status = STATUS_BAD_OP;
+		return 0;
+	}
+	int slen = 0;	// LCI string runs to end of payload (or to 0 octet for OP_PATCH)
+	while (slen < nlen && payload[slen] != '\0') slen++;
+	if (slen >= (int)sizeof(str)) slen = 0;
+	memcpy(str, payload, slen);
+	str[slen] = '\0';
+	if (! ishexstring(str)) {
+		*status = STATUS_BAD_REQUEST;
+		return 0;
+	}
+	*diag = cachedDecode(str, &activeprofile->defaults, &rec);
+	if (op == OP_DECODE) return packLciRecord(&rec, (unsigned char *) out);
+	if (op == OP_VALIDATE) {
+		formatDiagnostics(out, maxlen, *diag);
+		return strlen(out);
+	}
+	int flen = nlen - slen - 1;		// OP_PATCH: apply fields, then encode again
+	if (flen < 0) flen = 0;
+	if (flen >= (int)sizeof(str)) {
+		*status = STATUS_BAD_REQUEST;
+		return 0;
+	}
+	memcpy(str, payload + slen + 1, flen);
+	str[flen] = '\0';
+	char *rest = str, *token;
+	while ((token = nexttoken(&rest)) != NULL) {
+		if (! parseLciField(&rec, token)) {
+			*status = STATUS_BAD_REQUEST;
+			return 0;
+		}
+	}
+	*diag |= cachedEncode(&rec, out, maxlen);
+	if (! rejected(*diag)) return strlen(out);
+	*status = STATUS_REJECTED;
+	return 0;
+}
+
+// Server metrics: latency histogram per operation (log-linear buckets as in HdrHistogram,
+// 8 per power of 2, so within 12.5%), and counts of requests by status and of diagnostics
+// by code. Each thread counts in its own block --- only it writes there, so no atomic
+// read-modify-write and no cache lines shared with other threads --- and a scrape adds
+// up all the blocks. Blocks of threads that end are kept (counts must not go backwards)
+// and reused by the next thread.
+
+#define LATENCY_SUB_BITS 3
+#define LATENCY_SUB (1 << LATENCY_SUB_BITS)		// buckets per power of 2
+#define LATENCY_MAX_BITS 40						// (ns, longer counted in last bucket)
+#define LATENCY_BUCKETS ((LATENCY_MAX_BITS - LATENCY_SUB_BITS + 1) * LATENCY_SUB)
+
+struct ThreadMetrics {
+	ThreadMetrics *next;	// (all blocks)
+	int inuse;				// (by a thread)
+	std::atomic<long long> latency[NUM_OPS][LATENCY_BUCKETS];	// requests per bucket
+	std::atomic<long long> latencysum[NUM_OPS];					// (ns)
+	std::atomic<long long> requests[NUM_OPS][NUM_STATUS];
+	std::atomic<long long> diagcounts[NUM_DIAGNOSTICS];
+};
+
+ThreadMetrics *allmetrics = NULL;
+std::mutex metricslock;		// (adding or taking blocks, scraping)
+thread_local ThreadMetrics *threadmetrics = NULL;
+
+int INLINE latencybucket (long long ns) {
+	if (ns < LATENCY_SUB) return (ns < 0) ? 0 : (int) ns;
+#ifdef _MSC_VER
+	unsigned long top;
+	_BitScanReverse64(&top, (unsigned long long) ns);
+	int bits = (int) top;
+#else
+	int bits = 63 - __builtin_clzll((unsigned long long) ns);
+#endif
+	if (bits >= LATENCY_MAX_BITS) return LATENCY_BUCKETS - 1;
+	return (bits - LATENCY_SUB_BITS + 1) * LATENCY_SUB + (int)((ns >> (bits - LATENCY_SUB_BITS)) & (LATENCY_SUB - 1));
+}
+
+long long latencybound (int bucket) {	// (ns) upper end of bucket
+	if (bucket < LATENCY_SUB) return bucket + 1;
+	int shift = bucket / LATENCY_SUB - 1;
+	return (long long)(LATENCY_SUB + bucket % LATENCY_SUB + 1) << shift;
+}
+
+ThreadMetrics *takemetrics (void) {
+	std::lock_guard<std::mutex> guard(metricslock);
+	ThreadMetrics *metrics = allmetrics;
+	while (metrics != NULL && metrics->inuse) metrics = metrics->next;
+	if (metrics == NULL) {
+		metrics = new ThreadMetrics();	// (value-initialized: counters start at 0)
+		metrics->next = allmetrics;
+		allmetrics = metrics;
+	}
+	metrics->inuse = 1;
+	return metrics;
+}
+
+void releasemetrics (void) {	// (thread ending)
+	if (threadmetrics == NULL) return;
+	std::lock_guard<std::mutex> guard(metricslock);
+	threadmetrics->inuse = 0;
+	threadmetrics = NULL;
+}
+
+void freemetrics (void) {	// (no threads left)
+	while (allmetrics != NULL) {
+		ThreadMetrics *next = allmetrics->next;
+		delete allmetrics;
+		allmetrics = next;
+	}
+}
+
+void INLINE bump (std::atomic<long long> &counter, long long n) {	// (owner thread only)
+	counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+void countdiagnostics (int diag) {
+	if (diag == 0) return;
+	if (threadmetrics == NULL) threadmetrics = takemetrics();
+	for (int code = 0; code < NUM_DIAGNOSTICS; code++)
+		if (diag & (1 << code)) bump(threadmetrics->diagcounts[code], 1);
+}
+
+void recordrequest (int op, int status, long long ns) {
+	if (threadmetrics == NULL) threadmetrics = takemetrics();
+	if (op < 0 || op >= NUM_OPS) op = 0;
+	if (status < 0 || status >= NUM_STATUS) status = STATUS_BAD_REQUEST;
+	bump(threadmetrics->latency[op][latencybucket(ns)], 1);
+	bump(threadmetrics->latencysum[op], ns);
+	bump(threadmetrics->requests[op][status], 1);
+}
+
+// HTTP/JSON flavour of the same requests (-http=port, on localhost) --- POST /encode,
+// POST /decode, or POST /validate, with a single value or an array of them in the body:
+//	/encode		{"lat": 42.36, "lon": -71.09, ... "BSSID": ["00:11:22:33:44:55"]}
+//				-> {"lci": "0100...", "diagnostics": []}
+//	/decode		"0100..." or {"lci": "0100..."} -> {"lat": 42.36, ... "diagnostics": []}
+//	/validate	"0100..." or {"lci": "0100..."} -> {"valid": true, "diagnostics": []}
+//	/lookup		"00:11:22:33:44:55" -> {"lat": 42.36, ... "diagnostics": []} (or null if not in fleet)
+// Field names are the ones used by -decode / -encode; fields left out of a record to be
+// encoded take the values given on the command line. GET /metrics returns the server
+// metrics (text, see above).
+
+#define MAX_BODY (1 << 20)	// largest HTTP request body accepted
+
+struct JsonCursor {
+	const char *p, *end;
+};
+
+int INLINE jsonpeek (JsonCursor *cur) {	// next non-blank character (or -1 at end)
+	while (cur->p < cur->end && isblankchar(*cur->p)) cur->p++;
+	return (cur->p < cur->end) ? (unsigned char) *cur->p : -1;
+}
+
+int INLINE jsonexpect (JsonCursor *cur, int c) {
+	if (jsonpeek(cur) != c) return 0;
+	cur->p++;
+	return 1;
+}
+
+// read string (ASCII only) --- returns 0 if malformed or longer than nlen-1
+
+int jsonstring (JsonCursor *cur, char *str, int nlen) {
+	if (! jsonexpect(cur, '"')) return 0;
+	int k = 0;
+	while (cur->p < cur->end && *cur->p != '"') {
+		int c = (unsigned char) *cur->p++;
+		if (c == '\\') {
+			if (cur->p >= cur->end) return 0;
+			c = *cur->p++;
+			if (c == 'b') c = '\b';
+			else if (c == 'f') c = '\f';
+			else if (c == 'n') c = '\n';
+			else if (c == 'r') c = '\r';
+			else if (c == 't') c = '\t';
+			else if (c == 'u') {
+				unsigned int u;
+				char hex[5];
+				if (cur->end - cur->p < 4) return 0;
+				memcpy(hex, cur->p, 4);
+				hex[4] = '\0';
+				if (! ishexstring(hex) || sscanf_s(hex, "%x", &u) != 1 || u == 0 || u > 0x7F) return 0;
+				c = (int) u;
+				cur->p += 4;
+			}
+			else if (c != '"' && c != '\\' && c != '/') return 0;
+		}
+		else if (c < 0x20) return 0;
+		if (k >= nlen - 1) return 0;
+		str[k++] = (char) c;
+	}
+	str[k] = '\0';
+	return jsonexpect(cur, '"');
+}
+
+const char *jsondigits (const char *p, const char *end) {	// (past decimal digits)
+	while (p < end && *p >= '0' && *p <= '9') p++;
+	return p;
+}
+
+// is str (n characters) a JSON number ? -?(0|[1-9][0-9]*)(.[0-9]+)?([eE][+-]?[0-9]+)?
+// (strtod would also take nan, inf, hex, +1, .5 and 1.)
+
+int jsonnumber (const char *str, int n) {
+	const char *p = str, *end = str + n, *q;
+	if (p < end && *p == '-') p++;
+	if ((q = jsondigits(p, end)) == p || (*p == '0' && q > p + 1)) return 0;	// (no leading zeros)
+	p = q;
+	if (p < end && *p == '.') {
+		p++;
+		if ((q = jsondigits(p, end)) == p) return 0;
+		p = q;
+	}
+	if (p < end && (*p == 'e' || *p == 'E')) {
+		if (++p < end && (*p == '+' || *p == '-')) p++;
+		if ((q = jsondigits(p, end)) == p) return 0;
+		p = q;
+	}
+	return p == end;
+}
+
+// read number or true/false/null as text (true -> 1, false -> 0) --- returns 0 if malformed
+
+int jsonscalar (JsonCursor *cur, char *str, int nlen) {
+	jsonpeek(cur);
+	const char *start = cur->p;
+	while (cur->p < cur->end && strchr("+-.0123456789eEtruefalsn", *cur->p) != NULL) cur->p++;
+	int n = (int)(cur->p - start);
+	if (n == 0 || n >= nlen) return 0;
+	if (n == 4 && strncmp(start, "true", 4) == 0) strcpy(str, "1");
+	else if (n == 5 && strncmp(start, "false", 5) == 0) strcpy(str, "0");
+	else if (n == 4 && strncmp(start, "null", 4) == 0) str[0] = '\0';
+	else {
+		if (! jsonnumber(start, n)) return 0;
+		memcpy(str, start, n);
+		str[n] = '\0';
+	}
+	return 1;
+}
+
+// read record object --- fields as in parseLciField (BSSID may also be an array of strings)
+
+int jsonrecord (JsonCursor *cur, LciRecord *rec) {
+	char token[MAX_LINE];
+	if (! jsonexpect(cur, '{')) return 0;
+	if (jsonexpect(cur, '}')) return 1;
+	do {
+		if (! jsonstring(cur, token, 64) || ! jsonexpect(cur, ':')) return 0;
+		int k = strlen(token);
+		token[k++] = '=';
+		int c = jsonpeek(cur);
+		if (c == '"') {
+			if (! jsonstring(cur, token + k, sizeof(token) - k)) return 0;
+		}
+		else if (c == '[') {	// list of strings, joined by commas
+			cur->p++;
+			token[k] = '\0';
+			if (! jsonexpect(cur, ']')) {
+				do {
+					int n = strlen(token);
+					if (n > k) token[n++] = ',';
+					if (! jsonstring(cur, token + n, sizeof(token) - n)) return 0;
+				} while (jsonexpect(cur, ','));
+				if (! jsonexpect(cur, ']')) return 0;
+			}
+		}
+		else if (! jsonscalar(cur, token + k, sizeof(token) - k)) return 0;
+		if (token[k] != '\0' && ! parseLciField(rec, token)) return 0;	// (null leaves field alone)
+	} while (jsonexpect(cur, ','));
+	return jsonexpect(cur, '}');
+}
+
+// read LCI string, bare or as {"lci": "..."}
+
+int jsonlci (JsonCursor *cur, char *str, int nlen) {
+	if (jsonpeek(cur) == '"') return jsonstring(cur, str, nlen) && ishexstring(str);
+	char name[64];
+	if (! jsonexpect(cur, '{') || ! jsonstring(cur, name, sizeof(name)) || strcmp(name, "lci") != 0 ||
+		! jsonexpect(cur, ':') || ! jsonstring(cur, str, nlen) || ! jsonexpect(cur, '}')) return 0;
+	return ishexstring(str);
+}
+
+void jsondiagnostics (TextBuffer *out, int diag) {
+	appendtext(out, "\"diagnostics\":[");
+	int n = 0;
+	for (int k = 0; k < NUM_DIAGNOSTICS; k++) {
+		if (diag & (1 << k)) appendtext(out, "%s\"%s\"", (n++ > 0) ? "," : "", diagnostic_names[k]);
+	}
+	appendtext(out, "]");
+}
+
+void jsonwriterecord (TextBuffer *out, const LciRecord *rec) {
+	char str[64];
+	for (int f = 0; f < NUM_LCIFIELDS; f++) {
+		const LciField *field = &lcifields[f];
+		appendtext(out, "\"%s\":", field->name);
+		if (field->type == FIELD_DOUBLE) {
+			double val = *fielddouble(rec, field);
+			if (val != val || val - val != 0) appendtext(out, "null,");	// (NaN or infinite)
+			else {
+				formatdouble(str, sizeof(str), val);
+				appendtext(out, "%s,", str);
+			}
+		}
+		else if (field->type == FIELD_INT) appendtext(out, "%d,", *fieldint(rec, field));
+		else {
+			appendtext(out, "[");
+			for (int b = 0; b < rec->ncolocated; b++) {
+				formatBSSID(str, rec->colocated[b]);
+				appendtext(out, "%s\"%s\"", (b > 0) ? "," : "", str);
+			}
+			appendtext(out, "],");
+		}
+	}
+}
+
+// one element of request body --- returns 0 if malformed
+
+int jsonelement (int op, JsonCursor *cur, TextBuffer *out) {
+	char str[MAX_LINE];
+	LciRecord rec;
+	int diag;
+	if (op == OP_LOOKUP) {
+		unsigned char bssid[6];
+		if (! jsonstring(cur, str, sizeof(str)) || ! parseBSSID(str, bssid)) return 0;
+		if (! fleetlookup(bssid, &rec, &diag)) {
+			appendtext(out, "null");
+			return 1;
+		}
+		appendtext(out, "{");
+		jsonwriterecord(out, &rec);
+	}
+	else if (op == OP_ENCODE) {
+		rec = activeprofile->defaults;
+		if (! jsonrecord(cur, &rec)) return 0;
+		diag = cachedEncode(&rec, str, sizeof(str));
+		if (rejected(diag)) appendtext(out, "{\"lci\":null,\"rejected\":true,");
+		else appendtext(out, "{\"lci\":\"%s\",", str);
+	}
+	else {
+		if (! jsonlci(cur, str, sizeof(str))) return 0;
+		diag = cachedDecode(str, &activeprofile->defaults, &rec);
+		appendtext(out, "{");
+		if (op == OP_DECODE) jsonwriterecord(out, &rec);
+		else appendtext(out, "\"valid\":%s,", (diag == 0) ? "true" : "false");
+	}
+	jsondiagnostics(out, diag);
+	countdiagnostics(diag);
+	appendtext(out, "}");
+	return 1;
+}
+
+// Carry out HTTP request, given route (OP_ENCODE, OP_DECODE, OP_VALIDATE or OP_LOOKUP) and body ---
+// writes JSON response body into out, returns HTTP status code
+
+int httprequest (int op, const char *body, int nlen, TextBuffer *out) {
+	JsonCursor cur = { body, body + nlen };
+	out->len = 0;
+	int ok;
+	if (jsonpeek(&cur) == '[') {
+		cur.p++;
+		appendtext(out, "[");
+		ok = 1;
+		if (! jsonexpect(&cur, ']')) {
+			int n = 0;
+			do {
+				if (n++ > 0) appendtext(out, ",");
+				ok = jsonelement(op, &cur, out);
+			} while (ok && jsonexpect(&cur, ','));
+			ok = ok && jsonexpect(&cur, ']');
+		}
+		appendtext(out, "]\n");
+	}
+	else {
+		ok = jsonelement(op, &cur, out);
+		appendtext(out, "\n");
+	}
+	if (ok && jsonpeek(&cur) == -1) return 200;
+	out->len = 0;
+	appendtext(out, "{\"error\":\"malformed %s near offset %d\"}\n",
+			   (op == OP_ENCODE) ? "record" : (op == OP_LOOKUP) ? "BSSID" : "LCI string", (int)(cur.p - body));
+	return 400;
+}
+
+#ifdef __linux__
+
+enum server_protocols { PROTOCOL_BINARY, PROTOCOL_HTTP };
+
+struct ServerReply {	// HTTP response finished ahead of its turn
+	ServerReply *next;
+	unsigned int seq;
+	int last;			// (close connection after it)
+	int nlen;
+	char data[1];		// (actually nlen bytes)
+};
+
+// Connections and requests come from pools and go back to them, so nothing is allocated
+// for a request (unless its payload is large) and little for a connection: buffers start
+// small (grow when needed) and are kept (up to a point) for the next connection.
+// There may be several reactors (-reactors=...), each with its own epoll set; all of them
+// watch the listening sockets (EPOLLEXCLUSIVE), a connection stays with the one that
+// accepted it. Coroutine frames (C++20) are pooled the same way.
+
+#define CONN_BUFFER 4096	// initial size of connection input and output buffers
+#define CONN_KEEP 65536		// largest buffers kept when connection goes back to pool
+#define JOB_PAYLOAD 1024	// payloads up to this size are kept in the (pooled) job
+#define POOL_SLAB 64		// connections or jobs allocated at a time
+
+struct ServerConn {
+	ServerConn *next;			// (in pool)
+	int fd;
+	int epoll;					// of reactor it belongs to
+	int protocol;
+	int listening;				// (listening socket, not a connection)
+	std::atomic<int> refs;		// reactor's, plus one per request in progress
+	std::atomic<int> closed;
+	std::mutex lock;			// guards output (both reactor and workers send)
+	char *inbuf;
+	int inlen, incap;
+	char *outbuf;				// unsent output is outbuf[outpos] to outbuf[outlen-1]
+	int outpos, outlen, outcap;
+	int wantwrite;				// EPOLLOUT requested
+	unsigned int readseq;		// HTTP: requests read so far (reactor only)
+	unsigned int sendseq;		// HTTP: responses queued for sending so far
+	ServerReply *pending;		// HTTP: responses waiting for earlier ones
+	int lastrequest;			// HTTP: "Connection: close" seen, read no further
+	int closeafter;				// HTTP: shut down once output is sent
+	long long received;			// (nanoclock) when requests last read
+#if __cpp_impl_coroutine
+	std::coroutine_handle<> reader;	// (suspended until connection is readable)
+#endif
+};
+
+struct ServerJob {
+	ServerJob *next;	// (in pool)
+	ServerConn *conn;
+	unsigned int id;	// (binary) request id, (HTTP) sequence number on connection
+	int op, nlen;
+	int httpstatus;		// (HTTP) error found while reading request, or 0
+	int lastrequest;	// (HTTP) close connection after response
+	long long received;	// (nanoclock) when read, for latency metrics
+	char *payload;		// nlen bytes (plus 0), in space below or allocated
+	char space[JOB_PAYLOAD + 1];
+};
+
+struct ServerPool {		// (free lists)
+	std::mutex lock;
+	ServerConn *conns;
+	ServerJob *jobs;
+	void **connslabs, **jobslabs;	// everything allocated (freed when server stops)
+	int nconnslabs, njobslabs;
+#if __cpp_impl_coroutine
+	void *frames;			// coroutine frames (all the same size)
+	size_t framesize;
+	void **frameslabs;
+	int nframeslabs;
+#endif
+};
+
+ServerPool serverpool;
+std::atomic<int> openconns(0);		// (for metrics)
+std::atomic<int> shmclients(0);		// attached clients (shared memory)
+thread_local ServerJob *localjobs = NULL;	// reactor's own free jobs (taken from pool in bulk)
+
+struct JobQueue {		// ring buffer of jobs waiting for a worker
+	std::mutex lock;
+	std::condition_variable ready;
+	ServerJob **jobs;
+	int head, count, capacity;
+	int maxcount;		// (most jobs ever waiting)
+	int stopping;
+};
+
+JobQueue jobqueue;
+volatile sig_atomic_t serverstop = 0;
+volatile sig_atomic_t serverreload = 0;		// (SIGHUP)
+
+void serversignal (int sig) {
+	if (sig == SIGHUP) serverreload = 1;
+	else serverstop = 1;
+}
+
+void pushjobs (ServerJob **jobs, int njobs) {
+	std::lock_guard<std::mutex> guard(jobqueue.lock);
+	if (jobqueue.count + njobs > jobqueue.capacity) {	// grow, unwrapping ring
+		int capacity = jobqueue.capacity * 2;
+		while (jobqueue.count + njobs > capacity) capacity *= 2;
+		ServerJob **newjobs = (ServerJob **) malloc(capacity * sizeof(ServerJob *));
+		if (newjobs == NULL) exit(1);
+		for (int k = 0; k < jobqueue.count; k++)
+			newjobs[k] = jobqueue.jobs[(jobqueue.head + k) % jobqueue.capacity];
+		free(jobqueue.jobs);
+		jobqueue.jobs = newjobs;
+		jobqueue.head = 0;
+		jobqueue.capacity = capacity;
+	}
+	for (int k = 0; k < njobs; k++)
+		jobqueue.jobs[(jobqueue.head + jobqueue.count++) % jobqueue.capacity] = jobs[k];
+	if (jobqueue.count > jobqueue.maxcount) jobqueue.maxcount = jobqueue.count;
+	if (njobs > 1) jobqueue.ready.notify_all();
+	else jobqueue.ready.notify_one();
+}
+
+// wait for jobs, take up to maxjobs of them --- returns 0 when server is stopping
+
+int popjobs (ServerJob **jobs, int maxjobs) {
+	std::unique_lock<std::mutex> guard(jobqueue.lock);
+	while (jobqueue.count == 0 && ! jobqueue.stopping) jobqueue.ready.wait(guard);
+	int njobs = 0;
+	while (njobs < maxjobs && jobqueue.count > 0) {
+		jobs[njobs++] = jobqueue.jobs[jobqueue.head];
+		jobqueue.head = (jobqueue.head + 1) % jobqueue.capacity;
+		jobqueue.count--;
+	}
+	return njobs;
+}
+
+void addslab (void ***slabs, int *nslabs, void *slab) {	// (caller holds serverpool.lock)
+	if ((*nslabs & (*nslabs - 1)) == 0) {	// (0, 1, 2, 4, ...: grow)
+		*slabs = (void **) realloc(*slabs, (*nslabs == 0 ? 1 : 2 * *nslabs) * sizeof(void *));
+		if (*slabs == NULL) exit(1);
+	}
+	(*slabs)[(*nslabs)++] = slab;
+}
+
+ServerConn *getconn (void) {
+	std::lock_guard<std::mutex> guard(serverpool.lock);
+	if (serverpool.conns == NULL) {
+		ServerConn *slab = new ServerConn[POOL_SLAB]();		// (refs 0 while free)
+		addslab(&serverpool.connslabs, &serverpool.nconnslabs, slab);
+		for (int k = 0; k < POOL_SLAB; k++) {
+			slab[k].inbuf = slab[k].outbuf = NULL;
+			slab[k].next = serverpool.conns;
+			serverpool.conns = &slab[k];
+		}
+	}
+	ServerConn *conn = serverpool.conns;
+	serverpool.conns = conn->next;
+	return conn;
+}
+
+void putconn (ServerConn *conn) {
+	if (conn->incap > CONN_KEEP) {	// (keep buffers, unless they grew large)
+		free(conn->inbuf);
+		conn->inbuf = NULL;
+	}
+	if (conn->outcap > CONN_KEEP) {
+		free(conn->outbuf);
+		conn->outbuf = NULL;
+	}
+	std::lock_guard<std::mutex> guard(serverpool.lock);
+	conn->next = serverpool.conns;
+	serverpool.conns = conn;
+}
+
+ServerJob *getjob (void) {	// (reactor)
+	if (localjobs == NULL) {
+		std::lock_guard<std::mutex> guard(serverpool.lock);
+		localjobs = serverpool.jobs;	// (all of them)
+		serverpool.jobs = NULL;
+		if (localjobs == NULL) {
+			ServerJob *slab = new ServerJob[POOL_SLAB];
+			addslab(&serverpool.jobslabs, &serverpool.njobslabs, slab);
+			for (int k = 0; k < POOL_SLAB; k++) {
+				slab[k].next = localjobs;
+				localjobs = &slab[k];
+			}
+		}
+	}
+	ServerJob *job = localjobs;
+	localjobs = job->next;
+	return job;
+}
+
+void putjobs (ServerJob **jobs, int njobs) {	// (worker, once per batch)
+	for (int k = 0; k < njobs; k++) {
+		if (jobs[k]->payload != jobs[k]->space) free(jobs[k]->payload);
+		jobs[k]->next = (k + 1 < njobs) ? jobs[k + 1] : NULL;
+	}
+	std::lock_guard<std::mutex> guard(serverpool.lock);
+	jobs[njobs - 1]->next = serverpool.jobs;
+	serverpool.jobs = jobs[0];
+}
+
+void freepool (void) {	// (when nothing is in use any more)
+	for (int k = 0; k < serverpool.nconnslabs; k++) {
+		ServerConn *slab = (ServerConn *) serverpool.connslabs[k];
+		for (int j = 0; j < POOL_SLAB; j++) {
+			free(slab[j].inbuf);
+			free(slab[j].outbuf);
+		}
+		delete [] slab;
+	}
+	for (int k = 0; k < serverpool.njobslabs; k++) delete [] (ServerJob *) serverpool.jobslabs[k];
+	free(serverpool.connslabs);
+	free(serverpool.jobslabs);
+	serverpool.connslabs = serverpool.jobslabs = NULL;
+	serverpool.nconnslabs = serverpool.njobslabs = 0;
+#if __cpp_impl_coroutine
+	for (int k = 0; k < serverpool.nframeslabs; k++) free(serverpool.frameslabs[k]);
+	free(serverpool.frameslabs);
+	serverpool.frameslabs = NULL;
+	serverpool.nframeslabs = 0;
+	serverpool.frames = NULL;
+#endif
+	serverpool.conns = NULL;
+	serverpool.jobs = NULL;
+	localjobs = NULL;
+}
+
+void releaseconn (ServerConn *conn) {
+	if (conn->refs.fetch_sub(1) != 1) return;
+	close(conn->fd);	// only now, so the descriptor can't be reused while still in use
+	while (conn->pending != NULL) {
+		ServerReply *reply = conn->pending;
+		conn->pending = reply->next;
+		free(reply);
+	}
+	openconns--;
+	putconn(conn);
+}
+
+void closeconn (ServerConn *conn) {	// (reactor only)
+	conn->closed = 1;
+	epoll_ctl(conn->epoll, EPOLL_CTL_DEL, conn->fd, NULL);
+	shutdown(conn->fd, SHUT_RDWR);
+	releaseconn(conn);
+}
+
+void armwrite (ServerConn *conn, int wantwrite) {	// (caller holds conn->lock)
+	if (conn->wantwrite == wantwrite) return;
+	struct epoll_event event;
+	event.events = EPOLLIN | (wantwrite ? (unsigned) EPOLLOUT : 0u);
+	event.data.ptr = conn;
+	epoll_ctl(conn->epoll, EPOLL_CTL_MOD, conn->fd, &event);	// (fails harmlessly once closed)
+	conn->wantwrite = wantwrite;
+}
+
+void appendoutput (ServerConn *conn, const char *data, int nlen) {	// (caller holds conn->lock)
+	if (conn->outpos > 0 && conn->outpos == conn->outlen) conn->outpos = conn->outlen = 0;
+	if (conn->outlen + nlen > conn->outcap) {
+		if (conn->outpos > 0) {		// move unsent output to front first
+			memmove(conn->outbuf, conn->outbuf + conn->outpos, conn->outlen - conn->outpos);
+			conn->outlen -= conn->outpos;
+			conn->outpos = 0;
+		}
+		while (conn->outlen + nlen > conn->outcap) conn->outcap *= 2;
+		conn->outbuf = (char *) realloc(conn->outbuf, conn->outcap);
+		if (conn->outbuf == NULL) exit(1);
+	}
+	memcpy(conn->outbuf + conn->outlen, data, nlen);
+	conn->outlen += nlen;
+}
+
+void flushoutput (ServerConn *conn) {	// (caller holds conn->lock)
+	long long start = tracebegin();
+	int nlen = conn->outlen - conn->outpos;
+	while (conn->outpos < conn->outlen && ! conn->closed) {
+		ssize_t n = send(conn->fd, conn->outbuf + conn->outpos, conn->outlen - conn->outpos, MSG_NOSIGNAL);
+		if (n > 0) conn->outpos += n;
+		else if (n < 0 && errno == EINTR) continue;
+		else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			armwrite(conn, 1);	// reactor sends the rest when there is room
+			traceend(SPAN_FLUSH, start, nlen - (conn->outlen - conn->outpos));
+			return;
+		}
+		else break;		// (reactor will notice the connection is gone)
+	}
+	conn->outpos = conn->outlen = 0;
+	armwrite(conn, 0);
+	if (conn->closeafter) shutdown(conn->fd, SHUT_WR);	// (reactor closes when client does)
+	traceend(SPAN_FLUSH, start, nlen);
+}
+
+// HTTP responses must go out in the order of the requests
+
+void appendreply (ServerConn *conn, unsigned int seq, int last, const char *data, int nlen) {	// (caller holds conn->lock)
+	if (seq != conn->sendseq) {
+		ServerReply *reply = (ServerReply *) malloc(offsetof(ServerReply, data) + nlen);
+		if (reply == NULL) exit(1);
+		reply->seq = seq;
+		reply->last = last;
+		reply->nlen = nlen;
+		memcpy(reply->data, data, nlen);
+		reply->next = conn->pending;
+		conn->pending = reply;
+		return;
+	}
+	appendoutput(conn, data, nlen);
+	conn->sendseq++;
+	if (last) conn->closeafter = 1;
+	for (ServerReply **prev = &conn->pending; *prev != NULL; ) {	// any that can follow now
+		ServerReply *reply = *prev;
+		if (reply->seq != conn->sendseq) {
+			prev = &reply->next;
+			continue;
+		}
+		appendoutput(conn, reply->data, reply->nlen);
+		conn->sendseq++;
+		if (reply->last) conn->closeafter = 1;
+		*prev = reply->next;
+		free(reply);
+		prev = &conn->pending;
+	}
+}
+
+// Metrics for scraping (GET /metrics, OP_METRICS), in Prometheus text format: latency
+// histograms (bucket bounds are powers of 2 ns, which are also bounds of the finer buckets
+// counted), quantiles estimated from the finer buckets, request and diagnostic counts,
+// cache hits, job queue depth and connections.
+// NOTE: caller has entered an epoch
+
+void formatmetrics (TextBuffer *out) {
+	static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+	long long *latency = (long long *) calloc(NUM_OPS * LATENCY_BUCKETS, sizeof(long long));
+	if (latency == NULL) exit(1);
+	long long latencysum[NUM_OPS] = { 0 }, requests[NUM_OPS][NUM_STATUS] = { { 0 } };
+	long long diagcounts[NUM_DIAGNOSTICS] = { 0 }, counts[NUM_OPS] = { 0 };
+	{
+		std::lock_guard<std::mutex> guard(metricslock);
+		for (ThreadMetrics *metrics = allmetrics; metrics != NULL; metrics = metrics->next) {
+			for (int op = 0; op < NUM_OPS; op++) {
+				for (int b = 0; b < LATENCY_BUCKETS; b++)
+					latency[op * LATENCY_BUCKETS + b] += metrics->latency[op][b].load(std::memory_order_relaxed);
+				latencysum[op] += metrics->latencysum[op].load(std::memory_order_relaxed);
+				for (int k = 0; k < NUM_STATUS; k++)
+					requests[op][k] += metrics->requests[op][k].load(std::memory_order_relaxed);
+			}
+			for (int code = 0; code < NUM_DIAGNOSTICS; code++)
+				diagcounts[code] += metrics->diagcounts[code].load(std::memory_order_relaxed);
+		}
+	}
+	out->len = 0;
+	appendtext(out, "# HELP lci_request_duration_seconds Time from reading request to queueing response.\n");
+	appendtext(out, "# TYPE lci_request_duration_seconds histogram\n");
+	for (int op = 0; op < NUM_OPS; op++) {
+		long long *buckets = latency + op * LATENCY_BUCKETS;
+		for (int b = 0; b < LATENCY_BUCKETS; b++) counts[op] += buckets[b];
+		if (counts[op] == 0) continue;
+		long long below = 0;
+		for (int b = 0; b < LATENCY_BUCKETS - 1; b++) {		// (last has no upper bound)
+			below += buckets[b];
+			long long bound = latencybound(b);
+			if (bound < (1 << 10) || bound > (1LL << 34) || (bound & (bound - 1)) != 0) continue;	// (1 us to 17 s)
+			appendtext(out, "lci_request_duration_seconds_bucket{op=\"%s\",le=\"%.9g\"} %lld\n",
+					   server_op_names[op], bound * 1e-9, below);
+		}
+		appendtext(out, "lci_request_duration_seconds_bucket{op=\"%s\",le=\"+Inf\"} %lld\n",
+				   server_op_names[op], counts[op]);
+		appendtext(out, "lci_request_duration_seconds_sum{op=\"%s\"} %.9g\n", server_op_names[op], latencysum[op] * 1e-9);
+		appendtext(out, "lci_request_duration_seconds_count{op=\"%s\"} %lld\n", server_op_names[op], counts[op]);
+	}
+	appendtext(out, "# HELP lci_request_duration_quantile_seconds Latency quantiles (upper bound, within 12.5%%).\n");
+	appendtext(out, "# TYPE lci_request_duration_quantile_seconds gauge\n");
+	for (int op = 0; op < NUM_OPS; op++) {
+		if (counts[op] == 0) continue;
+		long long *buckets = latency + op * LATENCY_BUCKETS;
+		long long below = 0;
+		int b = 0;
+		for (int q = 0; q < (int)(sizeof(quantiles) / sizeof(quantiles[0])); q++) {
+			long long rank = (long long) ceil(quantiles[q] * counts[op]);
+			while (below + buckets[b] < rank && b < LATENCY_BUCKETS - 1) below += buckets[b++];
+			appendtext(out, "lci_request_duration_quantile_seconds{op=\"%s\",quantile=\"%g\"} %.9g\n",
+					   server_op_names[op], quantiles[q], latencybound(b) * 1e-9);
+		}
+	}
+	appendtext(out, "# HELP lci_requests_total Requests by operation and status.\n");
+	appendtext(out, "# TYPE lci_requests_total counter\n");
+	for (int op = 0; op < NUM_OPS; op++)
+		for (int k = 0; k < NUM_STATUS; k++)
+			if (requests[op][k] > 0)
+				appendtext(out, "lci_requests_total{op=\"%s\",status=\"%s\"} %lld\n",
+						   server_op_names[op], server_status_names[k], requests[op][k]);
+	appendtext(out, "# HELP lci_diagnostics_total Diagnostics found in requests, by code.\n");
+	appendtext(out, "# TYPE lci_diagnostics_total counter\n");
+	for (int code = 0; code < NUM_DIAGNOSTICS; code++)
+		appendtext(out, "lci_diagnostics_total{code=\"%s\"} %lld\n", diagnostic_names[code], diagcounts[code]);
+	free(latency);
+
+	long long hits, misses, evictions;
+	cachestats(&hits, &misses, &evictions);
+	appendtext(out, "# TYPE lci_cache_hits_total counter\n");
+	appendtext(out, "lci_cache_hits_total{cache=\"memory\"} %lld\n", hits);
+	if (persistcache != NULL) appendtext(out, "lci_cache_hits_total{cache=\"file\"} %lld\n", persisthits.load());
+	appendtext(out, "# TYPE lci_cache_misses_total counter\n");
+	appendtext(out, "lci_cache_misses_total{cache=\"memory\"} %lld\n", misses);
+	if (persistcache != NULL) appendtext(out, "lci_cache_misses_total{cache=\"file\"} %lld\n", persistmisses.load());
+	appendtext(out, "# TYPE lci_cache_evictions_total counter\n");
+	appendtext(out, "lci_cache_evictions_total{cache=\"memory\"} %lld\n", evictions);
+	appendtext(out, "# TYPE lci_cache_hit_ratio gauge\n");
+	appendtext(out, "lci_cache_hit_ratio{cache=\"memory\"} %.4f\n", (hits + misses > 0) ? (double) hits / (hits + misses) : 0.0);
+	appendtext(out, "# TYPE lci_coalesced_requests_total counter\n");
+	appendtext(out, "lci_coalesced_requests_total %lld\n", (long long) coalesced);
+	int depth, maxdepth;
+	{
+		std::lock_guard<std::mutex> guard(jobqueue.lock);
+		depth = jobqueue.count;
+		maxdepth = jobqueue.maxcount;
+	}
+	appendtext(out, "# TYPE lci_job_queue_depth gauge\n");
+	appendtext(out, "lci_job_queue_depth %d\n", depth);
+	appendtext(out, "# TYPE lci_job_queue_depth_max gauge\n");
+	appendtext(out, "lci_job_queue_depth_max %d\n", maxdepth);
+	appendtext(out, "# TYPE lci_connections gauge\n");
+	appendtext(out, "lci_connections %d\n", openconns.load());
+	appendtext(out, "# TYPE lci_shared_memory_clients gauge\n");
+	appendtext(out, "lci_shared_memory_clients %d\n", shmclients.load());
+	CodecProfile *profile = currentprofile.load();
+	FleetTable *fleet = currentfleet.load();
+	appendtext(out, "# TYPE lci_profile_generation gauge\n");
+	appendtext(out, "lci_profile_generation %u\n", (profile != NULL) ? profile->generation : 0);
+	appendtext(out, "# TYPE lci_fleet_generation gauge\n");
+	appendtext(out, "lci_fleet_generation %u\n", (fleet != NULL) ? fleet->generation : 0);
+}
+
+const char *httpreason (int status) {
+	switch (status) {
+		case 200: return "OK";
+		case 400: return "Bad Request";
+		case 404: return "Not Found";
+		case 405: return "Method Not Allowed";
+		case 411: return "Length Required";
+		case 413: return "Payload Too Large";
+		case 431: return "Request Header Fields Too Large";
+		case 501: return "Not Implemented";
+		default: return "Error";
+	}
+}
+
+// HTTP response (headers and JSON body) for job, in out
+
+int httpresponse (ServerJob *job, TextBuffer *body, TextBuffer *out) {	// returns HTTP status
+	int status = job->httpstatus;
+	int metrics = (status == 0 && job->op == OP_METRICS);
+	if (metrics) {
+		formatmetrics(body);
+		status = 200;
+	}
+	else if (status == 0) status = httprequest(job->op, job->payload, job->nlen, body);
+	else {
+		body->len = 0;
+		appendtext(body, "{\"error\":\"%s\"}\n", httpreason(status));
+	}
+	out->len = 0;
+	appendtext(out, "HTTP/1.1 %d %s\r\nContent-Type: %s\r\nContent-Length: %d\r\n%s%s\r\n",
+			   status, httpreason(status), metrics ? "text/plain; version=0.0.4" : "application/json",
+			   body->len, (status != 405) ? "" : (job->op == OP_METRICS) ? "Allow: GET\r\n" : "Allow: POST\r\n",
+			   job->lastrequest ? "Connection: close\r\n" : "");
+	appendtext(out, "%.*s", body->len, body->str);
+	return status;
+}
+
+void serverworker (void) {
+	tracethread("server worker");
+	ServerJob *jobs[64];
+	char *out = (char *) malloc(RESPONSE_HEADER + MAX_FRAME);
+	if (out == NULL) exit(1);
+	TextBuffer body = { NULL, 0, 0 }, http = { NULL, 0, 0 };	// (reused, for HTTP)
+	for (;;) {
+		long long start = tracebegin();
+		int njobs = popjobs(jobs, 64);
+		traceend(SPAN_WAIT, start, njobs);
+		if (njobs == 0) break;
+		start = tracebegin();
+		epochenter();
+		applyprofile(currentprofile.load());	// (same settings for whole batch)
+		for (int k = 0; k < njobs; k++) {
+			ServerJob *job = jobs[k];
+			if (job->conn->protocol == PROTOCOL_HTTP) {
+				int status = httpresponse(job, &body, &http);
+				{
+					std::lock_guard<std::mutex> guard(job->conn->lock);
+					appendreply(job->conn, job->id, job->lastrequest, http.str, http.len);
+				}
+				recordrequest(job->op, (status == 200) ? STATUS_OK : (status == 404 || status == 405) ?
+							  STATUS_BAD_OP : STATUS_BAD_REQUEST, nanoclock() - job->received);
+				continue;
+			}
+			int status, diag, nlen;
+			if (job->op == OP_METRICS) {	// (may not fit in out)
+				formatmetrics(&body);
+				status = diag = nlen = 0;
+			}
+			else nlen = serverequest(job->op, job->payload, job->nlen, out + RESPONSE_HEADER, MAX_FRAME,
+									 &status, &diag);
+			putle32(out, RESPONSE_HEADER - 4 + ((job->op == OP_METRICS) ? body.len : nlen));
+			putle32(out + 4, job->id);
+			out[8] = (char) job->op;
+			out[9] = (char) status;
+			putle32(out + 10, diag);
+			{
+				std::lock_guard<std::mutex> guard(job->conn->lock);
+				appendoutput(job->conn, out, RESPONSE_HEADER + nlen);
+				if (job->op == OP_METRICS) appendoutput(job->conn, body.str, body.len);
+			}
+			countdiagnostics(diag);
+			recordrequest(job->op, status, nanoclock() - job->received);
+		}
+		epochleave();
+		traceend(SPAN_CODEC, start, njobs);
+		for (int k = 0; k < njobs; k++) {	// send, once per connection
+			ServerConn *conn = jobs[k]->conn;
+			int first = 1;
+			for (int j = 0; j < k && first; j++) first = (jobs[j]->conn != conn);
+			if (! first) continue;
+			std::lock_guard<std::mutex> guard(conn->lock);
+			flushoutput(conn);
+		}
+		for (int k = 0; k < njobs; k++) releaseconn(jobs[k]->conn);
+		putjobs(jobs, njobs);
+	}
+	free(out);
+	free(body.str);
+	free(http.str);
+	releasemetrics();
+	traceleave();
+	freeColocatedBSSIDs();		// (this thread's copy)
+}
+
+// Shared memory transport: a client on the same machine sends OP_ATTACH over the Unix
+// domain socket and gets back (SCM_RIGHTS) a memfd holding a pair of single producer,
+// single consumer rings --- requests (client to server) and responses (server to client),
+// in fixed size slots laid out like the socket frames. Attached clients are shared out
+// among a few poller threads (no more than worker threads); no system calls are made while
+// requests keep coming, a side only sleeps (futex) when its ring is empty (or full) and is
+// only woken if it is asleep. The socket stays open while the rings are in use, so the
+// server notices when the client goes away.
+
+#define SHM_SLOTS 1024		// (power of 2)
+#define SHM_SLOT 1024		// bytes per slot
+#define SHM_PAYLOAD (SHM_SLOT - 16)
+#define SHM_SPIN 4000		// polls before sleeping (when there is more than one core)
+#define SHM_TICK 1		// ms a poller with several clients sleeps (only woken by one of them)
+#define SHM_VERSION 1
+
+struct ShmSlot {
+	unsigned int nlen;		// of payload
+	unsigned int id;
+	unsigned char op, status;
+	unsigned char pad[2];
+	unsigned int diag;
+	char payload[SHM_PAYLOAD];
+};
+
+struct ShmRing {
+	alignas(64) std::atomic<unsigned int> head;		// next slot to fill (producer)
+	std::atomic<unsigned int> consumerwaiting;		// consumer asleep on head
+	alignas(64) std::atomic<unsigned int> tail;		// next slot to use (consumer)
+	std::atomic<unsigned int> producerwaiting;		// producer asleep on tail
+	alignas(64) ShmSlot slots[SHM_SLOTS];
+};
+
+struct ShmRegion {
+	char magic[8];			// "LCIRINGS"
+	unsigned int version, nslots, slotsize;
+	ShmRing requests;
+	ShmRing responses;
+};
+
+
+void INLINE futexwait (std::atomic<unsigned int> *word, unsigned int val, int ms) {
+	struct timespec timeout = { ms / 1000, (ms % 1000) * 1000000L };	// (relative)
+	syscall(SYS_futex, (unsigned int *) word, FUTEX_WAIT, val, &timeout, NULL, 0);	// (not private)
+}
+
+void INLINE futexwake (std::atomic<unsigned int> *word) {
+	syscall(SYS_futex, (unsigned int *) word, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+int shmspin (void) {
+	static int spin = (std::thread::hardware_concurrency() > 1) ? SHM_SPIN : 0;
+	return spin;
+}
+
+// Consumer: wait (up to ms) for slots to be filled --- returns number available (0 on timeout)
+
+unsigned int ringfilled (ShmRing *ring, int ms) {
+	unsigned int tail = ring->tail.load(std::memory_order_relaxed);
+	for (int k = 0; k <= shmspin(); k++) {
+		unsigned int head = ring->head.load(std::memory_order_acquire);
+		if (head != tail) return head - tail;
+	}
+	ring->consumerwaiting.store(1);		// (seq_cst, as are producer's store and load)
+	unsigned int head = ring->head.load();
+	if (head == tail) futexwait(&ring->head, head, ms);
+	ring->consumerwaiting.store(0, std::memory_order_relaxed);
+	return ring->head.load(std::memory_order_acquire) - tail;
+}
+
+// Consumer: done with n slots
+
+void ringconsume (ShmRing *ring, unsigned int n) {
+	ring->tail.store(ring->tail.load(std::memory_order_relaxed) + n);
+	if (ring->producerwaiting.load()) futexwake(&ring->tail);
+}
+
+// Producer: wait (up to ms) for a free slot --- returns it (NULL on timeout)
+
+ShmSlot *ringfree (ShmRing *ring, unsigned int head, int ms) {
+	for (int k = 0; k <= shmspin(); k++) {
+		if (head - ring->tail.load(std::memory_order_acquire) < SHM_SLOTS)
+			return &ring->slots[head % SHM_SLOTS];
+	}
+	ring->producerwaiting.store(1);
+	unsigned int tail = ring->tail.load();
+	if (head - tail >= SHM_SLOTS) futexwait(&ring->tail, tail, ms);
+	ring->producerwaiting.store(0, std::memory_order_relaxed);
+	if (head - ring->tail.load(std::memory_order_acquire) >= SHM_SLOTS) return NULL;
+	return &ring->slots[head % SHM_SLOTS];
+}
+
+// Producer: slots up to (not including) head are filled
+
+void ringpublish (ShmRing *ring, unsigned int head) {
+	ring->head.store(head);
+	if (ring->consumerwaiting.load()) futexwake(&ring->head);
+}
+
+ShmRegion *makeShmRegion (int *pfd) {
+	int fd = memfd_create("lcicoder-rings", MFD_CLOEXEC);
+	if (fd < 0) return NULL;
+	if (ftruncate(fd, sizeof(ShmRegion)) != 0) {
+		close(fd);
+		return NULL;
+	}
+	void *ptr = mmap(NULL, sizeof(ShmRegion), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (ptr == MAP_FAILED) {
+		close(fd);
+		return NULL;
+	}
+	ShmRegion *region = (ShmRegion *) ptr;	// (memfd starts out zero)
+	memcpy(region->magic, "LCIRINGS", 8);
+	region->version = SHM_VERSION;
+	region->nslots = SHM_SLOTS;
+	region->slotsize = SHM_SLOT;
+	*pfd = fd;
+	return region;
+}
+
+struct ShmAttached {		// client being served
+	ShmAttached *next;
+	ServerConn *conn;
+	ShmRegion *region;
+	int fd;
+	unsigned int rhead;		// next response slot to fill
+};
+
+struct ShmPoller {
+	std::thread thread;
+	std::atomic<ShmAttached *> added;	// handed over, not yet taken (pushed by reactors)
+	std::atomic<int> nclients;
+	std::atomic<unsigned int> bell;		// (slept on when it has no clients)
+	std::atomic<std::atomic<unsigned int> *> asleep;	// word it is sleeping on (if any)
+};
+
+ShmPoller *shmpollers = NULL;
+int nshmpollers = 0, maxshmpollers = 0;
+std::mutex shmpollerslock;
+
+// serve a batch of requests from one client, straight from the ring --- returns number served
+// (none if its responses are all still waiting to be taken)
+
+unsigned int shmserve (ShmAttached *client) {
+	ShmRing *requests = &client->region->requests, *responses = &client->region->responses;
+	unsigned int tail = requests->tail.load(std::memory_order_relaxed);
+	unsigned int n = requests->head.load(std::memory_order_acquire) - tail;
+	unsigned int room = SHM_SLOTS - (client->rhead - responses->tail.load(std::memory_order_acquire));
+	if (n > room) n = (room > SHM_SLOTS) ? 0 : room;	// (client tail is not trusted either)
+	if (n == 0) return 0;
+	long long start = tracebegin();
+	long long received = nanoclock();
+	epochenter();
+	applyprofile(currentprofile.load());
+	for (unsigned int k = 0; k < n; k++) {
+		ShmSlot *req = &requests->slots[(tail + k) % SHM_SLOTS];
+		ShmSlot *resp = &responses->slots[client->rhead % SHM_SLOTS];
+		const volatile ShmSlot *slot = req;		// (client can write to it any time: read each field once)
+		unsigned int reqlen = slot->nlen, id = slot->id;
+		int op = slot->op;
+		int status, diag;
+		if (reqlen > SHM_PAYLOAD) {
+			resp->nlen = 0;
+			resp->status = STATUS_BAD_REQUEST;
+			resp->diag = 0;
+		}
+		else {
+			resp->nlen = serverequest(op, req->payload, (int) reqlen, resp->payload, SHM_PAYLOAD, &status, &diag);
+			resp->status = (unsigned char) status;
+			resp->diag = diag;
+			countdiagnostics(diag);
+		}
+		recordrequest(op, resp->status, nanoclock() - received);
+		resp->id = id;
+		resp->op = (unsigned char) op;
+		client->rhead++;
+	}
+	epochleave();
+	ringpublish(responses, client->rhead);
+	ringconsume(requests, n);
+	traceend(SPAN_CODEC, start, n);
+	return n;
+}
+
+void detachshm (ShmAttached *client) {
+	munmap(client->region, sizeof(ShmRegion));
+	close(client->fd);
+	releaseconn(client->conn);
+	delete client;
+	shmclients--;
+}
+
+// sleep (up to ms) until one of the clients sends more (or another is handed over)
+
+void shmsleep (ShmPoller *poller, ShmAttached *clients) {
+	std::atomic<unsigned int> *word = (clients == NULL) ? &poller->bell : &clients->region->requests.head;
+	unsigned int val = word->load();
+	poller->asleep.store(word);
+	int ready = (poller->added.load() != NULL);
+	for (ShmAttached *client = clients; client != NULL; client = client->next) {
+		ShmRing *requests = &client->region->requests;
+		requests->consumerwaiting.store(1);		// (seq_cst, as are producer's store and load)
+		if (requests->head.load() != requests->tail.load(std::memory_order_relaxed)) ready = 1;
+	}
+	if (! ready) futexwait(word, val, (clients != NULL && clients->next != NULL) ? SHM_TICK : 100);
+	for (ShmAttached *client = clients; client != NULL; client = client->next)
+		client->region->requests.consumerwaiting.store(0, std::memory_order_relaxed);
+	poller->asleep.store(NULL);
+}
+
+// go round the clients this poller has been given, serving whatever each has sent
+
+void shmpoller (ShmPoller *poller) {
+	tracethread("shared memory");
+	ShmAttached *clients = NULL;
+	int idle = 0;
+	while (! serverstop) {
+		ShmAttached *added = poller->added.exchange(NULL);
+		while (added != NULL) {
+			ShmAttached *client = added;
+			added = client->next;
+			client->next = clients;
+			clients = client;
+		}
+		unsigned int served = 0;
+		for (ShmAttached **prev = &clients; *prev != NULL; ) {
+			ShmAttached *client = *prev;
+			if (client->conn->closed) {
+				*prev = client->next;
+				detachshm(client);
+				poller->nclients--;
+				continue;
+			}
+			served += shmserve(client);
+			prev = &client->next;
+		}
+		if (served > 0) idle = 0;
+		else if (++idle > shmspin()) {
+			shmsleep(poller, clients);
+			idle = 0;
+		}
+	}
+	ShmAttached *added = poller->added.exchange(NULL);
+	while (clients != NULL || added != NULL) {
+		if (clients == NULL) {
+			clients = added;
+			added = NULL;
+		}
+		ShmAttached *client = clients;
+		clients = client->next;
+		detachshm(client);
+	}
+	releasemetrics();
+	traceleave();
+	freeColocatedBSSIDs();
+}
+
+// hand a newly attached client to the poller with fewest (starting another while there are
+// fewer pollers than workers and none is idle)
+
+void addshmclient (ShmAttached *client) {
+	std::lock_guard<std::mutex> guard(shmpollerslock);
+	if (shmpollers == NULL) {
+		maxshmpollers = getnthreads();
+		shmpollers = new ShmPoller[maxshmpollers]();
+	}
+	ShmPoller *poller = NULL;
+	for (int p = 0; p < nshmpollers; p++) {
+		if (poller == NULL || shmpollers[p].nclients < poller->nclients) poller = &shmpollers[p];
+	}
+	if (poller == NULL || (poller->nclients > 0 && nshmpollers < maxshmpollers)) {
+		poller = &shmpollers[nshmpollers++];
+		poller->thread = std::thread(shmpoller, poller);
+	}
+	poller->nclients++;
+	client->next = poller->added.load();
+	while (! poller->added.compare_exchange_weak(client->next, client)) ;
+	poller->bell++;
+	std::atomic<unsigned int> *word = poller->asleep.load();	// (else it will see added)
+	if (word != NULL) futexwake(word);		// (missed if not quite asleep: then up to 100 ms)
+}
+
+// wait for pollers to let go of their clients (after server stops)
+
+void stopshmpollers (void) {
+	for (int p = 0; p < nshmpollers; p++) shmpollers[p].thread.join();
+	delete [] shmpollers;
+	shmpollers = NULL;
+	nshmpollers = 0;
+}
+
+// OP_ATTACH: answer with the memfd and start serving it (reactor only)
+
+void attachshm (ServerConn *conn, unsigned int id) {
+	int fd = -1;
+	ShmRegion *region = makeShmRegion(&fd);
+	char frame[RESPONSE_HEADER];
+	putle32(frame, RESPONSE_HEADER - 4);
+	putle32(frame + 4, id);
+	frame[8] = (char) OP_ATTACH;
+	frame[9] = (char)((region != NULL) ? STATUS_OK : STATUS_BAD_REQUEST);
+	putle32(frame + 10, 0);
+	struct iovec iov = { frame, sizeof(frame) };
+	union {		// (aligned for cmsghdr)
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (region != NULL) {
+		msg.msg_control = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	}
+	std::lock_guard<std::mutex> guard(conn->lock);
+	flushoutput(conn);		// (so as not to land in the middle of another response)
+	ssize_t sent = (conn->outpos == conn->outlen) ? sendmsg(conn->fd, &msg, MSG_NOSIGNAL) : -1;
+	if (region == NULL) return;
+	if (sent != (ssize_t) sizeof(frame)) {
+		munmap(region, sizeof(ShmRegion));
+		close(fd);
+		return;
+	}
+	conn->refs++;
+	shmclients++;
+	ShmAttached *client = new ShmAttached;
+	client->conn = conn;
+	client->region = region;
+	client->fd = fd;
+	client->rhead = 0;
+	addshmclient(client);
+}
+
+ServerJob *newjob (ServerConn *conn, unsigned int id, int op, const char *payload, int nlen) {
+	ServerJob *job = getjob();
+	job->payload = job->space;
+	if (nlen > JOB_PAYLOAD && (job->payload = (char *) malloc(nlen + 1)) == NULL) exit(1);
+	job->conn = conn;
+	job->id = id;
+	job->op = op;
+	job->nlen = nlen;
+	job->httpstatus = 0;
+	job->lastrequest = 0;
+	job->received = conn->received;
+	memcpy(job->payload, payload, nlen);
+	job->payload[nlen] = '\0';
+	conn->refs++;
+	return job;
+}
+
+// queue complete binary protocol requests --- returns number of bytes used, or -1 on error
+// (requests before the error are still queued: each job holds a reference to the connection,
+// which is only let go of once a worker is done with it)
+
+int readframes (ServerConn *conn) {
+	ServerJob *jobs[256];
+	int njobs = 0, pos = 0;
+	while (conn->inlen - pos >= 4) {
+		unsigned int nlen = getle32(conn->inbuf + pos);
+		if (nlen < REQUEST_HEADER - 4 || nlen > MAX_FRAME) {	// protocol error
+			pos = -1;
+			break;
+		}
+		if (conn->inlen - pos < (int)(4 + nlen)) break;		// (incomplete)
+		if ((unsigned char) conn->inbuf[pos + 8] == OP_ATTACH) attachshm(conn, getle32(conn->inbuf + pos + 4));
+		else jobs[njobs++] = newjob(conn, getle32(conn->inbuf + pos + 4), (unsigned char) conn->inbuf[pos + 8],
+							   conn->inbuf + pos + REQUEST_HEADER, nlen - (REQUEST_HEADER - 4));
+		pos += 4 + nlen;
+		if (njobs == 256) {
+			pushjobs(jobs, njobs);
+			njobs = 0;
+		}
+	}
+	if (njobs > 0) pushjobs(jobs, njobs);
+	return pos;
+}
+
+// value of HTTP header (in headers, ending in blank line) --- copied into str, or 0 if absent
+
+int httpheader (const char *headers, const char *name, char *str, int nlen) {
+	int namelen = strlen(name);
+	const char *line = strstr(headers, "\r\n");
+	while (line != NULL && line[2] != '\r') {
+		line += 2;
+		if (_strnicmp(line, name, namelen) == 0 && line[namelen] == ':') {
+			const char *value = line + namelen + 1;
+			while (*value == ' ' || *value == '\t') value++;
+			int k = 0;
+			while (value[k] != '\r' && k < nlen - 1) { str[k] = value[k]; k++; }
+			while (k > 0 && (str[k-1] == ' ' || str[k-1] == '\t')) k--;
+			str[k] = '\0';
+			return 1;
+		}
+		line = strstr(line, "\r\n");
+	}
+	return 0;
+}
+
+// queue complete HTTP requests --- returns number of bytes used (errors are queued
+// as responses, followed by closing the connection)
+
+int readhttp (ServerConn *conn) {
+	ServerJob *jobs[256];
+	int njobs = 0, pos = 0;
+	while (! conn->lastrequest && pos < conn->inlen) {
+		char *start = conn->inbuf + pos;
+		int avail = conn->inlen - pos;
+		char *end = (char *) memmem(start, avail, "\r\n\r\n", 4);
+		int op = 0, status = 0, hlen = 0;
+		long blen = 0;
+		if (memchr(start, '\0', (end != NULL) ? end - start : avail) != NULL) status = 400;	// (headers are text)
+		else if (end == NULL) {
+			if (avail < 8192) break;	// (incomplete)
+			status = 431;
+		}
+		else {
+			hlen = (int)(end - start) + 4;
+			char saved = start[hlen];		// (inbuf always has room for terminating 0)
+			start[hlen] = '\0';
+			char method[16], path[64], version[16], value[64];
+			int keepalive = 1;
+			if (sscanf_s(start, "%15s %63s %15s", method, path, version) != 3 ||
+				strncmp(version, "HTTP/1.", 7) != 0) status = 400;
+			else {
+				if (strcmp(version, "HTTP/1.0") == 0) keepalive = 0;
+				if (httpheader(start, "Connection", value, sizeof(value))) {
+					if (_strnicmp(value, "close", 5) == 0) keepalive = 0;
+					else if (_strnicmp(value, "keep-alive", 10) == 0) keepalive = 1;
+				}
+				if (strcmp(path, "/encode") == 0) op = OP_ENCODE;
+				else if (strcmp(path, "/decode") == 0) op = OP_DECODE;
+				else if (strcmp(path, "/validate") == 0) op = OP_VALIDATE;
+				else if (strcmp(path, "/lookup") == 0) op = OP_LOOKUP;
+				else if (strcmp(path, "/metrics") == 0) op = OP_METRICS;
+				char *tail;
+				if (op == 0) status = 404;
+				else if (strcmp(method, (op == OP_METRICS) ? "GET" : "POST") != 0) status = 405;
+				else if (op == OP_METRICS) blen = 0;	// (no body)
+				else if (httpheader(start, "Transfer-Encoding", value, sizeof(value))) status = 501;
+				else if (! httpheader(start, "Content-Length", value, sizeof(value))) status = 411;
+				else if ((blen = strtol(value, &tail, 10)) < 0 || *tail != '\0') status = 400;
+				else if (blen > MAX_BODY) status = 413;
+			}
+			start[hlen] = saved;
+			if (status == 0 && avail - hlen < blen) break;	// (incomplete)
+			if (! keepalive) conn->lastrequest = 1;
+		}
+		if (status != 0) {
+			conn->lastrequest = 1;	// (don't try to make sense of the rest)
+			blen = 0;
+		}
+		ServerJob *job = newjob(conn, conn->readseq++, op, start + hlen, (int) blen);
+		job->httpstatus = status;
+		job->lastrequest = conn->lastrequest;
+		jobs[njobs++] = job;
+		pos += hlen + blen;
+		if (njobs == 256) {
+			pushjobs(jobs, njobs);
+			njobs = 0;
+		}
+	}
+	if (njobs > 0) pushjobs(jobs, njobs);
+	if (conn->lastrequest) pos = conn->inlen;	// (ignore anything after)
+	return pos;
+}
+
+// read what is available, queue complete requests --- returns 0 if connection is to be closed
+
+int readconn (ServerConn *conn) {
+	for (;;) {
+		if (conn->incap - conn->inlen < CONN_BUFFER / 4) {
+			conn->incap *= 2;
+			conn->inbuf = (char *) realloc(conn->inbuf, conn->incap);
+			if (conn->inbuf == NULL) exit(1);
+		}
+		ssize_t n = recv(conn->fd, conn->inbuf + conn->inlen, conn->incap - conn->inlen - 1, 0);
+		if (n == 0) return 0;	// end of file
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+			return 0;
+		}
+		conn->inlen += n;
+		if (conn->inlen < conn->incap - 1) break;	// (probably nothing more right now)
+	}
+	conn->received = nanoclock();
+	int pos = (conn->protocol == PROTOCOL_HTTP) ? readhttp(conn) : readframes(conn);
+	if (pos < 0) return 0;
+	if (pos > 0) {
+		memmove(conn->inbuf, conn->inbuf + pos, conn->inlen - pos);
+		conn->inlen -= pos;
+	}
+	return 1;
+}
+
+#if __cpp_impl_coroutine
+
+void *getframe (size_t size) {
+	std::lock_guard<std::mutex> guard(serverpool.lock);
+	if (serverpool.framesize == 0) serverpool.framesize = size;
+	if (size != serverpool.framesize) {		// (only one kind of coroutine, so not expected)
+		void *frame = malloc(size);
+		if (frame == NULL) exit(1);
+		return frame;
+	}
+	if (serverpool.frames == NULL) {
+		size_t stride = (size + 15) & ~(size_t) 15;		// (as aligned as new would make it)
+		char *slab = (char *) malloc(stride * POOL_SLAB);
+		if (slab == NULL) exit(1);
+		addslab(&serverpool.frameslabs, &serverpool.nframeslabs, slab);
+		for (int k = 0; k < POOL_SLAB; k++) {
+			*(void **)(slab + k * stride) = serverpool.frames;
+			serverpool.frames = slab + k * stride;
+		}
+	}
+	void *frame = serverpool.frames;
+	serverpool.frames = *(void **) frame;
+	return frame;
+}
+
+void putframe (void *frame, size_t size) {
+	std::lock_guard<std::mutex> guard(serverpool.lock);
+	if (size != serverpool.framesize) {
+		free(frame);
+		return;
+	}
+	*(void **) frame = serverpool.frames;
+	serverpool.frames = frame;
+}
+
+struct ConnTask {		// coroutine that runs by itself (until suspended), frees itself when done
+	struct promise_type {
+		ConnTask get_return_object (void) { return ConnTask(); }
+		std::suspend_never initial_suspend (void) { return std::suspend_never(); }
+		std::suspend_never final_suspend (void) noexcept { return std::suspend_never(); }
+		void return_void (void) {}
+		void unhandled_exception (void) { exit(1); }
+		static void *operator new (size_t size) { return getframe(size); }
+		static void operator delete (void *frame, size_t size) { putframe(frame, size); }
+	};
+};
+
+struct ConnReadable {	// co_await: suspend until reactor resumes connection (epoll: input, or hung up)
+	ServerConn *conn;
+	bool await_ready (void) { return false; }
+	void await_suspend (std::coroutine_handle<> handle) { conn->reader = handle; }
+	void await_resume (void) {}
+};
+
+// Read requests from connection and queue them, until it is closed: reads like a blocking
+// loop, but gives the reactor back whenever there is nothing to read (its state stays in
+// the coroutine frame). Workers send responses (reactor sends what did not fit right away).
+
+ConnTask connreader (ServerConn *conn) {
+	for (;;) {
+		co_await ConnReadable{conn};
+		long long start = tracebegin();
+		int inlen = conn->inlen;
+		if (! readconn(conn)) break;
+		traceend(SPAN_READ, start, conn->inlen - inlen);
+	}
+	closeconn(conn);
+}
+
+#endif
+
+// close connections still open once reactors and workers have stopped (destroying readers
+// left suspended, which frees their frames)
+
+void closeconns (void) {
+	for (int k = 0; k < serverpool.nconnslabs; k++) {
+		ServerConn *slab = (ServerConn *) serverpool.connslabs[k];
+		for (int j = 0; j < POOL_SLAB; j++) {
+			if (slab[j].refs == 0) continue;	// (free)
+#if __cpp_impl_coroutine
+			slab[j].reader.destroy();
+#endif
+			closeconn(&slab[j]);
+		}
+	}
+}
+
+void acceptconns (ServerConn *listener, int epoll) {
+	for (;;) {
+		int fd = accept4(listener->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) return;		// (EAGAIN: no more for now)
+		if (listener->protocol == PROTOCOL_HTTP) {
+			int one = 1;	// (responses are complete when written)
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		}
+		ServerConn *conn = getconn();
+		openconns++;
+		conn->fd = fd;
+		conn->epoll = epoll;
+		conn->protocol = listener->protocol;
+		conn->listening = 0;
+		conn->refs = 1;
+		conn->closed = 0;
+		conn->inlen = conn->outpos = conn->outlen = 0;
+		if (conn->inbuf == NULL) {		// (else kept from connection before)
+			conn->incap = CONN_BUFFER;
+			conn->inbuf = (char *) malloc(conn->incap);
+		}
+		if (conn->outbuf == NULL) {
+			conn->outcap = CONN_BUFFER;
+			conn->outbuf = (char *) malloc(conn->outcap);
+		}
+		if (conn->inbuf == NULL || conn->outbuf == NULL) exit(1);
+		conn->wantwrite = 0;
+		conn->readseq = conn->sendseq = 0;
+		conn->pending = NULL;
+		conn->lastrequest = conn->closeafter = 0;
+		struct epoll_event event;
+		event.events = EPOLLIN;
+		event.data.ptr = conn;
+		if (epoll_ctl(epoll, EPOLL_CTL_ADD, fd, &event) != 0) releaseconn(conn);
+#if __cpp_impl_coroutine
+		else connreader(conn);		// (suspends at once, until there is something to read)
+#endif
+	}
+}
+
+void serverreactor (int epoll, int first) {	// (first reactor also handles reloads)
+	tracethread("reactor");
+	struct epoll_event events[64];
+	while (! serverstop) {
+		int nevents = epoll_wait(epoll, events, 64, 1000);
+		if (first && serverreload) {
+			serverreload = 0;
+			updateprofile(&baseprofile, NULL);
+			if (fleetfile != NULL && ! fleetloading.exchange(1)) std::thread(reloadfleet).detach();
+		}
+		if (first) reclaim();
+		for (int k = 0; k < nevents; k++) {
+			ServerConn *conn = (ServerConn *) events[k].data.ptr;
+			if (conn->listening) {
+				acceptconns(conn, epoll);
+				continue;
+			}
+			if (events[k].events & EPOLLOUT) {
+				std::lock_guard<std::mutex> guard(conn->lock);
+				flushoutput(conn);
+			}
+			if (events[k].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+#if __cpp_impl_coroutine
+				conn->reader.resume();		// (coroutine closes connection when done with it)
+#else
+				long long start = tracebegin();		// (state kept in conn between events)
+				int inlen = conn->inlen;
+				if (! readconn(conn)) closeconn(conn);
+				else traceend(SPAN_READ, start, conn->inlen - inlen);
+#endif
+			}
+		}
+	}
+}
+
+// listen on Unix domain socket --- returns descriptor, or -1 on failure
+
+int listensocket (const char *path) {
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		printf("ERROR: socket path too long %s\n", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+	struct stat st;
+	if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path);	// left over from before
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0 || bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0) {
+		printf("ERROR: unable to listen on %s (%s)\n", path, strerror(errno));
+		if (fd >= 0) close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// listen on TCP port on localhost (only) --- returns descriptor, or -1 on failure
+
+int listenport (int port) {
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons((unsigned short) port);
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	int one = 1;
+	if (fd >= 0) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (fd < 0 || bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0) {
+		printf("ERROR: unable to listen on port %d (%s)\n", port, strerror(errno));
+		if (fd >= 0) close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+void addlistener (ServerConn *listener, int fd, int protocol, int *epolls) {	// (listener value-initialized)
+	listener->fd = fd;
+	listener->protocol = protocol;
+	listener->listening = 1;
+	struct epoll_event event;
+	event.data.ptr = listener;
+	for (int r = 0; r < nreactors; r++) {	// (only one reactor woken per connection, if supported)
+		event.events = EPOLLIN | EPOLLEXCLUSIVE;
+		if (epoll_ctl(epolls[r], EPOLL_CTL_ADD, fd, &event) != 0 && errno == EINVAL) {
+			event.events = EPOLLIN;
+			epoll_ctl(epolls[r], EPOLL_CTL_ADD, fd, &event);
+		}
+	}
+}
+
+// serve binary protocol on Unix domain socket (path) and/or HTTP on localhost (port)
+
+void serve (const char *path, int port) {
+	int listenfd = -1, httpfd = -1;
+	if (path != NULL && (listenfd = listensocket(path)) < 0) return;
+	if (port > 0 && (httpfd = listenport(port)) < 0) {
+		if (listenfd >= 0) {
+			close(listenfd);
+			unlink(path);
+		}
+		return;
+	}
+	captureprofile(&baseprofile);
+	int ok = (updateprofile(&baseprofile, NULL) != 0);	// (with -profile=... file, if any)
+	if (ok && fleetfile != NULL) {
+		epochenter();
+		applyprofile(currentprofile.load());
+		ok = (loadfleet(fleetfile) != 0);
+		epochleave();
+	}
+	if (! ok) {
+		if (listenfd >= 0) {
+			close(listenfd);
+			unlink(path);
+		}
+		if (httpfd >= 0) close(httpfd);
+		return;
+	}
+	if (cachemb > 0) makeCache(cachemb);
+	if (persistfile != NULL) openPersist(persistfile, persistmb);
+	coalesceflag = 1;
+	int nworkers = getnthreads();
+	if (verboseflag && path != NULL) printf("# serving on %s with %d worker threads\n", path, nworkers);
+	if (verboseflag && port > 0) printf("# serving HTTP on localhost port %d with %d worker threads\n", port, nworkers);
+	fflush(stdout);
+	int oldverboseflag = verboseflag;
+	verboseflag = 0;
+	quietflag = 1;
+
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = serversignal;
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+	sigaction(SIGHUP, &action, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	jobqueue.capacity = 1024;
+	jobqueue.jobs = (ServerJob **) malloc(jobqueue.capacity * sizeof(ServerJob *));
+	if (jobqueue.jobs == NULL) exit(1);
+	int *epolls = new int[nreactors];
+	for (int r = 0; r < nreactors; r++) epolls[r] = epoll_create1(EPOLL_CLOEXEC);
+	ServerConn *listeners = new ServerConn[2]();	// (fields 0, mutex and atomics constructed)
+	if (listenfd >= 0) addlistener(&listeners[0], listenfd, PROTOCOL_BINARY, epolls);
+	if (httpfd >= 0) addlistener(&listeners[1], httpfd, PROTOCOL_HTTP, epolls);
+
+	sigset_t signals, oldsignals;	// (signals go to this thread, which handles reloads)
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	sigaddset(&signals, SIGHUP);
+	pthread_sigmask(SIG_BLOCK, &signals, &oldsignals);
+	std::thread *workers = new std::thread[nworkers];
+	for (int t = 0; t < nworkers; t++) workers[t] = std::thread(serverworker);
+	std::thread *reactors = new std::thread[nreactors];
+	for (int r = 1; r < nreactors; r++) reactors[r] = std::thread(serverreactor, epolls[r], 0);
+	pthread_sigmask(SIG_SETMASK, &oldsignals, NULL);
+	serverreactor(epolls[0], 1);
+	for (int r = 1; r < nreactors; r++) reactors[r].join();
+	delete [] reactors;
+
+	{
+		std::lock_guard<std::mutex> guard(jobqueue.lock);
+		jobqueue.stopping = 1;
+	}
+	jobqueue.ready.notify_all();
+	for (int t = 0; t < nworkers; t++) workers[t].join();
+	delete [] workers;
+	stopshmpollers();
+	closeconns();
+	while (fleetloading) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	delete [] listeners;
+	if (listenfd >= 0) {
+		close(listenfd);
+		unlink(path);
+	}
+	if (httpfd >= 0) close(httpfd);
+	for (int r = 0; r < nreactors; r++) close(epolls[r]);
+	delete [] epolls;
+	verboseflag = oldverboseflag;
+	if (verboseflag && cachebuckets > 0) showcachestats();
+	if (verboseflag && persistcache != NULL) showpersiststats();
+	if (verboseflag) printf("# coalesced %lld requests\n", (long long) coalesced);
+	freepool();
+	freemetrics();
+	freeCache();
+	closePersist();
+	reclaimall();
+	delete currentprofile.exchange(NULL);
+	FleetTable *fleet = currentfleet.exchange(NULL);
+	if (fleet != NULL) releaseFleet(fleet);
+}
+
+// Client end of shared memory transport (-connect=... with -decode=... or -encode=...)
+
+struct ShmClient {
+	int sock, fd;
+	ShmRegion *region;
+	unsigned int nextid;
+	unsigned int head;		// next request slot (those before it not yet published are submitted)
+	long long calls;
+	double seconds;		// total round trip time
+};
+
+ShmClient *shmclient = NULL;
+
+ShmClient *shmconnect (const char *path) {
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) return NULL;
+	strcpy(addr.sun_path, path);
+	int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock < 0) return NULL;
+	char frame[RESPONSE_HEADER];
+	putle32(frame, REQUEST_HEADER - 4);
+	putle32(frame + 4, 0);
+	frame[8] = (char) OP_ATTACH;
+	int fd = -1;
+	if (connect(sock, (struct sockaddr *) &addr, sizeof(addr)) == 0 &&
+		send(sock, frame, REQUEST_HEADER, MSG_NOSIGNAL) == REQUEST_HEADER) {
+		struct iovec iov = { frame, sizeof(frame) };
+		union {
+			char buf[CMSG_SPACE(sizeof(int))];
+			struct cmsghdr align;
+		} control;
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+		if (recvmsg(sock, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC) == (ssize_t) sizeof(frame) &&
+			frame[8] == OP_ATTACH && frame[9] == STATUS_OK) {
+			struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+			if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+				memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+		}
+	}
+	void *ptr = (fd < 0) ? MAP_FAILED : mmap(NULL, sizeof(ShmRegion), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	ShmRegion *region = (ShmRegion *) ptr;
+	if (ptr == MAP_FAILED || memcmp(region->magic, "LCIRINGS", 8) != 0 || region->version != SHM_VERSION ||
+		region->nslots != SHM_SLOTS || region->slotsize != SHM_SLOT) {
+		if (ptr != MAP_FAILED) munmap(ptr, sizeof(ShmRegion));
+		if (fd >= 0) close(fd);
+		close(sock);
+		return NULL;
+	}
+	ShmClient *client = new ShmClient;
+	client->sock = sock;
+	client->fd = fd;
+	client->region = region;
+	client->nextid = 1;
+	client->head = 0;
+	client->calls = 0;
+	client->seconds = 0;
+	return client;
+}
+
+void shmdisconnect (ShmClient *client) {
+	munmap(client->region, sizeof(ShmRegion));
+	close(client->fd);
+	close(client->sock);	// (server stops serving rings)
+	delete client;
+}
+
+double INLINE monotonic (void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Several requests in flight: shmsubmit fills the next request slot (waiting if the ring
+// is full) and returns the request id (0 if the server took none for 5 s), shmflush hands
+// everything submitted so far to the server at once (waking it at most once), shmpoll waits
+// (up to ms) for the next response. Responses come back in the order requests were submitted.
+
+void shmflush (ShmClient *client) {
+	ShmRing *requests = &client->region->requests;
+	if (requests->head.load(std::memory_order_relaxed) != client->head) ringpublish(requests, client->head);
+}
+
+unsigned int shmsubmit (ShmClient *client, int op, const char *payload, int nlen) {
+	ShmRing *requests = &client->region->requests;
+	ShmSlot *req = NULL;
+	if (client->head - requests->tail.load(std::memory_order_acquire) < SHM_SLOTS) req = &requests->slots[client->head % SHM_SLOTS];
+	else shmflush(client);		// (full: server must have all there is)
+	for (int tries = 0; req == NULL && tries < 50; tries++) req = ringfree(requests, client->head, 100);
+	if (req == NULL) return 0;
+	unsigned int id = client->nextid++;
+	if (id == 0) id = client->nextid++;		// (0 is for failure)
+	req->nlen = (nlen <= SHM_PAYLOAD) ? nlen : SHM_PAYLOAD + 1;		// (too long: bad request)
+	req->id = id;
+	req->op = (unsigned char) op;
+	if (nlen <= SHM_PAYLOAD) memcpy(req->payload, payload, nlen);
+	client->head++;
+	return id;
+}
+
+// returns length of response payload (up to maxlen of it put in out), or -1 if none came
+
+int shmpoll (ShmClient *client, unsigned int *id, char *out, int maxlen, int *status, int *diag, int ms) {
+	ShmRing *responses = &client->region->responses;
+	if (ringfilled(responses, ms) == 0) return -1;
+	ShmSlot *resp = &responses->slots[responses->tail.load(std::memory_order_relaxed) % SHM_SLOTS];
+	int rlen = (resp->nlen <= SHM_PAYLOAD) ? (int) resp->nlen : SHM_PAYLOAD;
+	memcpy(out, resp->payload, (rlen < maxlen) ? rlen : maxlen);
+	*id = resp->id;
+	*status = resp->status;
+	*diag = resp->diag;
+	ringconsume(responses, 1);
+	return rlen;
+}
+
+// one request, waiting for its response --- returns length of response payload (in out,
+// of size maxlen), or -1 if the server is not responding (none others to be in flight)
+
+int shmcall (ShmClient *client, int op, const char *payload, int nlen, char *out, int maxlen, int *status, int *diag) {
+	double start = monotonic();
+	unsigned int id = shmsubmit(client, op, payload, nlen), rid = 0;
+	if (id == 0) return -1;
+	shmflush(client);
+	int rlen = -1;
+	for (int tries = 0; rlen < 0 && tries < 50; tries++) rlen = shmpoll(client, &rid, out, maxlen, status, diag, 100);
+	if (rlen < 0) return -1;
+	client->calls++;
+	client->seconds += monotonic() - start;
+	return (rid == id && rlen <= maxlen) ? rlen : -1;
+}
+
+int remoteDecode (const char *str, const LciRecord *defaults, LciRecord *rec) {
+	unsigned char out[SHM_PAYLOAD];
+	int status, diag;
+	int n = shmcall(shmclient, OP_DECODE, str, strlen(str), (char *) out, sizeof(out), &status, &diag);
+	if (n < 0) {
+		printf("ERROR: no response from server\n");
+		exit(1);
+	}
+	if (status != STATUS_OK || unpackLciRecord(rec, out, n) != n) {
+		memcpy(rec, defaults, sizeof(LciRecord));
+		return 0;
+	}
+	return diag;
+}
+
+int remoteEncode (const LciRecord *rec, char *str, int nlen) {
+	unsigned char buf[PACKED_RECORD_MAX];
+	char out[SHM_PAYLOAD + 1];
+	int status, diag;
+	int n = shmcall(shmclient, OP_ENCODE, (const char *) buf, packLciRecord(rec, buf), out, SHM_PAYLOAD, &status, &diag);
+	if (n < 0) {
+		printf("ERROR: no response from server\n");
+		exit(1);
+	}
+	if (status != STATUS_OK || n >= nlen) n = 0;
+	memcpy(str, out, n);
+	str[n] = '\0';
+	return diag;
+}
+
+// send batch mode work to server (started with -serve=path) --- returns 0 on failure
+
+int connectserver (const char *path) {
+	shmclient = shmconnect(path);
+	if (shmclient == NULL) {
+		printf("ERROR: unable to attach to server at %s\n", path);
+		return 0;
+	}
+	batchdecode = remoteDecode;
+	batchencode = remoteEncode;
+	cachemb = 0;		// (server caches)
+	persistfile = NULL;
+	return 1;
+}
+
+void disconnectserver (void) {
+	if (shmclient == NULL) return;
+	if (verboseflag && shmclient->calls > 0)
+		printf("# shared memory: %lld round trips, %.3f usec average\n",
+			   shmclient->calls, shmclient->seconds * 1e6 / shmclient->calls);
+	shmdisconnect(shmclient);
+	shmclient = NULL;
+	batchdecode = cachedDecode;
+	batchencode = cachedEncode;
+}
+
+#else
+
+void serve (const char *path, int port) {
+	printf("ERROR: -serve and -http not supported on this platform (needs Linux)\n");
+}
+
+int connectserver (const char *path) {
+	printf("ERROR: -connect not supported on this platform (needs Linux)\n");
+	return 0;
+}
+
+void disconnectserver (void) {
+}
+
+#endif
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Microbenchmarks of the codec kernels (-bench): each kernel is run in a loop, the loop
+// count doubled until one run takes BENCH_REP_MS (and at least BENCH_WARMUP_MS has gone
+// by, to warm up caches and branch predictors and let the clock settle), then timed
+// benchreps times. Reports median and percentiles of ns per call (over repetitions), and
+// writes them, with every repetition, as JSON (-benchjson=...).
+// Given earlier results (-benchbaseline=...), each kernel is compared with them: it has
+// regressed if its median is more than benchthreshold % slower and a Mann-Whitney test
+// says the slowdown is unlikely to be chance (the run then fails, exit status 1).
+
+#define BENCH_REP_MS 10
+#define BENCH_WARMUP_MS 100
+#define BENCH_ALPHA 0.01	// significance level for regressions
+
+struct BenchKernel {
+	const char *name;
+	long long (*run)(long long n);	// n calls --- returns something depending on results
+};
+
+volatile long long benchsink;	// (so results are not optimized away)
+char benchfull[256], benchz[64], benchusage[64], benchcolocated[64];	// LCI strings
+char benchbuf[256], benchbuf2[MAX_LINE];
+
+long long benchgetbits (long long n) {
+	long long sum = 0;
+	for (long long i = 0; i < n; i++) sum += getbits(benchfull + 10, (int)(i & 63), 34);
+	return sum;
+}
+
+long long benchputbits (long long n) {
+	for (long long i = 0; i < n; i++) putbits(benchbuf, (int)(i & 63), 34, i);
+	return benchbuf[0];
+}
+
+long long benchmortonkey (long long n) {
+	unsigned long long sum = 0;
+	for (long long i = 0; i < n; i++) sum += mortonkey(i * 0x9E3779B1LL, sum);
+	return (long long) sum;
+}
+
+long long benchmortonportable (long long n) {
+	unsigned long long sum = 0;
+	for (long long i = 0; i < n; i++) sum += mortonportable(i * 0x9E3779B1LL, sum);
+	return (long long) sum;
+}
+
+long long benchhex (long long n) {	// 16 octets hexadecimal to binary and back
+	for (long long i = 0; i < n; i++) {
+		for (int k = 0; k < 16; k++) putoctet(benchbuf, k, getoctet(benchfull + 10, k) ^ (int)(i & 0xFF));
+	}
+	return benchbuf[0];
+}
+
+long long benchencodebinarydot (long long n) {
+	long long sum = 0;
+	for (long long i = 0; i < n; i++) sum += encodebinarydot(0.0007105 * (1 + (i & 15)), 8);
+	return sum;
+}
+
+long long benchdecodebinarydot (long long n) {
+	double sum = 0;
+	for (long long i = 0; i < n; i++) sum += decodebinarydot(1 + (int)(i & 31), 8);
+	return (long long) sum;
+}
+
+long long benchdecodeLCIfield (long long n) {
+	long long sum = 0;
+	for (long long i = 0; i < n; i++) sum += decodeLCIfield(benchfull + 10, 0);
+	return sum;
+}
+
+long long benchencodeLCIfield (long long n) {
+	long long sum = 0;
+	for (long long i = 0; i < n; i++) sum += encodeLCIfield(benchbuf, 0);
+	return sum;
+}
+
+long long benchencodeZfield (long long n) {
+	long long sum = 0;
+	for (long long i = 0; i < n; i++) sum += encodeZfield(benchbuf, 0);
+	return sum;
+}
+
+long long benchencodeUsageField (long long n) {
+	long long sum = 0;
+	for (long long i = 0; i < n; i++) sum += encodeUsageField(benchbuf, 0);
+	return sum;
+}
+
+long long benchencodeColocatedBSSID (long long n) {
+	long long sum = 0;
+	for (long long i = 0; i < n; i++) sum += encodeColocatedBSSID(benchbuf, 0, bssid_index);
+	return sum;
+}
+
+long long benchdecodeColocatedBSSID (long long n) {	// (str past header, ID and length octets)
+	long long sum = 0;
+	for (long long i = 0; i < n; i++) sum += decodeColocatedBSSID(benchcolocated, 5, 13);
+	return sum;
+}
+
+long long benchdecodestring (const char *str, long long n) {
+	for (long long i = 0; i < n; i++) decodeLCIstring(str);
+	return diagnostics;
+}
+
+long long benchdecodeZ (long long n) { return benchdecodestring(benchz, n); }
+long long benchdecodeUsage (long long n) { return benchdecodestring(benchusage, n); }
+long long benchdecodeLCIstring (long long n) { return benchdecodestring(benchfull, n); }
+
+long long benchencodeLCIstring (long long n) {
+	long long sum = 0;
+	for (long long i = 0; i < n; i++) {
+		char *str = encodeLCIstring();
+		sum += str[10];
+		free(str);
+	}
+	return sum;
+}
+
+// golden corpus (see above) decoded as -decode does, and records encoded: set up by a thread
+// of its own, so that defaults are the built-in ones (not the command line's)
+
+LciRecord goldendefaults, goldenrecords[NUM_GOLDEN];
+int goldenready = 0;
+
+void goldenprepare (void) {
+	saveLciRecord(&goldendefaults);
+	for (int g = 0; g < NUM_GOLDEN; g++) {
+		char line[MAX_LINE];
+		snprintf(line, sizeof(line), "%s", goldenvectors[g].record);
+		memcpy(&goldenrecords[g], &goldendefaults, sizeof(LciRecord));
+		char *rest = line, *token;
+		while ((token = nexttoken(&rest)) != NULL)
+			if (strncmp(token, "diagnostics=", 12) != 0) parseLciField(&goldenrecords[g], token);
+	}
+	goldenready = 1;
+	freeColocatedBSSIDs();		// (this thread's copy)
+}
+
+long long benchgoldendecode (long long n) {
+	LciRecord rec;
+	long long sum = 0;
+	for (long long i = 0; i < n; ) {
+		for (int g = 0; g < NUM_GOLDEN && i < n; g++) {
+			if (goldenvectors[g].lci == NULL) continue;
+			decodeLciRecord(goldenvectors[g].lci, &goldendefaults, &rec);
+			sum += formatLciRecord(benchbuf2, sizeof(benchbuf2), &rec);
+			i++;
+		}
+	}
+	return sum;
+}
+
+long long benchgoldenencode (long long n) {
+	long long sum = 0;
+	for (long long i = 0; i < n; i++) {
+		cachedEncode(&goldenrecords[i % NUM_GOLDEN], benchbuf2, sizeof(benchbuf2));
+		sum += benchbuf2[10];
+	}
+	return sum;
+}
+
+const BenchKernel benchkernels[] = {
+	{ "getbits", benchgetbits },
+	{ "putbits", benchputbits },
+	{ "hex", benchhex },
+	{ "mortonkey", benchmortonkey },
+	{ "mortonportable", benchmortonportable },
+	{ "encodebinarydot", benchencodebinarydot },
+	{ "decodebinarydot", benchdecodebinarydot },
+	{ "decodeLCIfield", benchdecodeLCIfield },
+	{ "encodeLCIfield", benchencodeLCIfield },
+	{ "decodeZ", benchdecodeZ },
+	{ "encodeZfield", benchencodeZfield },
+	{ "decodeUsage", benchdecodeUsage },
+	{ "encodeUsageField", benchencodeUsageField },
+	{ "decodeColocatedBSSID", benchdecodeColocatedBSSID },
+	{ "encodeColocatedBSSID", benchencodeColocatedBSSID },
+	{ "decodeLCIstring", benchdecodeLCIstring },
+	{ "encodeLCIstring", benchencodeLCIstring },
+	{ "goldendecode", benchgoldendecode },	// (per record: decoded and printed)
+	{ "goldenencode", benchgoldenencode },
+};
+
+// set up global variables and inputs: Sydney Opera House, with two colocated BSSIDs
+
+void benchsetup (void) {
+	quietflag = 1;
+	verboseflag = traceflag = debugflag = 0;
+	clearColocatedBSSIDs();
+	decodeLCIstring(lci2);
+	extractBSSID("00:11:22:33:44:55,66:77:88:99:aa:bb");
+	char *str = encodeLCIstring();
+	snprintf(benchfull, sizeof(benchfull), "%s", str);
+	free(str);
+	snprintf(benchz, sizeof(benchz), "%.6s0406000000000012", lci2);
+	snprintf(benchusage, sizeof(benchusage), "%.6s060101", lci2);
+	snprintf(benchcolocated, sizeof(benchcolocated), "%.6s070d02001122334455667788990abb", lci2);
+	memcpy(benchbuf, benchfull, strlen(benchfull) + 1);
+	if (! goldenready) std::thread(goldenprepare).join();
+}
+
+double benchrun (const BenchKernel *kernel, long long n) {	// ns per call
+	long long start = nanoclock();
+	benchsink = benchsink + kernel->run(n);
+	return (double)(nanoclock() - start) / n;
+}
+
+// Hardware performance counters (-benchcounters, Linux perf_event_open): counted over
+// the timed repetitions (user space only) and reported per call. Counters that can't be
+// opened (no PMU in a virtual machine, perf_event_paranoid, seccomp) are left out.
+
+enum bench_counters { COUNTER_CYCLES, COUNTER_INSTRUCTIONS, COUNTER_BRANCH_MISSES, COUNTER_L1D_MISSES,
+					  COUNTER_LLC_MISSES, NUM_COUNTERS };
+
+const char *bench_counter_names[NUM_COUNTERS] = {
+	"cycles", "instructions", "branch_misses", "l1d_misses", "llc_misses",
+};
+
+int benchcounters[NUM_COUNTERS] = { -1, -1, -1, -1, -1 };	// descriptors (-1 if not counting)
+
+#ifdef __linux__
+
+int opencounters (void) {	// returns number of counters available
+	static const unsigned int types[NUM_COUNTERS] = {
+		PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE,
+	};
+	static const unsigned long long configs[NUM_COUNTERS] = {
+		PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_BRANCH_MISSES,
+		PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+		PERF_COUNT_HW_CACHE_MISSES,
+	};
+	int navailable = 0;
+	for (int c = 0; c < NUM_COUNTERS; c++) {
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = types[c];
+		attr.config = configs[c];
+		attr.disabled = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+		benchcounters[c] = (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+		if (benchcounters[c] >= 0) navailable++;
+	}
+	return navailable;
+}
+
+void startcounters (void) {
+	for (int c = 0; c < NUM_COUNTERS; c++) {
+		if (benchcounters[c] < 0) continue;
+		ioctl(benchcounters[c], PERF_EVENT_IOC_RESET, 0);
+		ioctl(benchcounters[c], PERF_EVENT_IOC_ENABLE, 0);
+	}
+}
+
+void stopcounters (double *counts) {	// (-1 if not counted)
+	for (int c = 0; c < NUM_COUNTERS; c++) {
+		counts[c] = -1;
+		if (benchcounters[c] < 0) continue;
+		ioctl(benchcounters[c], PERF_EVENT_IOC_DISABLE, 0);
+		unsigned long long values[3];	// count, time enabled, time running
+		if (read(benchcounters[c], values, sizeof(values)) != (ssize_t) sizeof(values) || values[2] == 0) continue;
+		counts[c] = (double) values[0] * ((double) values[1] / values[2]);	// (scaled if multiplexed)
+	}
+}
+
+void closecounters (void) {
+	for (int c = 0; c < NUM_COUNTERS; c++) {
+		if (benchcounters[c] >= 0) close(benchcounters[c]);
+		benchcounters[c] = -1;
+	}
+}
+
+#else
+
+int opencounters (void) {
+	return 0;
+}
+
+void startcounters (void) {
+}
+
+void stopcounters (double *counts) {
+	for (int c = 0; c < NUM_COUNTERS; c++) counts[c] = -1;
+}
+
+void closecounters (void) {
+}
+
+#endif
+
+long peakrss (void) {	// (KB, or -1 if not known)
+#ifdef _WIN32
+	return -1;
+#else
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0) return -1;
+#ifdef __APPLE__
+	return usage.ru_maxrss / 1024;	// (bytes there)
+#else
+	return usage.ru_maxrss;
+#endif
+#endif
+}
+
+double INLINE percentile (const double *sorted, int n, double p) {	// (interpolated)
+	double pos = p * (n - 1);
+	int k = (int) pos;
+	return (k + 1 < n) ? sorted[k] + (pos - k) * (sorted[k + 1] - sorted[k]) : sorted[n - 1];
+}
+
+// One-sided Mann-Whitney U test --- probability of y being this much larger than x (or more)
+// if both came from the same distribution (normal approximation, corrected for ties)
+
+double mannwhitney (const double *x, int nx, const double *y, int ny) {
+	int n = nx + ny;
+	std::pair<double, int> *all = new std::pair<double, int>[n];	// value, from y
+	for (int k = 0; k < nx; k++) all[k] = std::make_pair(x[k], 0);
+	for (int k = 0; k < ny; k++) all[nx + k] = std::make_pair(y[k], 1);
+	std::sort(all, all + n);
+	double ranky = 0, ties = 0;
+	for (int k = 0; k < n; ) {
+		int j = k;
+		while (j < n && all[j].first == all[k].first) j++;
+		double rank = (k + 1 + j) / 2.0;	// (average of ranks k+1 to j)
+		for (int i = k; i < j; i++) if (all[i].second) ranky += rank;
+		ties += (double)(j - k) * (j - k) * (j - k) - (j - k);
+		k = j;
+	}
+	delete [] all;
+	double u = ranky - ny * (ny + 1) / 2.0;
+	double mean = nx * (double) ny / 2;
+	double var = nx * (double) ny / 12 * ((n + 1) - ties / ((double) n * (n - 1)));
+	if (var <= 0) return (u > mean) ? 0.0 : 1.0;
+	double z = (u - mean - 0.5) / sqrt(var);	// (continuity correction)
+	return 0.5 * erfc(z / sqrt(2.0));
+}
+
+// Baseline results (as written by -benchjson=...)
+
+struct BenchBaseline {
+	char name[64];
+	double *samples;	// ns per call, each repetition
+	int nsamples;
+};
+
+const char *jsonafter (const char *p, const char *name) {	// just past "name": (or NULL)
+	char key[80];
+	snprintf(key, sizeof(key), "\"%s\"", name);
+	if ((p = strstr(p, key)) == NULL) return NULL;
+	p += strlen(key);
+	while (isblankchar(*p) || *p == '\n' || *p == '\r') p++;
+	if (*p++ != ':') return NULL;
+	while (isblankchar(*p) || *p == '\n' || *p == '\r') p++;
+	return p;
+}
+
+BenchBaseline *readBaseline (const char *filename, int *nbaseline) {
+	*nbaseline = 0;
+	FILE *file = NULL;
+	if (fopen_s(&file, filename, "rb") != 0) {
+		printf("ERROR: unable to read %s\n", filename);
+		return NULL;
+	}
+	fseek(file, 0, SEEK_END);
+	long size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	char *text = (char *) malloc(size + 1);
+	if (text == NULL) exit(1);
+	size = (long) fread(text, 1, size, file);
+	text[size] = '\0';
+	fclose(file);
+	int maxbaseline = 0;
+	for (const char *p = text; (p = jsonafter(p, "name")) != NULL; ) maxbaseline++;
+	BenchBaseline *baseline = (BenchBaseline *) calloc(maxbaseline + 1, sizeof(BenchBaseline));
+	if (baseline == NULL) exit(1);
+	const char *p = text;
+	while ((p = jsonafter(p, "name")) != NULL && *nbaseline < maxbaseline) {
+		BenchBaseline *base = &baseline[*nbaseline];
+		int k = 0;
+		if (*p == '"') p++;
+		while (*p != '"' && *p != '\0' && k < (int) sizeof(base->name) - 1) base->name[k++] = *p++;
+		base->name[k] = '\0';
+		const char *q = jsonafter(p, "samples");
+		const char *next = jsonafter(p, "name");
+		if (q == NULL || *q != '[' || (next != NULL && q > next)) continue;	// (no samples)
+		q++;
+		int count = 1;
+		for (const char *c = q; *c != ']' && *c != '\0'; c++) if (*c == ',') count++;
+		base->samples = (double *) malloc(count * sizeof(double));
+		if (base->samples == NULL) exit(1);
+		char *end;
+		for (;;) {
+			double val = strtod(q, &end);
+			if (end == q) break;
+			base->samples[base->nsamples++] = val;
+			for (q = end; isblankchar(*q) || *q == '\n' || *q == '\r'; q++) ;
+			if (*q++ != ',') break;
+		}
+		if (base->nsamples > 0) (*nbaseline)++;
+		else free(base->samples);
+	}
+	free(text);
+	if (*nbaseline == 0) {		// (nothing to compare with is a failure, not a pass)
+		printf("ERROR: no benchmark results in %s\n", filename);
+		free(baseline);
+		return NULL;
+	}
+	return baseline;
+}
+
+void freeBaseline (BenchBaseline *baseline, int nbaseline) {
+	for (int k = 0; k < nbaseline; k++) free(baseline[k].samples);
+	free(baseline);
+}
+
+// compare current results of benchmark with baseline --- returns 1 if it regressed
+
+int comparebaseline (const char *name, const double *samples, double median,
+					 const BenchBaseline *baseline, int nbaseline) {
+	const BenchBaseline *base = NULL;
+	for (int k = 0; k < nbaseline && base == NULL; k++)
+		if (strcmp(baseline[k].name, name) == 0) base = &baseline[k];
+	if (base == NULL) {
+		printf("%-24s %10s %10.2f %9s %10s  new (not in baseline)\n", name, "-", median, "-", "-");
+		return 0;
+	}
+	double *sorted = (double *) malloc(base->nsamples * sizeof(double));
+	if (sorted == NULL) exit(1);
+	memcpy(sorted, base->samples, base->nsamples * sizeof(double));
+	std::sort(sorted, sorted + base->nsamples);
+	double basemedian = percentile(sorted, base->nsamples, 0.5);
+	free(sorted);
+	double change = 100.0 * (median - basemedian) / basemedian;
+	double pslower = mannwhitney(base->samples, base->nsamples, samples, benchreps);
+	double pfaster = mannwhitney(samples, benchreps, base->samples, base->nsamples);
+	int regressed = (change > benchthreshold && pslower < BENCH_ALPHA);
+	const char *verdict = regressed ? "REGRESSED" : (change > benchthreshold) ? "slower (not significant)" :
+		(change < -benchthreshold && pfaster < BENCH_ALPHA) ? "faster" : "ok";
+	printf("%-24s %10.2f %10.2f %+8.1f%% %10.2g  %s\n", name, basemedian, median, change,
+		   (change >= 0) ? pslower : pfaster, verdict);
+	return regressed;
+}
+
+int runbenchmarks (void) {	// returns number of benchmarks that regressed
+	int nkernels = (int)(sizeof(benchkernels) / sizeof(benchkernels[0]));
+	int nbaseline = 0, nregressed = 0;
+	BenchBaseline *baseline = NULL;
+	if (benchbaseline != NULL && (baseline = readBaseline(benchbaseline, &nbaseline)) == NULL) return 1;
+	if (benchreps < 1) benchreps = 1;
+	double *samples = (double *) malloc(benchreps * sizeof(double));
+	double *sorted = (double *) malloc(benchreps * sizeof(double));
+	if (samples == NULL || sorted == NULL) exit(1);
+	FILE *json = NULL;
+	if (benchjson != NULL && fopen_s(&json, benchjson, "w") != 0) {
+		printf("ERROR: unable to write %s\n", benchjson);
+		json = NULL;
+	}
+	if (json != NULL) fprintf(json, "{\"version\":\"%s\",\"repetitions\":%d,\"benchmarks\":[", version, benchreps);
+	if (benchcountersflag && opencounters() == 0)
+		printf("# hardware counters not available (no PMU, or perf_event_paranoid too high), timing only\n");
+	benchsetup();
+	if (baseline == NULL)
+		printf("# %-22s %12s %10s %10s %10s %14s\n", "benchmark", "calls/rep", "median ns", "p10 ns", "p90 ns", "calls/s");
+	else printf("# %-22s %10s %10s %9s %10s  (medians, ns per call; threshold %lg%%)\n", "benchmark",
+				"baseline", "current", "change", "p-value", benchthreshold);
+	int nrun = 0;
+	for (int b = 0; b < nkernels; b++) {
+		const BenchKernel *kernel = &benchkernels[b];
+		if (benchfilter != NULL && strstr(kernel->name, benchfilter) == NULL) continue;
+		long long n = 1, start = nanoclock();
+		for (;;) {		// (warming up)
+			if (benchrun(kernel, n) * n < BENCH_REP_MS * 1e6) n *= 2;
+			else if (nanoclock() - start >= BENCH_WARMUP_MS * 1000000LL) break;
+		}
+		double counts[NUM_COUNTERS];
+		startcounters();
+		for (int r = 0; r < benchreps; r++) samples[r] = sorted[r] = benchrun(kernel, n);
+		stopcounters(counts);
+		for (int c = 0; c < NUM_COUNTERS; c++) if (counts[c] >= 0) counts[c] /= (double) n * benchreps;
+		long rss = peakrss();
+		std::sort(sorted, sorted + benchreps);
+		double median = percentile(sorted, benchreps, 0.5);
+		if (baseline != NULL) nregressed += comparebaseline(kernel->name, samples, median, baseline, nbaseline);
+		else printf("%-24s %12lld %10.2f %10.2f %10.2f %14.0f\n", kernel->name, n, median,
+					percentile(sorted, benchreps, 0.1), percentile(sorted, benchreps, 0.9), 1e9 / median);
+		if (counts[COUNTER_CYCLES] >= 0 || counts[COUNTER_INSTRUCTIONS] >= 0) {		// (per call)
+			printf("  ");
+			for (int c = 0; c < NUM_COUNTERS; c++)
+				if (counts[c] >= 0) printf(" %s %.2f", bench_counter_names[c], counts[c]);
+			if (counts[COUNTER_CYCLES] > 0 && counts[COUNTER_INSTRUCTIONS] >= 0)
+				printf(" IPC %.2f", counts[COUNTER_INSTRUCTIONS] / counts[COUNTER_CYCLES]);
+			printf("\n");
+		}
+		fflush(stdout);
+		if (json == NULL) continue;
+		fprintf(json, "%s\n{\"name\":\"%s\",\"calls_per_rep\":%lld,\"ns_per_call\":{\"median\":%.3f,"
+				"\"p10\":%.3f,\"p90\":%.3f,\"min\":%.3f,\"max\":%.3f},\"calls_per_sec\":%.0f,\"samples\":[",
+				(nrun > 0) ? "," : "", kernel->name, n, median, percentile(sorted, benchreps, 0.1),
+				percentile(sorted, benchreps, 0.9), sorted[0], sorted[benchreps - 1], 1e9 / median);
+		for (int r = 0; r < benchreps; r++) fprintf(json, "%s%.3f", (r > 0) ? "," : "", samples[r]);
+		fprintf(json, "]");
+		int ncounted = 0;
+		for (int c = 0; c < NUM_COUNTERS; c++) {
+			if (counts[c] < 0) continue;
+			fprintf(json, "%s\"%s\":%.3f", (ncounted++ > 0) ? "," : ",\"counters_per_call\":{",
+					bench_counter_names[c], counts[c]);
+		}
+		if (ncounted > 0) fprintf(json, "}");
+		if (rss >= 0) fprintf(json, ",\"peak_rss_kb\":%ld", rss);
+		fprintf(json, "}");
+		nrun++;
+	}
+	if (json != NULL) {
+		fprintf(json, "\n]}\n");
+		fclose(json);
+	}
+	free(samples);
+	free(sorted);
+	closecounters();
+	if (peakrss() >= 0) printf("# peak RSS %ld KB\n", peakrss());
+	if (baseline == NULL) return 0;
+	freeBaseline(baseline, nbaseline);
+	if (nregressed > 0)
+		printf("FAIL: %d benchmark%s regressed by more than %lg%% (compared with %s)\n",
+			   nregressed, (nregressed > 1) ? "s" : "", benchthreshold, benchbaseline);
+	else printf("PASS: no benchmark regressed by more than %lg%% (compared with %s)\n", benchthreshold, benchbaseline);
+	return nregressed;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Round trip harness (-roundtrip): encode -> decode -> encode across the value space, on all
+// threads. Each sweep steps some fields through every code they have, or through the
+// boundaries of their fixed point range (0, +-2^b, +-2^b +-1) and then a random sample of
+// it (-roundtrip=... cases), with the other fields random. The decoded record must equal
+// the one encoded, and encoding it again must give the same LCI string. A record that fails
+// is shrunk (fields reset to defaults, BSSIDs dropped, while it fails the same way) and
+// printed as a record (for -encode=...) along with its lci=...
+
+#define ROUNDTRIP_BLOCK 256		// cases taken by a thread at a time
+#define ROUNDTRIP_SHOW 8		// mismatches printed per sweep and field (the rest counted)
+
+unsigned long long INLINE mix64 (unsigned long long x) {	// (splitmix64)
+	x += 0x9E3779B97F4A7C15ULL;
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+	return x ^ (x >> 31);
+}
+
+unsigned long long INLINE nextrandom (unsigned long long *state) {
+	*state = mix64(*state);
+	return *state;
+}
+
+#define FIXED_BOUNDARIES(nbits) (6 * (nbits))
+
+long long fixedboundary (int nbits, long long k) {	// k-th boundary of signed nbits field
+	long long lo = -(1LL << (nbits - 1)), hi = (1LL << (nbits - 1)) - 1;
+	long long val = (1LL << (k / 6)) + (k % 3) - 1;		// (2^b - 1, 2^b, 2^b + 1)
+	if (k % 6 >= 3) val = -val;
+	return (val < lo) ? lo : (val > hi) ? hi : val;
+}
+
+long long INLINE fixedrandom (int nbits, unsigned long long *state) {	// anywhere in signed nbits field
+	return propagate_sign((long long)(nextrandom(state) & ((1ULL << nbits) - 1)), nbits);
+}
+
+double INLINE uncertaintyvalue (int code, int bpoint) {	// (as decoded: 0 => unknown)
+	return (code == 0) ? 0 : decodebinarydot(code, bpoint);
+}
+
+void randomrecord (unsigned long long seed, LciRecord *rec) {
+	memset(rec, 0, sizeof(LciRecord));
+	unsigned long long state = seed;
+	rec->latitude = fixedrandom(34, &state) / (double)(1 << 25);
+	rec->longitude = fixedrandom(34, &state) / (double)(1 << 25);
+	rec->altitude = fixedrandom(30, &state) / 256.0;
+	rec->latitude_uncertainty = uncertaintyvalue((int)(nextrandom(&state) % (MAX_LCI_UNCERTAINTY + 1)), 8);
+	rec->longitude_uncertainty = uncertaintyvalue((int)(nextrandom(&state) % (MAX_LCI_UNCERTAINTY + 1)), 8);
+	rec->altitude_uncertainty = uncertaintyvalue((int)(nextrandom(&state) % (MAX_LCI_UNCERTAINTY + 1)), 21);
+	unsigned long long bits = nextrandom(&state);
+	rec->Altitude_Type = (int)(bits & 15);
+	rec->datum = (int)((bits >> 4) & 7);
+	rec->RegLoc_Agreement = (int)((bits >> 7) & 1);
+	rec->RegLoc_DSE = (int)((bits >> 8) & 1);
+	rec->Dependent_STA = (int)((bits >> 9) & 1);
+	rec->LCI_version = (int)((bits >> 10) & 3);
+	rec->expected_to_move = (int)((bits >> 12) & 3);
+	rec->retransmission_allowed = (int)((bits >> 14) & 1);
+	rec->STA_location_policy = (int)((bits >> 15) & 1);
+	rec->expiration = ((bits >> 16) & 3) ? 0 : (int)((bits >> 18) & 0xFFFF);
+	rec->retention_expires_present = (rec->expiration != 0);	// (else encoder overrides it)
+	rec->ncolocated = ((bits >> 34) & 7) ? (int)((bits >> 37) & 3) : (int)((bits >> 37) % (MAX_COLOCATED + 1));
+	rec->sta_floor = fixedrandom(14, &state) / 16.0;
+	rec->sta_height_above_floor = fixedrandom(24, &state) / 4096.0;
+	rec->sta_height_above_floor_uncertainty = uncertaintyvalue((int)(nextrandom(&state) % (MAX_Z_UNCERTAINTY + 1)), 11);
+	for (int k = 0; k < rec->ncolocated; k++) {
+		unsigned long long mac = nextrandom(&state);
+		for (int i = 0; i < 6; i++) rec->colocated[k][i] = (unsigned char)(mac >> (8 * i));
+	}
+}
+
+// sweeps: set fields of (random) record for k-th case
+
+void sweeplatlonunc (long long k, LciRecord *rec) {		// all pairs of codes (binary point 8)
+	rec->latitude_uncertainty = uncertaintyvalue((int)(k % (MAX_LCI_UNCERTAINTY + 1)), 8);
+	rec->longitude_uncertainty = uncertaintyvalue((int)(k / (MAX_LCI_UNCERTAINTY + 1) % (MAX_LCI_UNCERTAINTY + 1)), 8);
+}
+
+void sweepaltunc (long long k, LciRecord *rec) {	// (binary point 21)
+	rec->altitude_uncertainty = uncertaintyvalue((int)(k % (MAX_LCI_UNCERTAINTY + 1)), 21);
+}
+
+void sweepheightunc (long long k, LciRecord *rec) {	// (binary point 11)
+	rec->sta_height_above_floor_uncertainty = uncertaintyvalue((int)(k % (MAX_Z_UNCERTAINTY + 1)), 11);
+}
+
+void sweeplatitude (long long k, LciRecord *rec) {	// (random after boundaries)
+	if (k < FIXED_BOUNDARIES(34)) rec->latitude = fixedboundary(34, k) / (double)(1 << 25);
+}
+
+void sweeplongitude (long long k, LciRecord *rec) {
+	if (k < FIXED_BOUNDARIES(34)) rec->longitude = fixedboundary(34, k) / (double)(1 << 25);
+}
+
+void sweepaltitude (long long k, LciRecord *rec) {	// every altitude type with each boundary
+	rec->Altitude_Type = (int)(k & 15);
+	if (k / 16 < FIXED_BOUNDARIES(30)) rec->altitude = fixedboundary(30, k / 16) / 256.0;
+}
+
+void sweepfloor (long long k, LciRecord *rec) {		// every STA Floor Info (floor and movable)
+	rec->expected_to_move = (int)(k & 3);
+	rec->sta_floor = propagate_sign(k >> 2, 14) / 16.0;
+}
+
+void sweepheight (long long k, LciRecord *rec) {
+	if (k < FIXED_BOUNDARIES(24)) rec->sta_height_above_floor = fixedboundary(24, k) / 4096.0;
+}
+
+void sweepusage (long long k, LciRecord *rec) {		// every expiration, with each flag
+	rec->expiration = (int)(k & 0xFFFF);
+	rec->retention_expires_present = (rec->expiration != 0);
+	rec->retransmission_allowed = (int)((k >> 16) & 1);
+	rec->STA_location_policy = (int)((k >> 17) & 1);
+}
+
+void sweepflags (long long k, LciRecord *rec) {		// datum, RegLoc, Dependent STA, version
+	rec->datum = (int)(k & 7);
+	rec->RegLoc_Agreement = (int)((k >> 3) & 1);
+	rec->RegLoc_DSE = (int)((k >> 4) & 1);
+	rec->Dependent_STA = (int)((k >> 5) & 1);
+	rec->LCI_version = (int)((k >> 6) & 3);
+}
+
+void sweepcolocated (long long k, LciRecord *rec) {	// 0 to MAX_COLOCATED BSSIDs
+	int n = (int)(k % (MAX_COLOCATED + 1));
+	for (int j = rec->ncolocated; j < n; j++) {
+		unsigned long long mac = mix64((unsigned long long) k * MAX_COLOCATED + j);
+		for (int i = 0; i < 6; i++) rec->colocated[j][i] = (unsigned char)(mac >> (8 * i));
+	}
+	rec->ncolocated = n;
+}
+
+void sweeprandom (long long, LciRecord *) {	// (random record, made before this is called, is complete)
+}
+
+struct RoundtripSweep {
+	const char *name;
+	void (*make)(long long k, LciRecord *rec);
+	long long cases;		// (plus roundtripcount if sampled)
+	int sampled;
+};
+
+const RoundtripSweep roundtripsweeps[] = {
+	{ "lat/lon uncertainty",	sweeplatlonunc,	(MAX_LCI_UNCERTAINTY + 1) * (MAX_LCI_UNCERTAINTY + 1) * 16, 0 },
+	{ "alt uncertainty",		sweepaltunc,	(MAX_LCI_UNCERTAINTY + 1) * 64, 0 },
+	{ "height uncertainty",		sweepheightunc,	(MAX_Z_UNCERTAINTY + 1) * 64, 0 },
+	{ "latitude",				sweeplatitude,	FIXED_BOUNDARIES(34), 1 },
+	{ "longitude",				sweeplongitude,	FIXED_BOUNDARIES(34), 1 },
+	{ "altitude",				sweepaltitude,	16 * FIXED_BOUNDARIES(30), 1 },
+	{ "floor",					sweepfloor,		1 << 16, 0 },
+	{ "height",					sweepheight,	FIXED_BOUNDARIES(24), 1 },
+	{ "usage",					sweepusage,		1 << 18, 0 },
+	{ "flags",					sweepflags,		256 * 16, 0 },
+	{ "colocated",				sweepcolocated,	(MAX_COLOCATED + 1) * 64, 0 },
+	{ "random",					sweeprandom,	0, 1 },
+};
+
+#define NUM_SWEEPS ((int)(sizeof(roundtripsweeps) / sizeof(roundtripsweeps[0])))
+
+struct RoundtripRun {
+	long long cases[NUM_SWEEPS];
+	long long total;
+	std::atomic<long long> next;	// (first case not yet taken)
+	std::mutex lock;				// (reporting mismatches)
+	long long mismatches[NUM_SWEEPS][NUM_LCIFIELDS + 1];	// (by field, last: encoding again differs)
+};
+
+// first field in which records differ (index in lcifields), or -1
+
+int recorddiffers (const LciRecord *a, const LciRecord *b) {
+	for (int f = 0; f < NUM_LCIFIELDS; f++) {
+		const LciField *field = &lcifields[f];
+		if (field->type == FIELD_DOUBLE && *fielddouble(a, field) != *fielddouble(b, field)) return f;
+		if (field->type == FIELD_INT && *fieldint(a, field) != *fieldint(b, field)) return f;
+		if (field->type == FIELD_BSSIDS && (a->ncolocated != b->ncolocated ||
+			memcmp(a->colocated, b->colocated, a->ncolocated * 6) != 0)) return f;
+	}
+	return -1;
+}
+
+// encode -> decode -> encode --- returns -1 if all is well, field decoded wrong (index in
+// lcifields), or NUM_LCIFIELDS if encoding the decoded record gives a different string
+
+int roundtripcheck (const LciRecord *rec, const LciRecord *blank, char *lci, LciRecord *back) {
+	char again[MAX_LINE];
+	batchencode(rec, lci, MAX_LINE);
+	batchdecode(lci, blank, back);
+	int f = recorddiffers(rec, back);
+	if (f >= 0) return f;
+	batchencode(back, again, sizeof(again));
+	return (strcmp(lci, again) != 0) ? NUM_LCIFIELDS : -1;
+}
+
+// reset fields (and drop BSSIDs) while record still fails the same way
+
+void roundtripshrink (LciRecord *rec, const LciRecord *blank, int fail) {
+	char lci[MAX_LINE];
+	LciRecord trial, back;
+	for (int f = 0; f < NUM_LCIFIELDS; f++) {
+		const LciField *field = &lcifields[f];
+		for (;;) {
+			memcpy(&trial, rec, sizeof(LciRecord));
+			if (field->type == FIELD_DOUBLE) *fielddouble(&trial, field) = *fielddouble(blank, field);
+			else if (field->type == FIELD_INT) *fieldint(&trial, field) = *fieldint(blank, field);
+			else if (trial.ncolocated > 0) trial.ncolocated--;
+			if (memcmp(&trial, rec, sizeof(LciRecord)) == 0 || roundtripcheck(&trial, blank, lci, &back) != fail) break;
+			memcpy(rec, &trial, sizeof(LciRecord));
+			if (field->type != FIELD_BSSIDS) break;
+		}
+	}
+	if (rec->ncolocated < MAX_COLOCATED) memset(rec->colocated[rec->ncolocated], 0, (MAX_COLOCATED - rec->ncolocated) * 6);
+}
+
+void roundtripreport (RoundtripRun *run, int sweep, long long k, const LciRecord *rec, const LciRecord *blank, int fail) {
+	{
+		std::lock_guard<std::mutex> guard(run->lock);
+		if (++run->mismatches[sweep][fail] > ROUNDTRIP_SHOW) return;
+	}
+	LciRecord small, back;
+	memcpy(&small, rec, sizeof(LciRecord));
+	roundtripshrink(&small, blank, fail);
+	char lci[MAX_LINE], text[MAX_LINE], again[MAX_LINE], val[64];
+	roundtripcheck(&small, blank, lci, &back);
+	if (formatLciRecord(text, sizeof(text), &small) < 0) strcpy(text, "(record too long)");
+	std::lock_guard<std::mutex> guard(run->lock);
+	printf("MISMATCH %s case %lld: ", roundtripsweeps[sweep].name, k);
+	if (fail < NUM_LCIFIELDS) {
+		const LciField *field = &lcifields[fail];
+		if (field->type == FIELD_DOUBLE) formatdouble(val, sizeof(val), *fielddouble(&back, field));
+		else if (field->type == FIELD_INT) snprintf(val, sizeof(val), "%d", *fieldint(&back, field));
+		else snprintf(val, sizeof(val), "%d BSSIDs", back.ncolocated);
+		printf("%s decoded as %s\n", field->name, val);
+	}
+	else {
+		batchencode(&back, again, sizeof(again));
+		printf("encoding decoded record gives lci=%s\n", again);
+	}
+	printf("  %s\n  lci=%s\n", text, lci);
+}
+
+void roundtripworker (RoundtripRun *run) {
+	LciRecord blank, rec, back;
+	saveLciRecord(&blank);		// (this thread's defaults, not the command line's)
+	char lci[MAX_LINE];
+	for (;;) {
+		long long first = run->next.fetch_add(ROUNDTRIP_BLOCK);
+		if (first >= run->total) break;
+		long long last = (first + ROUNDTRIP_BLOCK < run->total) ? first + ROUNDTRIP_BLOCK : run->total;
+		int sweep = 0;
+		long long k = first;
+		while (k >= run->cases[sweep]) k -= run->cases[sweep++];
+		for (long long n = first; n < last; n++, k++) {
+			while (k >= run->cases[sweep]) {
+				k = 0;
+				sweep++;
+			}
+			randomrecord(mix64(((unsigned long long) sweep << 56) ^ (unsigned long long) k), &rec);
+			roundtripsweeps[sweep].make(k, &rec);
+			int fail = roundtripcheck(&rec, &blank, lci, &back);
+			if (fail >= 0) roundtripreport(run, sweep, k, &rec, &blank, fail);
+		}
+	}
+	freeColocatedBSSIDs();		// (this thread's copy)
+}
+
+int roundtrip (void) {	// returns number of mismatches
+	RoundtripRun *run = new RoundtripRun;
+	run->total = 0;
+	for (int s = 0; s < NUM_SWEEPS; s++) {
+		run->cases[s] = roundtripsweeps[s].cases + (roundtripsweeps[s].sampled ? roundtripcount : 0);
+		run->total += run->cases[s];
+	}
+	run->next = 0;
+	memset(run->mismatches, 0, sizeof(run->mismatches));
+	int oldverboseflag = verboseflag, oldquietflag = quietflag;
+	verboseflag = 0;
+	quietflag = 1;
+	int nworkers = getnthreads();
+	long long start = nanoclock();
+	std::thread *workers = new std::thread[nworkers];
+	for (int t = 0; t < nworkers; t++) workers[t] = std::thread(roundtripworker, run);
+	for (int t = 0; t < nworkers; t++) workers[t].join();
+	delete [] workers;
+	double seconds = (nanoclock() - start) * 1e-9;
+	verboseflag = oldverboseflag;
+	quietflag = oldquietflag;
+	long long nmismatches = 0;
+	printf("# round trip: %lld records in %.3f s (%.0f records/s) on %d thread%s\n", run->total, seconds,
+		   (seconds > 0) ? run->total / seconds : 0.0, nworkers, (nworkers > 1) ? "s" : "");
+	printf("# %-20s %10s %10s\n", "sweep", "cases", "mismatches");
+	for (int s = 0; s < NUM_SWEEPS; s++) {
+		long long n = 0;
+		for (int f = 0; f <= NUM_LCIFIELDS; f++) n += run->mismatches[s][f];
+		printf("# %-20s %10lld %10lld", roundtripsweeps[s].name, run->cases[s], n);
+		for (int f = 0; f <= NUM_LCIFIELDS; f++)
+			if (run->mismatches[s][f] > 0)
+				printf(" %s=%lld", (f < NUM_LCIFIELDS) ? lcifields[f].name : "lci", run->mismatches[s][f]);
+		printf("\n");
+		nmismatches += n;
+	}
+	if (nmismatches > 0) printf("FAIL: %lld record%s did not survive encode -> decode -> encode\n",
+								nmismatches, (nmismatches > 1) ? "s" : "");
+	else printf("PASS: all records survived encode -> decode -> encode\n");
+	delete run;
+	return (nmismatches > 0x7FFFFFFF) ? 0x7FFFFFFF : (int) nmismatches;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Golden corpus check (-golden): each string decoded, and each record encoded, through the
+// batch code (as -decode and -encode would, with built-in defaults), must give exactly the
+// line stored. Then the corpus is benchmarked (goldendecode, goldenencode: see -bench).
+
+const char *goldenline (BatchChunk *chunk, const char *line, int encodeflag) {	// (output without newline)
+	chunk->in.len = 0;
+	appendbytes(&chunk->in, line, (int) strlen(line) + 1);
+	chunk->nlines = chunk->firstline = 1;
+	batchchunk(chunk, &goldendefaults, encodeflag);
+	if (chunk->out.len > 0 && chunk->out.str[chunk->out.len - 1] == '\n') chunk->out.len--;
+	appendbytes(&chunk->out, "", 1);
+	return chunk->out.str;
+}
+
+int goldencompare (const char *name, const char *what, const char *expected, const char *got) {
+	if (strcmp(expected, got) == 0) return 0;
+	printf("MISMATCH %s (%s)\n  expected %s\n  got      %s\n", name, what, expected, got);
+	return 1;
+}
+
+void goldencheck (int *nmismatches) {
+	goldenprepare();
+	BatchChunk chunk;
+	memset(&chunk, 0, sizeof(chunk));
+	for (int g = 0; g < NUM_GOLDEN; g++) {
+		const GoldenVector *vector = &goldenvectors[g];
+		if (vector->lci != NULL)
+			*nmismatches += goldencompare(vector->name, "decoding", vector->record, goldenline(&chunk, vector->lci, 0));
+		*nmismatches += goldencompare(vector->name, "encoding", vector->again, goldenline(&chunk, vector->record, 1));
+	}
+	free(chunk.in.str);
+	free(chunk.out.str);
+	freeColocatedBSSIDs();		// (this thread's copy)
+}
+
+int rungolden (void) {	// returns number of mismatches
+	int nmismatches = 0;
+	int oldverboseflag = verboseflag, oldquietflag = quietflag;
+	verboseflag = 0;
+	quietflag = 1;
+	std::thread(goldencheck, &nmismatches).join();	// (built-in defaults and flags)
+	verboseflag = oldverboseflag;
+	quietflag = oldquietflag;
+	if (nmismatches > 0) printf("FAIL: %d golden output%s differ\n", nmismatches, (nmismatches > 1) ? "s" : "");
+	else printf("PASS: %d golden vectors decode and encode exactly as before\n", NUM_GOLDEN);
+	return nmismatches;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Allocation check (-alloccheck): once warmed up, decoding and encoding records through the
+// batch code (as -decode and -encode do, with built-in defaults) must not touch the heap.
+// Random records (as -roundtrip makes them) and their LCI strings are coded over and over,
+// counting malloc, calloc, realloc, strndup and free calls with the -stats hooks.
+
+#define ALLOCCHECK_LINES 64		// records in each chunk coded
+
+#ifndef NOSTATS
+
+void allocpass (BatchChunk *chunk, const LciRecord *defaults, int encodeflag, RunStats *stats) {
+	batchchunk(chunk, defaults, encodeflag);	// warm up (buffers and BSSID slots grow)
+	memset(stats, 0, sizeof(RunStats));
+	runstats = stats;
+	while (stats->records < alloccount) batchchunk(chunk, defaults, encodeflag);
+	runstats = NULL;
+}
+
+void allocworker (RunStats *stats) {	// stats[0] decoding, stats[1] encoding
+	LciRecord defaults, rec;
+	saveLciRecord(&defaults);
+	BatchChunk chunks[2];
+	memset(chunks, 0, sizeof(chunks));
+	char line[MAX_LINE];
+	for (int k = 0; k < ALLOCCHECK_LINES; k++) {
+		randomrecord(mix64(k + 1), &rec);
+		memcpy(line, "lci=", 4);
+		cachedEncode(&rec, line + 4, sizeof(line) - 4);
+		appendbytes(&chunks[0].in, line, (int) strlen(line) + 1);
+		formatLciRecord(line, sizeof(line), &rec);
+		appendbytes(&chunks[1].in, line, (int) strlen(line) + 1);
+	}
+	for (int c = 0; c < 2; c++) {
+		chunks[c].nlines = ALLOCCHECK_LINES;
+		chunks[c].firstline = 1;
+		allocpass(&chunks[c], &defaults, c, &stats[c]);
+		free(chunks[c].in.str);
+		free(chunks[c].out.str);
+	}
+	freeColocatedBSSIDs();		// (this thread's copy)
+}
+
+int alloccheck (void) {		// returns number of heap calls seen
+	RunStats stats[2];
+	int oldverboseflag = verboseflag, oldquietflag = quietflag;
+	verboseflag = 0;
+	quietflag = 1;
+	std::thread(allocworker, stats).join();	// (built-in defaults and flags)
+	verboseflag = oldverboseflag;
+	quietflag = oldquietflag;
+	long long ncalls = 0;
+	for (int c = 0; c < 2; c++) {
+		printf("# %s %lld records:", (c == 0) ? "decode" : "encode", stats[c].records);
+		for (int call = 0; call < NUM_ALLOC_CALLS; call++) {
+			printf(" %s %lld", alloc_call_names[call], stats[c].calls_by_kind[call]);
+			ncalls += stats[c].calls_by_kind[call];
+		}
+		printf(" (%.3f per record)\n", (stats[c].records > 0) ?
+			   (double)(stats[c].allocations + stats[c].frees) / stats[c].records : 0.0);
+	}
+	if (ncalls > 0) printf("FAIL: %lld heap call%s while decoding and encoding records\n", ncalls, (ncalls > 1) ? "s" : "");
+	else printf("PASS: no heap allocations while decoding and encoding records\n");
+	return (ncalls > 0x7FFFFFFF) ? 0x7FFFFFFF : (int) ncalls;
+}
+
+#else
+
+int alloccheck (void) {
+	printf("ERROR: -alloccheck not available (built with NOSTATS)\n");
+	return 1;
+}
+
+#endif
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Quantization error (-quantization=...): how far the fixed point fields of the LCI and Z
+// subelements are from the values they stand for, next to the uncertainty the record claims.
+// Lines hold LCI strings (as for -decode) or records (as for -encode), optionally after a
+// BSSID, so fleet files will do. A record's values are quantized as the encoder does it; an
+// LCI string's values already were, so the most the encoder could have moved them is used.
+// Errors are in m (lat and lon along the ground, floors floorheight apart; height is held
+// to the height uncertainty, floor to none: the Z subelement gives none for the floor number,
+// and the height's is no measure of it). APs whose error exceeds the uncertainty are flagged,
+// then each field is summed up over the fleet: error percentiles, and a histogram of error
+// divided by uncertainty.
+
+enum quant_fields { QUANT_LAT, QUANT_LON, QUANT_ALT, QUANT_FLOOR, QUANT_HEIGHT, NUM_QUANT_FIELDS };
+
+struct QuantField {
+	const char *name;
+	double scale;		// stored as value * scale ...
+	int truncated;		// ... truncated (else rounded) by the encoder
+};
+
+const QuantField quantfields[NUM_QUANT_FIELDS] = {
+	{ "lat",	(double)(1 << 25),	0 },
+	{ "lon",	(double)(1 << 25),	0 },
+	{ "alt",	256.0,				0 },
+	{ "floor",	16.0,				1 },
+	{ "height",	4096.0,				1 },
+};
+
+enum quant_kinds { QUANT_BAD = -1, QUANT_SKIPPED, QUANT_DECODED, QUANT_ENCODED };
+
+#define QUANT_BUCKETS 10	// error / uncertainty below 4^-6, 4^-5, ... 4^2, and the rest
+
+struct QuantFleet {		// one entry per line (structure of arrays, for the reductions)
+	int n;
+	const char **lines;
+	char (*names)[BSSID_TEXT];			// BSSID (if line has one)
+	signed char *kind;
+	double *error[NUM_QUANT_FIELDS];	// m
+	double *ratio[NUM_QUANT_FIELDS];	// error / uncertainty (-1 if uncertainty unknown)
+};
+
+struct QuantSummary {
+	long long count, known, flagged;
+	double sum, max;
+	long long buckets[QUANT_BUCKETS];
+};
+
+// decode (or parse) line into record --- returns kind of line
+
+int quantline (char *line, const LciRecord *defaults, LciRecord *rec, char *name) {
+	char *rest = line;
+	char *token = nexttoken(&rest);
+	if (token == NULL || *token == '#') return QUANT_SKIPPED;
+	if (isValidBSSID(token)) {
+		snprintf(name, BSSID_TEXT, "%s", token);
+		token = nexttoken(&rest);
+	}
+	if (token == NULL) return QUANT_BAD;
+	if (_strnicmp(token, "lci=", 4) == 0 || ishexstring(token)) {
+		if (_strnicmp(token, "lci=", 4) == 0) token += 4;
+		if (! ishexstring(token)) return QUANT_BAD;
+		decodeLciRecord(token, defaults, rec);
+		return QUANT_DECODED;
+	}
+	memcpy(rec, defaults, sizeof(LciRecord));
+	for (; token != NULL; token = nexttoken(&rest)) {
+		if (strncmp(token, "diagnostics=", 12) == 0) continue;
+		if (! parseLciField(rec, token)) return QUANT_BAD;
+	}
+	return QUANT_ENCODED;
+}
+
+void quanterrors (QuantFleet *fleet, int i, const LciRecord *rec, int decoded) {
+	double values[NUM_QUANT_FIELDS] = { rec->latitude, rec->longitude, rec->altitude, rec->sta_floor,
+										rec->sta_height_above_floor };
+	double uncertainties[NUM_QUANT_FIELDS] = { rec->latitude_uncertainty, rec->longitude_uncertainty,
+		rec->altitude_uncertainty, 0, rec->sta_height_above_floor_uncertainty };	// (floor: unknown)
+	double meters = EARTH_RADIUS * DEGREES_TO_RADIANS;	// (per degree of latitude)
+	double units[NUM_QUANT_FIELDS] = { meters, meters * cos(rec->latitude * DEGREES_TO_RADIANS),
+		(rec->Altitude_Type == ALTITUDE_FLOORS) ? floorheight : 1.0, floorheight, 1.0 };
+	double uncunits[NUM_QUANT_FIELDS] = { units[QUANT_LAT], units[QUANT_LON], units[QUANT_ALT], 1.0, 1.0 };
+	for (int f = 0; f < NUM_QUANT_FIELDS; f++) {
+		const QuantField *field = &quantfields[f];
+		double error;
+		if (decoded) error = (field->truncated ? 1.0 : 0.5) / field->scale;	// (at most)
+		else {
+			double v = values[f] * field->scale;
+			error = fabs(values[f] - (field->truncated ? trunc(v) : round(v)) / field->scale);
+		}
+		error *= units[f];
+		double uncertainty = uncertainties[f] * uncunits[f];
+		fleet->error[f][i] = error;
+		fleet->ratio[f][i] = (uncertainty > 0) ? error / uncertainty : -1;
+	}
+}
+
+void quantworker (void *context, const CodecProfile *profile, const LciRecord *defaults, int lo, int hi) {
+	QuantFleet *fleet = (QuantFleet *) context;
+	applyprofile(profile);
+	LciRecord rec;
+	char line[MAX_LINE];
+	for (int i = lo; i < hi; i++) {
+		snprintf(line, sizeof(line), "%s", fleet->lines[i]);
+		fleet->names[i][0] = '\0';
+		fleet->kind[i] = (signed char) quantline(line, defaults, &rec, fleet->names[i]);
+		if (fleet->kind[i] > 0) quanterrors(fleet, i, &rec, fleet->kind[i] == QUANT_DECODED);
+	}
+	freeColocatedBSSIDs();		// (this thread's copy)
+}
+
+// Sum up one field over n records. Four lanes kept apart, so that the compiler can
+// vectorize the loop (floating point sums are not reordered otherwise). The histogram
+// bucket comes from the exponent bits of the ratio: 4^(b-7) <= ratio < 4^(b-6).
+
+void quantreduce (const double *error, const double *ratio, int n, QuantSummary *summary) {
+	double sum[4] = { 0, 0, 0, 0 }, max[4] = { 0, 0, 0, 0 };
+	long long known[4] = { 0, 0, 0, 0 }, flagged[4] = { 0, 0, 0, 0 };
+	int k = 0;
+	for (; k + 4 <= n; k += 4) {
+		for (int j = 0; j < 4; j++) {
+			double e = error[k + j], r = ratio[k + j];
+			sum[j] += e;
+			max[j] = (e > max[j]) ? e : max[j];
+			known[j] += (r >= 0);
+			flagged[j] += (r > 1);
+		}
+	}
+	for (; k < n; k++) {
+		sum[0] += error[k];
+		max[0] = (error[k] > max[0]) ? error[k] : max[0];
+		known[0] += (ratio[k] >= 0);
+		flagged[0] += (ratio[k] > 1);
+	}
+	memset(summary, 0, sizeof(QuantSummary));
+	summary->count = n;
+	for (int j = 0; j < 4; j++) {
+		summary->sum += sum[j];
+		if (max[j] > summary->max) summary->max = max[j];
+		summary->known += known[j];
+		summary->flagged += flagged[j];
+	}
+	for (k = 0; k < n; k++) {
+		unsigned long long bits;
+		memcpy(&bits, &ratio[k], sizeof(bits));
+		if (bits >> 63) continue;	// (uncertainty unknown)
+		int b = ((int)((bits >> 52) & 0x7FF) - 1023 + 14) >> 1;
+		summary->buckets[(b < 0) ? 0 : (b >= QUANT_BUCKETS) ? QUANT_BUCKETS - 1 : b]++;
+	}
+}
+
+void quantization (const char *filename) {
+	FileLines file;
+	if (! readlines(&file, filename)) return;
+	int nlines = file.nlines;
+	QuantFleet fleet;
+	fleet.n = nlines;
+	fleet.lines = file.lines;
+	fleet.names = (char (*)[BSSID_TEXT]) malloc((nlines + 1) * BSSID_TEXT);
+	fleet.kind = (signed char *) malloc(nlines + 1);
+	if (fleet.names == NULL || fleet.kind == NULL) exit(1);
+	for (int f = 0; f < NUM_QUANT_FIELDS; f++) {
+		fleet.error[f] = (double *) malloc((nlines + 1) * sizeof(double));
+		fleet.ratio[f] = (double *) malloc((nlines + 1) * sizeof(double));
+		if (fleet.error[f] == NULL || fleet.ratio[f] == NULL) exit(1);
+	}
+	splitlines(nlines, quantworker, &fleet);
+
+	int n = 0, ndecoded = 0, nflagged = 0;		// (records moved to the front)
+	for (int i = 0; i < nlines; i++) {
+		if (fleet.kind[i] == QUANT_BAD) printf("ERROR: line %d: missing or invalid LCI string or record\n", i + 1);
+		if (fleet.kind[i] <= 0) continue;
+		int flagged = 0;
+		for (int f = 0; f < NUM_QUANT_FIELDS; f++) {
+			if (fleet.ratio[f][i] <= 1) continue;
+			printf("WARNING: line %d%s%s: %s error %.3g m exceeds uncertainty %.3g m\n", i + 1,
+				   (fleet.names[i][0] != '\0') ? " " : "", fleet.names[i], quantfields[f].name,
+				   fleet.error[f][i], fleet.error[f][i] / fleet.ratio[f][i]);
+			flagged = 1;
+		}
+		nflagged += flagged;
+		ndecoded += (fleet.kind[i] == QUANT_DECODED);
+		for (int f = 0; f < NUM_QUANT_FIELDS; f++) {
+			fleet.error[f][n] = fleet.error[f][i];
+			fleet.ratio[f][n] = fleet.ratio[f][i];
+		}
+		n++;
+	}
+	printf("# quantization: %d record%s (%d decoded, %d encoded) from %s, %d AP%s flagged\n", n, (n == 1) ? "" : "s",
+		   ndecoded, n - ndecoded, filename, nflagged, (nflagged == 1) ? "" : "s");
+	printf("# %-8s %10s %10s %10s %10s %10s %10s %10s\n", "field", "known", "flagged", "mean m", "p50 m", "p90 m",
+		   "p99 m", "max m");
+	QuantSummary summaries[NUM_QUANT_FIELDS];
+	for (int f = 0; f < NUM_QUANT_FIELDS; f++) {
+		QuantSummary *summary = &summaries[f];
+		quantreduce(fleet.error[f], fleet.ratio[f], n, summary);
+		std::sort(fleet.error[f], fleet.error[f] + n);
+		printf("# %-8s %10lld %10lld", quantfields[f].name, summary->known, summary->flagged);
+		if (n > 0) printf(" %10.3g %10.3g %10.3g %10.3g %10.3g\n", summary->sum / n, percentile(fleet.error[f], n, 0.5),
+						  percentile(fleet.error[f], n, 0.9), percentile(fleet.error[f], n, 0.99), summary->max);
+		else printf("\n");
+	}
+	printf("# %-8s", "error/unc");
+	for (int b = 0; b < QUANT_BUCKETS - 1; b++) printf(" %5s4^%-2d", "<", b - 6);
+	printf(" %9s\n", ">=4^2");
+	for (int f = 0; f < NUM_QUANT_FIELDS; f++) {
+		printf("# %-8s", quantfields[f].name);
+		for (int b = 0; b < QUANT_BUCKETS; b++) printf(" %9lld", summaries[f].buckets[b]);
+		printf("\n");
+	}
+
+	for (int f = 0; f < NUM_QUANT_FIELDS; f++) {
+		free(fleet.error[f]);
+		free(fleet.ratio[f]);
+	}
+	free(fleet.names);
+	free(fleet.kind);
+	freelines(&file);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Thread scaling benchmark (-scaling): batch decoding and encoding (as -decode and -encode,
+// without the file), validating (as the server's validate request) and diffing a fleet (old
+// and new LCI strings of each AP decoded and compared) over a synthetic corpus held in memory,
+// at 1, 2, 4 ... threads, up to -threads=... Strong scaling codes the whole corpus (-scaling=...
+// records) whatever the number of threads, weak scaling gives each thread the same share (the
+// corpus over the most threads). Reports records/s, parallel efficiency (speedup / threads),
+// and the rate at which the text going in and out is streamed through memory.
+
+#define SCALING_REPS 3		// runs of each (median reported)
+#define SCALING_CHANGED 16	// in fleet diff, one AP in this many has a new LCI string
+
+enum scaling_stages { SCALING_DECODE, SCALING_ENCODE, SCALING_VALIDATE, SCALING_FLEETDIFF, NUM_SCALING_STAGES };
+
+const char *scaling_stage_names[NUM_SCALING_STAGES] = { "decode", "encode", "validate", "fleetdiff" };
+
+struct ScalingRun {
+	BatchChunk *lcis, *records, *changed;	// corpus: LCI strings, records, fleet's next LCI strings
+	int nchunks, stage;						// (chunks in this run)
+	const CodecProfile *profile;
+	const LciRecord *defaults;
+	std::atomic<int> next;					// next chunk to code
+	std::atomic<long long> bytes, differ;	// (text in and out, APs changed)
+};
+
+const char *scalingtoken (const char *line, char *str) {	// (LCI string of "lci=..." line)
+	snprintf(str, MAX_LINE, "%s", line);
+	char *token = nexttoken(&str);
+	if (token != NULL && _strnicmp(token, "lci=", 4) == 0) token += 4;
+	return (token != NULL) ? token : "";
+}
+
+void validatechunk (BatchChunk *chunk, const LciRecord *defaults) {
+	LciRecord rec;
+	char line[MAX_LINE], names[MAX_LINE];
+	const char *next = chunk->in.str;
+	chunk->out.len = 0;
+	for (int k = 0; k < chunk->nlines; k++, next += strlen(next) + 1) {
+		formatDiagnostics(names, sizeof(names), cachedDecode(scalingtoken(next, line), defaults, &rec));
+		appendtext(&chunk->out, "%s\n", names);
+	}
+}
+
+long long diffchunk (const BatchChunk *chunk, const BatchChunk *changed, const LciRecord *defaults) {
+	LciRecord rec, newrec;
+	char line[MAX_LINE], newline[MAX_LINE];
+	const char *next = chunk->in.str, *newnext = changed->in.str;
+	long long differ = 0;
+	for (int k = 0; k < chunk->nlines; k++, next += strlen(next) + 1, newnext += strlen(newnext) + 1) {
+		cachedDecode(scalingtoken(next, line), defaults, &rec);
+		cachedDecode(scalingtoken(newnext, newline), defaults, &newrec);
+		differ += (recorddiffers(&rec, &newrec) >= 0);
+	}
+	return differ;
+}
+
+void scalingworker (ScalingRun *run) {
+	applyprofile(run->profile);
+	long long bytes = 0, differ = 0;
+	for (int c; (c = run->next.fetch_add(1)) < run->nchunks; ) {
+		BatchChunk *chunk = (run->stage == SCALING_ENCODE) ? &run->records[c] : &run->lcis[c];
+		switch (run->stage) {
+			case SCALING_DECODE: batchchunk(chunk, run->defaults, 0); break;
+			case SCALING_ENCODE: batchchunk(chunk, run->defaults, 1); break;
+			case SCALING_VALIDATE: validatechunk(chunk, run->defaults); break;
+			default:
+				differ += diffchunk(chunk, &run->changed[c], run->defaults);
+				bytes += run->changed[c].in.len;
+				break;
+		}
+		bytes += chunk->in.len + ((run->stage == SCALING_FLEETDIFF) ? 0 : chunk->out.len);
+	}
+	run->bytes += bytes;
+	run->differ += differ;
+	freeColocatedBSSIDs();		// (this thread's copy)
+}
+
+double scalingtime (ScalingRun *run, int stage, int nchunks, int nworkers) {	// seconds (median)
+	double seconds[SCALING_REPS];
+	run->stage = stage;
+	run->nchunks = nchunks;
+	std::thread *workers = new std::thread[nworkers];
+	for (int r = -1; r < SCALING_REPS; r++) {	// (first run warms up output buffers)
+		run->next = 0;
+		run->bytes = run->differ = 0;
+		long long start = nanoclock();
+		for (int t = 0; t < nworkers; t++) workers[t] = std::thread(scalingworker, run);
+		for (int t = 0; t < nworkers; t++) workers[t].join();
+		if (r >= 0) seconds[r] = (nanoclock() - start) * 1e-9;
+	}
+	delete [] workers;
+	std::sort(seconds, seconds + SCALING_REPS);
+	return percentile(seconds, SCALING_REPS, 0.5);
+}
+
+double scalingline (ScalingRun *run, int stage, const char *scaling, int nworkers, double seconds, double *baserate) {
+	long long nrecords = (long long) run->nchunks * BATCH_LINES;
+	double rate = (seconds > 0) ? nrecords / seconds : 0.0;
+	if (nworkers == 1) *baserate = rate;
+	double speedup = (*baserate > 0) ? rate / *baserate : 0.0;
+	printf("# %-10s %-7s %7d %9lld %9.1f %12.0f %8.2f %9.1f%% %10.1f", scaling_stage_names[stage], scaling,
+		   nworkers, nrecords, seconds * 1e3, rate, speedup, 100.0 * speedup / nworkers,
+		   (seconds > 0) ? run->bytes.load() / seconds * 1e-6 : 0.0);
+	if (stage == SCALING_FLEETDIFF) printf("  (%lld changed)", run->differ.load());
+	printf("\n");
+	return rate;
+}
+
+void scalingappend (BatchChunk *chunk, const LciRecord *rec, int lciflag) {	// (as line of corpus)
+	char line[MAX_LINE];
+	if (lciflag) {
+		memcpy(line, "lci=", 4);
+		cachedEncode(rec, line + 4, sizeof(line) - 4);
+	}
+	else formatLciRecord(line, sizeof(line), rec);
+	appendbytes(&chunk->in, line, (int) strlen(line) + 1);
+	chunk->nlines++;
+}
+
+int nextworkers (int nworkers, int maxworkers) {	// 1, 2, 4 ... maxworkers (then past it)
+	if (nworkers == maxworkers) return maxworkers + 1;
+	return (nworkers * 2 < maxworkers) ? nworkers * 2 : maxworkers;
+}
+
+void scaling (void) {
+	int maxworkers = getnthreads();
+	int nchunks = (int)((scalingrecords + BATCH_LINES - 1) / BATCH_LINES);
+	if (nchunks < maxworkers) nchunks = maxworkers;
+	int perworker = nchunks / maxworkers;	// (chunks per thread, weak scaling)
+	LciRecord defaults, rec;
+	saveLciRecord(&defaults);
+	CodecProfile profile;
+	captureprofile(&profile);
+	int oldverboseflag = verboseflag, oldquietflag = quietflag;
+	verboseflag = 0;
+	quietflag = 1;
+	ScalingRun *run = new ScalingRun;
+	run->lcis = new BatchChunk[nchunks]();
+	run->records = new BatchChunk[nchunks]();
+	run->changed = new BatchChunk[nchunks]();
+	run->profile = &profile;
+	run->defaults = &defaults;
+	for (int c = 0; c < nchunks; c++) {		// make up corpus
+		run->lcis[c].firstline = run->records[c].firstline = run->changed[c].firstline = c * BATCH_LINES + 1;
+		for (int k = 0; k < BATCH_LINES; k++) {
+			unsigned long long seed = mix64((unsigned long long) c * BATCH_LINES + k + 1);
+			randomrecord(seed, &rec);
+			scalingappend(&run->records[c], &rec, 0);
+			scalingappend(&run->lcis[c], &rec, 1);
+			if (k % SCALING_CHANGED == 0) randomrecord(mix64(seed), &rec);	// (AP changed)
+			scalingappend(&run->changed[c], &rec, 1);
+		}
+	}
+	printf("# scaling: %lld records in memory (%d chunks of %d), 1 to %d thread%s, median of %d runs\n",
+		   (long long) nchunks * BATCH_LINES, nchunks, BATCH_LINES, maxworkers, (maxworkers > 1) ? "s" : "", SCALING_REPS);
+	printf("# %-10s %-7s %7s %9s %9s %12s %8s %10s %10s\n", "stage", "scaling", "threads", "records", "ms",
+		   "records/s", "speedup", "efficiency", "MB/s");
+	for (int stage = 0; stage < NUM_SCALING_STAGES; stage++) {
+		for (int weak = 0; weak < 2; weak++) {
+			double baserate = 0;
+			for (int nworkers = 1; nworkers <= maxworkers; nworkers = nextworkers(nworkers, maxworkers)) {
+				int n = weak ? perworker * nworkers : nchunks;
+				double seconds = scalingtime(run, stage, n, nworkers);
+				scalingline(run, stage, weak ? "weak" : "strong", nworkers, seconds, &baserate);
+			}
+		}
+	}
+	verboseflag = oldverboseflag;
+	quietflag = oldquietflag;
+	for (int c = 0; c < nchunks; c++) {
+		BatchChunk *chunks[3] = { &run->lcis[c], &run->records[c], &run->changed[c] };
+		for (int i = 0; i < 3; i++) {
+			free(chunks[i]->in.str);
+			free(chunks[i]->out.str);
+		}
+	}
+	delete [] run->lcis;
+	delete [] run->records;
+	delete [] run->changed;
+	delete run;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Load generator (-load=...): drives a server on this machine (-serve=... or -http=...) with
+// a mix of encode, decode, validate and patch requests (-loadmix=decode:4,encode:1 ..., by
+// weight) made from random records, over -threads=... connections for -loadtime=... seconds:
+//	-load=socket:path	binary protocol over Unix domain socket
+//	-load=shm:path		shared memory rings (attached through that socket)
+//	-load=http:port		HTTP/JSON on localhost (there is no patch over HTTP)
+// Closed loop (default): each connection sends its next request as soon as the last is
+// answered, so the rate is the most the server gives. Open loop (-loadrate=... requests/s):
+// requests are due at fixed intervals; a connection has one in flight, so when the server
+// falls behind they go out late, and latency is counted from when each was due, not when
+// it went out (so stalls are not hidden, "coordinated omission"). Closed loop over shared
+// memory keeps up to LOAD_BATCH requests in flight, topped up half at a time (published
+// together), so latency there includes waiting behind the rest. Latencies are kept in the
+// same log-linear histograms as the server metrics (within 12.5%).
+
+#define LOAD_CORPUS 1024	// requests of each kind made up beforehand
+#define LOAD_TIMEOUT 5		// (s) for any one response
+#define LOAD_SPIN 200000	// (ns) open loop: spin this long before request is due
+#define LOAD_BATCH 32		// shared memory closed loop: requests in flight
+
+#ifdef __linux__
+
+enum load_transports { LOAD_SOCKET, LOAD_SHM, LOAD_HTTP };
+
+struct LoadStats {		// (per connection, added up at the end)
+	long long latency[NUM_OPS][LATENCY_BUCKETS];
+	long long requests[NUM_OPS][NUM_STATUS];
+	long long latencysum[NUM_OPS], latencymax[NUM_OPS];		// (ns)
+	long long failed;	// (no response)
+	long long unsent;	// (open loop: due, but server too far behind to send them)
+};
+
+struct LoadRun {
+	int transport;
+	const char *path;
+	int port;
+	int weights[NUM_OPS], totalweight;
+	char *payloads[NUM_OPS][LOAD_CORPUS];
+	int lengths[NUM_OPS][LOAD_CORPUS];
+	double rate, seconds;	// (rate 0 => closed loop)
+	int nconns;
+	LoadStats *stats;		// (one per connection)
+	std::atomic<int> connected;
+};
+
+struct LoadConn {
+	int fd;
+	ShmClient *shm;
+	unsigned int nextid;
+	TextBuffer in;			// (HTTP response read so far)
+};
+
+
+int loadsend (int fd, const char *data, int nlen) {
+	while (nlen > 0) {
+		ssize_t n = send(fd, data, nlen, MSG_NOSIGNAL);
+		if (n <= 0) return 0;
+		data += n;
+		nlen -= (int) n;
+	}
+	return 1;
+}
+
+int loadrecv (int fd, char *data, int nlen) {
+	while (nlen > 0) {
+		ssize_t n = recv(fd, data, nlen, 0);
+		if (n <= 0) return 0;
+		data += n;
+		nlen -= (int) n;
+	}
+	return 1;
+}
+
+int loadconnect (const LoadRun *run, LoadConn *conn) {
+	memset(conn, 0, sizeof(LoadConn));
+	conn->fd = -1;
+	conn->nextid = 1;
+	if (run->transport == LOAD_SHM) return (conn->shm = shmconnect(run->path)) != NULL;
+	if (run->transport == LOAD_HTTP) {
+		struct sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		addr.sin_port = htons((unsigned short) run->port);
+		conn->fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (conn->fd < 0) return 0;
+		int one = 1;
+		setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		if (connect(conn->fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) return 0;
+	}
+	else {
+		struct sockaddr_un addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		if (strlen(run->path) >= sizeof(addr.sun_path)) return 0;
+		strcpy(addr.sun_path, run->path);
+		conn->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (conn->fd < 0 || connect(conn->fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) return 0;
+	}
+	struct timeval timeout = { LOAD_TIMEOUT, 0 };
+	setsockopt(conn->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	return 1;
+}
+
+void loaddisconnect (LoadConn *conn) {
+	if (conn->shm != NULL) shmdisconnect(conn->shm);
+	if (conn->fd >= 0) close(conn->fd);
+	free(conn->in.str);
+}
+
+// one request, waiting for its response --- returns 0 if there was none (else status)
+
+int loadhttp (LoadConn *conn, int op, const char *payload, int nlen, int *status) {
+	char header[256];
+	int hlen = snprintf(header, sizeof(header), "POST /%s HTTP/1.1\r\nHost: localhost\r\n"
+						"Content-Type: application/json\r\nContent-Length: %d\r\n\r\n", server_op_names[op], nlen);
+	if (! loadsend(conn->fd, header, hlen) || ! loadsend(conn->fd, payload, nlen)) return 0;
+	TextBuffer *in = &conn->in;
+	in->len = 0;
+	long blen = -1;
+	int code = 0;
+	for (;;) {
+		if (blen < 0) {
+			appendbytes(in, "", 1);		// (0 terminated while looking for end of header)
+			in->len--;
+			const char *end = strstr(in->str, "\r\n\r\n");
+			if (end != NULL) {
+				hlen = (int)(end - in->str) + 4;
+				const char *length = strstr(in->str, "Content-Length:");
+				if (sscanf_s(in->str, "HTTP/1.%*d %d", &code) < 1 || length == NULL || length > end) return 0;
+				blen = strtol(length + 15, NULL, 10);
+			}
+		}
+		if (blen >= 0 && in->len >= hlen + blen) break;
+		growtext(in, 4096);
+		ssize_t n = recv(conn->fd, in->str + in->len, in->cap - in->len - 1, 0);
+		if (n <= 0) return 0;
+		in->len += (int) n;
+	}
+	*status = (code == 200) ? STATUS_OK : (code == 404) ? STATUS_BAD_OP : STATUS_BAD_REQUEST;
+	return 1;
+}
+
+int loadcall (const LoadRun *run, LoadConn *conn, int op, const char *payload, int nlen, int *status) {
+	char out[MAX_FRAME];
+	int diag;
+	if (run->transport == LOAD_SHM) return shmcall(conn->shm, op, payload, nlen, out, SHM_PAYLOAD, status, &diag) >= 0;
+	if (run->transport == LOAD_HTTP) return loadhttp(conn, op, payload, nlen, status);
+	char frame[REQUEST_HEADER + MAX_LINE];
+	unsigned int id = conn->nextid++;
+	putle32(frame, REQUEST_HEADER - 4 + nlen);
+	putle32(frame + 4, id);
+	frame[8] = (char) op;
+	memcpy(frame + REQUEST_HEADER, payload, nlen);
+	if (! loadsend(conn->fd, frame, REQUEST_HEADER + nlen) || ! loadrecv(conn->fd, out, RESPONSE_HEADER)) return 0;
+	int rlen = (int) getle32(out) - (RESPONSE_HEADER - 4);
+	if (getle32(out + 4) != id || rlen < 0 || rlen > (int) sizeof(out)) return 0;
+	*status = (unsigned char) out[9];
+	return loadrecv(conn->fd, out, rlen);
+}
+
+void loadpick (const LoadRun *run, unsigned long long *state, int *op, int *r) {
+	int pick = (int)(nextrandom(state) % run->totalweight);
+	*op = 1;
+	while (pick >= run->weights[*op]) pick -= run->weights[(*op)++];
+	*r = (int)(nextrandom(state) % LOAD_CORPUS);
+}
+
+void loadrecord (LoadStats *stats, int op, int status, long long ns) {
+	stats->latency[op][latencybucket(ns)]++;
+	stats->latencysum[op] += ns;
+	if (ns > stats->latencymax[op]) stats->latencymax[op] = ns;
+	stats->requests[op][(status < NUM_STATUS) ? status : STATUS_BAD_REQUEST]++;
+}
+
+// shared memory closed loop: submit requests in batches, publishing each batch at once
+
+void loadbatch (const LoadRun *run, LoadConn *conn, LoadStats *stats, unsigned long long *state, long long end) {
+	struct {
+		unsigned int id;
+		int op;
+		long long sent;
+	} inflight[LOAD_BATCH];		// (in order sent, as responses come back)
+	char out[SHM_PAYLOAD];
+	unsigned int sent = 0, done = 0;
+	for (;;) {
+		long long now = nanoclock();
+		if (now < end && sent - done <= LOAD_BATCH / 2) {
+			while (sent - done < LOAD_BATCH) {
+				int op, r;
+				loadpick(run, state, &op, &r);
+				unsigned int id = shmsubmit(conn->shm, op, run->payloads[op][r], run->lengths[op][r]);
+				if (id == 0) {
+					stats->failed++;
+					end = 0;		// (just wait for those in flight)
+					break;
+				}
+				inflight[sent % LOAD_BATCH].id = id;
+				inflight[sent % LOAD_BATCH].op = op;
+				inflight[sent % LOAD_BATCH].sent = now;
+				sent++;
+			}
+			shmflush(conn->shm);
+		}
+		if (sent == done) break;
+		unsigned int id;
+		int status, diag;
+		if (shmpoll(conn->shm, &id, out, sizeof(out), &status, &diag, LOAD_TIMEOUT * 1000) < 0 ||
+			id != inflight[done % LOAD_BATCH].id) {
+			stats->failed += sent - done;
+			break;		// (connection is of no further use)
+		}
+		loadrecord(stats, inflight[done % LOAD_BATCH].op, status, nanoclock() - inflight[done % LOAD_BATCH].sent);
+		done++;
+	}
+}
+
+void loadworker (LoadRun *run, int t) {
+	LoadConn conn;
+	if (! loadconnect(run, &conn)) {
+		loaddisconnect(&conn);
+		return;
+	}
+	run->connected++;
+	LoadStats *stats = &run->stats[t];
+	unsigned long long state = mix64(t + 1);
+	double interval = (run->rate > 0) ? run->nconns / run->rate : 0;
+	long long start = nanoclock(), end = start + (long long)(run->seconds * 1e9);
+	long long k = 0;
+	if (interval == 0 && run->transport == LOAD_SHM) loadbatch(run, &conn, stats, &state, end);
+	else for (;; k++) {
+		long long due, now = nanoclock();	// (when request is to go out)
+		if (interval > 0) {
+			due = start + (long long)(interval * 1e9 * (k + (double) t / run->nconns));	// (connections staggered)
+			if (due >= end || now >= end) break;	// (if behind, the rest are not sent)
+			long long wait = due - nanoclock();		// (sleep, then spin the last bit: sleeps overshoot)
+			if (wait > LOAD_SPIN) std::this_thread::sleep_for(std::chrono::nanoseconds(wait - LOAD_SPIN));
+			while (nanoclock() < due) std::this_thread::yield();
+		}
+		else if ((due = now) >= end) break;
+		int op, r, status;
+		loadpick(run, &state, &op, &r);
+		if (! loadcall(run, &conn, op, run->payloads[op][r], run->lengths[op][r], &status)) {
+			stats->failed++;
+			break;		// (connection is of no further use)
+		}
+		loadrecord(stats, op, status, nanoclock() - due);
+	}
+	if (interval > 0) {
+		long long ndue = (long long) ceil(run->seconds / interval - (double) t / run->nconns);
+		if (ndue > k) stats->unsent = ndue - k;
+	}
+	loaddisconnect(&conn);
+	freeColocatedBSSIDs();		// (this thread's copy)
+}
+
+// make up requests: random records (as -roundtrip), as the transport wants them
+
+void loadpayload (LoadRun *run, int op, int r, const char *data, int nlen) {
+	char *payload = (char *) malloc(nlen + 1);
+	if (payload == NULL) exit(1);
+	memcpy(payload, data, nlen);
+	payload[nlen] = '\0';
+	run->payloads[op][r] = payload;
+	run->lengths[op][r] = nlen;
+}
+
+void loadcorpus (LoadRun *run) {
+	LciRecord rec, patch;
+	char lci[MAX_LINE], fields[MAX_LINE];
+	unsigned char packed[PACKED_RECORD_MAX];
+	TextBuffer json;
+	memset(&json, 0, sizeof(json));
+	for (int r = 0; r < LOAD_CORPUS; r++) {
+		randomrecord(mix64(r + 1), &rec);
+		cachedEncode(&rec, lci, sizeof(lci));
+		json.len = 0;
+		if (run->transport == LOAD_HTTP) {
+			appendtext(&json, "{");
+			jsonwriterecord(&json, &rec);
+			json.str[json.len - 1] = '}';	// (instead of last comma)
+			loadpayload(run, OP_ENCODE, r, json.str, json.len);
+			json.len = 0;
+			appendtext(&json, "\"%s\"", lci);
+			loadpayload(run, OP_DECODE, r, json.str, json.len);
+			loadpayload(run, OP_VALIDATE, r, json.str, json.len);
+			continue;
+		}
+		loadpayload(run, OP_ENCODE, r, (const char *) packed, packLciRecord(&rec, packed));
+		loadpayload(run, OP_DECODE, r, lci, (int) strlen(lci));
+		loadpayload(run, OP_VALIDATE, r, lci, (int) strlen(lci));
+		randomrecord(mix64(LOAD_CORPUS + r + 1), &patch);	// (AP moved)
+		char lat[32], lon[32], alt[32];
+		formatdouble(lat, sizeof(lat), patch.latitude);
+		formatdouble(lon, sizeof(lon), patch.longitude);
+		formatdouble(alt, sizeof(alt), patch.altitude);
+		int nlen = snprintf(fields, sizeof(fields), "%s%clat=%s lon=%s alt=%s", lci, 0, lat, lon, alt);
+		loadpayload(run, OP_PATCH, r, fields, nlen);
+	}
+	free(json.str);
+}
+
+// -loadmix=decode:4,encode:1 ... --- returns 0 if malformed
+
+int loadweights (LoadRun *run, const char *mix) {
+	memset(run->weights, 0, sizeof(run->weights));
+	if (mix == NULL) mix = "encode:1,decode:1,validate:1,patch:1";
+	char str[MAX_LINE];
+	snprintf(str, sizeof(str), "%s", mix);
+	for (char *name = strtok(str, ","); name != NULL; name = strtok(NULL, ",")) {
+		char *colon = strchr(name, ':');
+		int weight = 1, op;
+		if (colon != NULL) {
+			*colon = '\0';
+			if (sscanf_s(colon + 1, "%d", &weight) < 1 || weight < 0) return 0;
+		}
+		for (op = OP_ENCODE; op <= OP_PATCH; op++)
+			if (strcmp(name, server_op_names[op]) == 0) break;
+		if (op > OP_PATCH) return 0;
+		run->weights[op] = weight;
+	}
+	if (run->transport == LOAD_HTTP && run->weights[OP_PATCH] > 0) {
+		printf("WARNING: no patch over HTTP, left out of the mix\n");
+		run->weights[OP_PATCH] = 0;
+	}
+	run->totalweight = 0;
+	for (int op = 0; op < NUM_OPS; op++) run->totalweight += run->weights[op];
+	return run->totalweight > 0;
+}
+
+void loadline (const char *name, const long long *latency, long long sum, long long max, const long long *requests) {
+	static const double quantiles[] = { 0.5, 0.75, 0.9, 0.99, 0.999, 0.9999 };
+	long long count = 0;
+	for (int b = 0; b < LATENCY_BUCKETS; b++) count += latency[b];
+	if (count == 0) return;
+	printf("# %-9s %10lld %10lld %8lld %9.1f", name, count, requests[STATUS_OK], count - requests[STATUS_OK],
+		   sum * 1e-3 / count);
+	long long below = 0;
+	int b = 0;
+	for (int q = 0; q < (int)(sizeof(quantiles) / sizeof(quantiles[0])); q++) {
+		long long rank = (long long) ceil(quantiles[q] * count);
+		while (below + latency[b] < rank && b < LATENCY_BUCKETS - 1) below += latency[b++];
+		long long bound = latencybound(b);
+		printf(" %9.1f", ((bound < max) ? bound : max) * 1e-3);
+	}
+	printf(" %9.1f\n", max * 1e-3);
+}
+
+int loadgenerate (const char *target) {		// returns number of requests failed
+	LoadRun *run = new LoadRun;
+	memset(run->payloads, 0, sizeof(run->payloads));
+	run->path = NULL;
+	run->port = 0;
+	if (strncmp(target, "socket:", 7) == 0) {
+		run->transport = LOAD_SOCKET;
+		run->path = target + 7;
+	}
+	else if (strncmp(target, "shm:", 4) == 0) {
+		run->transport = LOAD_SHM;
+		run->path = target + 4;
+	}
+	else if (strncmp(target, "http:", 5) == 0 && sscanf_s(target + 5, "%d", &run->port) == 1) run->transport = LOAD_HTTP;
+	else {
+		printf("ERROR: -load=%s (want socket:path, shm:path or http:port)\n", target);
+		delete run;
+		return 1;
+	}
+	if (! loadweights(run, loadmix)) {
+		printf("ERROR: -loadmix=%s (want encode, decode, validate, patch with weights, e.g. decode:4,encode:1)\n", loadmix);
+		delete run;
+		return 1;
+	}
+	int oldverboseflag = verboseflag, oldquietflag = quietflag;
+	verboseflag = 0;
+	quietflag = 1;
+	loadcorpus(run);
+	run->rate = loadrate;
+	run->seconds = loadtime;
+	run->nconns = getnthreads();
+	run->stats = (LoadStats *) calloc(run->nconns, sizeof(LoadStats));
+	if (run->stats == NULL) exit(1);
+	run->connected = 0;
+	std::thread *workers = new std::thread[run->nconns];
+	long long start = nanoclock();
+	for (int t = 0; t < run->nconns; t++) workers[t] = std::thread(loadworker, run, t);
+	for (int t = 0; t < run->nconns; t++) workers[t].join();
+	delete [] workers;
+	double seconds = (nanoclock() - start) * 1e-9;
+	verboseflag = oldverboseflag;
+	quietflag = oldquietflag;
+
+	LoadStats *total = (LoadStats *) calloc(1, sizeof(LoadStats));
+	if (total == NULL) exit(1);
+	for (int t = 0; t < run->nconns; t++) {
+		const LoadStats *stats = &run->stats[t];
+		for (int op = 0; op < NUM_OPS; op++) {
+			for (int b = 0; b < LATENCY_BUCKETS; b++) total->latency[op][b] += stats->latency[op][b];
+			for (int k = 0; k < NUM_STATUS; k++) total->requests[op][k] += stats->requests[op][k];
+			total->latencysum[op] += stats->latencysum[op];
+			if (stats->latencymax[op] > total->latencymax[op]) total->latencymax[op] = stats->latencymax[op];
+		}
+		total->failed += stats->failed;
+		total->unsent += stats->unsent;
+	}
+	long long count = 0, all[LATENCY_BUCKETS], allrequests[NUM_STATUS], allsum = 0, allmax = 0;
+	memset(all, 0, sizeof(all));
+	memset(allrequests, 0, sizeof(allrequests));
+	for (int op = 0; op < NUM_OPS; op++) {
+		for (int b = 0; b < LATENCY_BUCKETS; b++) all[b] += total->latency[op][b];
+		for (int k = 0; k < NUM_STATUS; k++) allrequests[k] += total->requests[op][k];
+		allsum += total->latencysum[op];
+		if (total->latencymax[op] > allmax) allmax = total->latencymax[op];
+	}
+	for (int k = 0; k < NUM_STATUS; k++) count += allrequests[k];
+	printf("# load: %s loop", (run->rate > 0) ? "open" : "closed");
+	if (run->rate > 0) printf(" at %lg requests/s", run->rate);
+	printf(", %d of %d connection%s to %s, %.1f s: %lld requests (%.0f/s), %lld failed", run->connected.load(),
+		   run->nconns, (run->nconns > 1) ? "s" : "", target, seconds, count, (seconds > 0) ? count / seconds : 0.0,
+		   total->failed);
+	if (run->rate > 0) printf(", %lld due but not sent", total->unsent);
+	printf("\n");
+	printf("# %-9s %10s %10s %8s %9s %9s %9s %9s %9s %9s %9s %9s  (us)\n", "op", "requests", "ok", "not ok",
+		   "mean", "p50", "p75", "p90", "p99", "p99.9", "p99.99", "max");
+	for (int op = OP_ENCODE; op <= OP_PATCH; op++)
+		loadline(server_op_names[op], total->latency[op], total->latencysum[op], total->latencymax[op], total->requests[op]);
+	loadline("all", all, allsum, allmax, allrequests);
+	int failed = (run->connected.load() < run->nconns) ? run->nconns - run->connected.load() : 0;
+	if (failed > 0) printf("ERROR: unable to connect to %s (%d connection%s)\n", target, failed, (failed > 1) ? "s" : "");
+	failed += (int) total->failed;
+	for (int op = 0; op < NUM_OPS; op++)
+		for (int r = 0; r < LOAD_CORPUS; r++) free(run->payloads[op][r]);
+	free(total);
+	free(run->stats);
+	delete run;
+	return failed;
+}
+
+#else
+
+int loadgenerate (const char *target) {
+	printf("ERROR: -load not supported on this platform (needs Linux)\n");
+	return 1;
+}
+
+#endif
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+
+void showusage(void) {
+	printf("-v\t\tFlip verbose mode %s\n", verboseflag ? "off":"on");
+	printf("-t\t\tFlip trace mode %s\n", traceflag ? "off":"on");
+	printf("-d\t\tFlip debug mode %s\n", debugflag ? "off":"on");
+	printf("-c\t\tFlip checking mode %s\n", checkflag ? "off":"on");
+	printf("\n");
+	printf("-lci=...\tDecode given LCI string\n");
+	printf("\n");
+	printf("To encode an LCI string use the following:\n");
+	printf("\n");
+	printf("-lat=...\tLatitude  (degrees)\n");
+	printf("-lon=...\tLongitude (degrees)\n");
+	printf("-alt=...\tAltitude  (%s)\n", altitude_type_string(Altitude_Type));
+	printf("\n");
+	printf("-latunc=...\tLatitude  uncertainty (degrees)\n");
+	printf("-lonunc=...\tLongitude uncertainty (degrees)\n");
+	printf("-altunc=...\tAltitude  uncertainty (%s)\n", altitude_type_string(Altitude_Type));
+	printf("\n");
+	printf("-smallest\tZero uncertainty means smallest (as opposed to unknown)\n"); 
+	printf("\n");
+	printf("-floor=...\tFloor number\n");
+	printf("-height=...\tHeight above floor (m)\n");
+	printf("-heightunc=...\tHeight above floor uncertainty (m)\n");
+	printf("\n");
+	printf("-BSSID=... \tMac Addresses of colocated BSSIDs (comma separated list)\n");
+	printf("\n");
+	printf("-datum=...\tCoordinate Datum   (default %d -> \"%s\")\n", datum, datum_string(datum));
+	printf("-altitude_type=\tAltitude Type Code (default %d -> \"%s\")\n",
+		   Altitude_Type, altitude_type_string(Altitude_Type));
+	printf("\n");
+	if (debugflag) { //	Shouldn't really fiddle with the following 
+		printf("-Retransmission_Allowed\t\tRetransmission allowed (default %d)\n", retransmission_allowed);
+		printf("-Retention_Expires_Present\tRetention Expires Present (default %d)\n", retention_expires_present);
+		printf("-expiration=...\t\t\tExpiration (default %d hours)\n", expiration);
+		printf("-STA_Location_Policy\t\tSTA Location Policy (default %d)\n", STA_location_policy);
+		printf("-movable=...\t\t\tExpected to move (default %d)\n",	expected_to_move); // ?
+		printf("\n");
+	}
+	printf("-sample\t\tShow example decoding / encoding\n");
+	printf("-stats\t\tReport time per stage, allocations and diagnostics at end of run\n");
+	printf("-bench\t\tTime codec kernels (-bench=... only those whose names contain ...)\n");
+	printf("-benchreps=...\tTimed repetitions of each benchmark (default %d)\n", benchreps);
+	printf("-benchjson=...\tFile to write benchmark results to (JSON)\n");
+	printf("-benchbaseline=...\tCompare benchmarks with earlier results (JSON), fail if slower\n");
+	printf("-benchthreshold=...\tSlowdown (%%) that counts as regression (default %lg)\n", benchthreshold);
+	printf("-benchcounters\tAlso count cycles, instructions, branch and cache misses (Linux perf)\n");
+	printf("-trace-out=...\tWrite spans of batch and server stages to file (Chrome trace event JSON)\n");
+	printf("-golden\t\tCheck codec bit for bit against golden corpus, then benchmark it (as -bench)\n");
+	printf("-alloccheck\tCheck decoding and encoding records does not allocate (-alloccheck=... records, default %lld)\n", alloccount);
+	printf("-roundtrip\tCheck encode -> decode -> encode over all field values (-roundtrip=... random cases per sweep, default %lld)\n", roundtripcount);
+	printf("\n");
+	printf("-quantization=...\tReport quantization error against claimed uncertainty for LCI strings or records in file\n");
+	printf("-scaling\tTime batch decode, encode, validate and fleet diff at 1 to -threads=... threads (-scaling=... records, default %lld)\n", scalingrecords);
+	printf("-neighbors=...\tNeighbor reports (nr=...) for each AP in fleet file (lines of BSSID lci=...)\n");
+	printf("-nearest=...\tNumber of neighbors reported for each AP (default %d)\n", nearestk);
+	printf("-floorheight=...\tSeparation of floors (default %lg m)\n", floorheight);
+	printf("-spatialindex=...\tBuild spatial index file from -fleet=... file, or query it with -radius=... or -bbox=...\n");
+	printf("-radius=...\tFind APs within lat,lon,meters (optionally also floor1,floor2), nearest first\n");
+	printf("-bbox=...\tFind APs in lat1,lon1,lat2,lon2 (optionally also floor1,floor2)\n");
+	printf("-bssidindex=...\tBuild BSSID index file (own and colocated BSSIDs) from -fleet=... file, or query it with -lookup=...\n");
+	printf("-lookup=...\tFind LCI of AP that each BSSID (comma separated) belongs to\n");
+	printf("-mortonsort=...\tSort lines (LCI strings or records, fleet file lines) by Morton key of location\n");
+	printf("-threads=...\tNumber of worker threads (default one per hardware thread)\n");
+	printf("\n");
+	printf("-decode=...\tDecode each LCI string in file, printing records as name=value fields\n");
+	printf("-encode=...\tEncode each record (name=value fields) in file, printing lci=...\n");
+	printf("-cache=...\tMemory for encode/decode cache (default %d MB, 0 => no cache)\n", cachemb);
+	printf("-persist=...\tFile holding persistent decode cache (kept across runs)\n");
+	printf("-persistmb=...\tSize of persistent decode cache file when created (default %d MB)\n", persistmb);
+	printf("\n");
+	printf("-serve=...\tServe encode/decode/validate/patch requests on Unix domain socket\n");
+	printf("-http=...\tServe POST /encode, /decode, /validate (JSON), GET /metrics on localhost port\n");
+	printf("-reactors=...\tThreads watching server connections (default %d)\n", nreactors);
+	printf("-load=...\tDrive server with requests: socket:path, shm:path or http:port (one connection per -threads=...)\n");
+	printf("-loadmix=...\tRequests sent, by weight (default encode:1,decode:1,validate:1,patch:1)\n");
+	printf("-loadrate=...\tRequests/s due at fixed intervals (open loop; default as fast as answered)\n");
+	printf("-loadtime=...\tSeconds to run load for (default %lg)\n", loadtime);
+	printf("-connect=...\tHave server on Unix domain socket do -decode/-encode work (shared memory)\n");
+	printf("-profile=...\tFile of settings for server (name=value, reread on SIGHUP)\n");
+	printf("-fleet=...\tFleet file for server to look up APs in (reread on SIGHUP)\n");
+	printf("-android=...\tSettings Android will not use: off, warn or reject (default %s)\n",
+		   android_policy_names[androidpolicy]);
+	printf("\n");
+	printf("-?\t\tPrint this command line argument summary\n");
+	printf("-version=...\t%s\n", version);
+	fflush(stdout);
+	exit(1);
+}
+
+int commandline(int argc, const char *argv[]) {
+	int firstarg = 1;
+	while (firstarg < argc && *argv[firstarg] == '-') {
+		const char *arg = argv[firstarg];
+		if (strcmp(arg, "-v") == 0) verboseflag = !verboseflag;
+		else if (strcmp(arg, "-t") == 0) traceflag = !traceflag;
+		else if (strcmp(arg, "-d") == 0) debugflag = !debugflag;
+		else if (strcmp(arg, "-c") == 0) checkflag = !checkflag;
+		else if (strcmp(arg, "-smallest") == 0) smallestflag = !smallestflag;
+		else if (strcmp(arg, "-sample") == 0) sampleflag = !sampleflag;
+		else if (strcmp(arg, "-stats") == 0) statsflag = 1;
+		else if (strcmp(arg, "-bench") == 0) benchflag = 1;
+		else if (strncmp(arg, "-bench=", 7) == 0) {
+			benchflag = 1;
+			benchfilter = arg + 7;
+		}
+		else if (strncmp(arg, "-benchreps=", 11) == 0) {
+			if (sscanf_s(arg + 11, "%d", &benchreps) < 1) printf("ERROR: %s\n", arg);
+		}
+		else if (strncmp(arg, "-benchjson=", 11) == 0) benchjson = arg + 11;
+		else if (strncmp(arg, "-benchbaseline=", 15) == 0) benchbaseline = arg + 15;
+		else if (strcmp(arg, "-benchcounters") == 0) benchcountersflag = 1;
+		else if (strncmp(arg, "-trace-out=", 11) == 0) tracefile = arg + 11;
+		else if (strcmp(arg, "-roundtrip") == 0) roundtripflag = 1;
+		else if (strcmp(arg, "-golden") == 0) goldenflag = 1;
+		else if (strcmp(arg, "-alloccheck") == 0) allocflag = 1;
+		else if (strncmp(arg, "-alloccheck=", 12) == 0) {
+			allocflag = 1;
+			if (sscanf_s(arg + 12, "%lld", &alloccount) < 1) printf("ERROR: %s\n", arg);
+		}
+		else if (strncmp(arg, "-roundtrip=", 11) == 0) {
+			roundtripflag = 1;
+			if (sscanf_s(arg + 11, "%lld", &roundtripcount) < 1) printf("ERROR: %s\n", arg);
+		}
+		else if (strncmp(arg, "-benchthreshold=", 16) == 0) {
+			if (sscanf_s(arg + 16, "%lg", &benchthreshold) < 1) printf("ERROR: %s\n", arg);
+		}
+		else if (strncmp(arg, "-neighbors=", 11) == 0) neighborfile = arg + 11;
+		else if (strncmp(arg, "-quantization=", 14) == 0) quantfile = arg + 14;
+		else if (strncmp(arg, "-spatialindex=", 14) == 0) spatialfile = arg + 14;
+		else if (strncmp(arg, "-radius=", 8) == 0) radiusquery = arg + 8;
+		else if (strncmp(arg, "-bbox=", 6) == 0) bboxquery = arg + 6;
+		else if (strncmp(arg, "-mortonsort=", 12) == 0) mortonfile = arg + 12;
+		else if (strncmp(arg, "-bssidindex=", 12) == 0) bssidfile = arg + 12;
+		else if (strncmp(arg, "-lookup=", 8) == 0) lookupquery = arg + 8;
+		else if (strcmp(arg, "-scaling") == 0) scalingflag = 1;
+		else if (strncmp(arg, "-load=", 6) == 0) loadtarget = arg + 6;
+		else if (strncmp(arg, "-loadmix=", 9) == 0) loadmix = arg + 9;
+		else if (strncmp(arg, "-loadrate=", 10) == 0) {
+			if (sscanf_s(arg + 10, "%lg", &loadrate) < 1) printf("ERROR: %s\n", arg);
+		}
+		else if (strncmp(arg, "-loadtime=", 10) == 0) {
+			if (sscanf_s(arg + 10, "%lg", &loadtime) < 1) printf("ERROR: %s\n", arg);
+		}
+		else if (strncmp(arg, "-scaling=", 9) == 0) {
+			scalingflag = 1;
+			if (sscanf_s(arg + 9, "%lld", &scalingrecords) < 1) printf("ERROR: %s\n", arg);
+		}
+		else if (strncmp(arg, "-nearest=", 9) == 0) {
+			if (sscanf_s(arg + 9, "%d", &nearestk) < 1) printf("ERROR: %s\n", arg);
+		}
+		else if (strncmp(arg, "-floorheight=", 13) == 0) {	// in meters
+			if (sscanf_s(arg + 13, "%lg", &floorheight) < 1) printf("ERROR: %s\n", arg);
+		}
+		else if (strncmp(arg, "-decode=", 8) == 0) decodefile = arg + 8;
+		else if (strncmp(arg, "-encode=", 8) == 0) encodefile = arg + 8;
+		else if (strncmp(arg, "-cache=", 7) == 0) {	// in MB
+			if (sscanf_s(arg + 7, "%d", &cachemb) < 1) printf("ERROR: %s\n", arg);
+		}
+		else if (strncmp(arg, "-persist=", 9) == 0) persistfile = arg + 9;
+		else if (strncmp(arg, "-persistmb=", 11) == 0) {	// in MB
+			if (sscanf_s(arg + 11, "%d", &persistmb) < 1) printf("ERROR: %s\n", arg);
+		}
+		else if (strncmp(arg, "-serve=", 7) == 0) servepath = arg + 7;
+		else if (strncmp(arg, "-connect=", 9) == 0) connectpath = arg + 9;
+		else if (strncmp(arg, "-profile=", 9) == 0) profilefile = arg + 9;
+		else if (strncmp(arg, "-fleet=", 7) == 0) fleetfile = arg + 7;
+		else if (strncmp(arg, "-android=", 9) == 0) {
+			int k = 0;
+			while (k < NUM_ANDROID_POLICIES && strcmp(arg + 9, android_policy_names[k]) != 0) k++;
+			if (k < NUM_ANDROID_POLICIES) androidpolicy = k;
+			else printf("ERROR: %s (use off, warn or reject)\n", arg);
+		}
+		else if (strncmp(arg, "-http=", 6) == 0) {
+			if (sscanf_s(arg + 6, "%d", &httpport) < 1 || httpport <= 0 || httpport > 65535)
+			{
+				printf("ERROR: bad port %s\n", arg);
+				httpport = 0;
+			}
+		}
+		else if (strncmp(arg, "-threads=", 9) == 0) {
+			if (sscanf_s(arg + 9, "%d", &nthreads) < 1) printf("ERROR: %s\n", arg);
+		}
+		else if (strncmp(arg, "-reactors=", 10) == 0) {
+			if (sscanf_s(arg + 10, "%d", &nreactors) < 1 || nreactors < 1) {
+				printf("ERROR: %s\n", arg);
+				nreactors = 1;
+			}
+		}
+		else if (_strnicmp(arg, "-lci=", 5) == 0)		// string to decode (uc or lc)
+			lcistring = arg + 5;
+//		parameters for construction of LCI subelement 
+		else if (strncmp(arg, "-lat=", 5) == 0) {	// in degrees
+			if (sscanf_s(arg + 5, "%lg", &latitude) < 1) printf("ERROR: %s\n", arg);
+		}
+		else if (strncmp(arg, "-latitude=", 10) == 0) {
+			if (sscanf_s(arg + 10, "%lg", &latitude) < 1) printf("ERROR: %s\n", arg);
+		}
+		else if (strncmp(arg, "-lon=", 5) == 0) {	// in degrees
+			if (sscanf_s(arg + 5, "%lg", &longitude) < 1) printf("ERROR: %s\n", arg);
+		}
+		else if (strncmp(arg, "-longitude=", 11) == 0) {
+			if (sscanf_s(arg + 11, "%lg", &longitude) < 1) printf("ERROR: %s\n", arg);
+		}
+		else if (strncmp(arg, "-alt=", 5) == 0) {	// in meters
+			if (sscanf_s(arg + 5, "%lg", &altitude) < 1) printf("ERROR: %s\n", arg);
+		}
+		else if (strncmp(arg, "-altitude=", 10) == 0) {
+			if (sscanf_s(arg + 10, "%lg", &altitude) < 1) printf("ERROR: %s\n", arg);
+		}
+		else if (strncmp(arg, "-latunc=", 8) == 0) {	// in degrees
+			if (sscanf_s(arg + 8, "%lg", &latitude_uncertainty) < 1) printf("ERROR: %s\n", arg);
+		}
+		else if (strncmp(arg, "-lonunc=", 8) == 0) {	// in degrees
+			if (sscanf_s(arg + 8, "%lg", &longitude_uncertainty) < 1) printf("ERROR: %s\n", arg);
+		}
+		else if (strncmp(arg, "-altunc=", 8) == 0) {	// in meters
+			if (sscanf_s(arg + 8, "%lg", &altitude_uncertainty) < 1) printf("ERROR: %s\n", arg);
+		}
+//		parameters for construction of Z subelement 
+		else if (strncmp(arg, "-floor=", 7) == 0) {	// need not be integer
+			if (sscanf_s(arg + 7, "%lg", &sta_floor) < 1) printf("ERROR: %s\n", arg);
+		}
+		else if (strncmp(arg, "-height=", 8) == 0) { 
+			if (sscanf_s(arg + 8, "%lg", &sta_height_above_floor) < 1) printf("ERROR: %s\n", arg);
 		}
 		else if (strncmp(arg, "-heightunc=", 11) == 0) {	// in meters
 			if (sscanf_s(arg + 11, "%lg", &sta_height_above_floor_uncertainty) < 1) printf("ERROR: %s\n", arg);
@@ -1213,33 +8795,98 @@ int commandline(int argc, const char *argv[]) {
 
 ///////////////////////////////////////////////////////////////////////////////////////////////
 
-void freeColocatedBSSIDs () {
-	for (int k = 0; k < bssid_index; k++) {
-		if (BSSIDS[k] == NULL) continue;
-		free((void *) BSSIDS[k]);
-		BSSIDS[k] = NULL;
-	}
-	free(BSSIDS);
-	BSSIDS = NULL;
-}
-
 void initialize_arrays (void) {
-	BSSIDS = (char const **) malloc((max_bssids+1) * sizeof(char *));
-	if (BSSIDS == NULL) exit(1);
-//	for (int k = 0; k <= MAX_BSSID; k++) BSSIDS[k] = NULL;	// or...
-	memset(BSSIDS, 0, (max_bssids+1) * sizeof(char *));
+	reserveBSSIDs(0);
 }
 
 int main(int argc, const char *argv[]) {
 	int firstarg = 1;
+	int status = 0;
 
 //	testbinarydot(20);	return 0;	// testing
 	initialize_arrays();
 	firstarg = commandline(argc, argv);
+	if (statsflag && ! benchflag && ! roundtripflag && ! goldenflag && ! allocflag && ! scalingflag && loadtarget == NULL && spatialfile == NULL && bssidfile == NULL && mortonfile == NULL && servepath == NULL && httpport == 0) startstats();
+	if (tracefile != NULL) starttrace();
+
+//	Generate neighbor reports for a fleet of APs ?
+	if (neighborfile != NULL) {
+		neighborreports(neighborfile);
+	}
+
+//	Time codec kernels ?
+	else if (benchflag) {
+		if (runbenchmarks() > 0) status = 1;
+	}
+
+//	Check codec against golden corpus, and time it ?
+	else if (goldenflag) {
+		if (rungolden() > 0) status = 1;
+		else {
+			if (benchfilter == NULL) benchfilter = "golden";
+			if (runbenchmarks() > 0) status = 1;
+		}
+	}
+
+//	Check encoding and decoding round trip ?
+	else if (roundtripflag) {
+		if (roundtrip() > 0) status = 1;
+	}
+
+//	Check decoding and encoding do not allocate ?
+	else if (allocflag) {
+		if (alloccheck() > 0) status = 1;
+	}
+
+//	Time batch modes at 1 to -threads=... threads ?
+	else if (scalingflag) {
+		scaling();
+	}
+
+//	Report quantization error of LCI strings or records ?
+	else if (quantfile != NULL) {
+		quantization(quantfile);
+	}
+
+//	Build or query spatial index of fleet ?
+	else if (spatialfile != NULL) {
+		if (spatialindex(spatialfile, fleetfile) > 0) status = 1;
+	}
+
+//	Build or query BSSID index of fleet ?
+	else if (bssidfile != NULL) {
+		if (bssidindex(bssidfile, fleetfile) > 0) status = 1;
+	}
+
+//	Sort file by location ?
+	else if (mortonfile != NULL) {
+		mortonsort(mortonfile);
+	}
+
+//	Drive server with requests ?
+	else if (loadtarget != NULL) {
+		if (loadgenerate(loadtarget) > 0) status = 1;
+	}
+
+//	Run as server ?
+	else if (servepath != NULL || httpport > 0) {
+		serve(servepath, httpport);
+	}
+
+//	Decode or encode a file of LCI strings or records ?
+	else if (decodefile != NULL) {
+		if (connectpath == NULL || connectserver(connectpath)) batchcodec(decodefile, 0);
+		disconnectserver();
+	}
+	else if (encodefile != NULL) {
+		if (connectpath == NULL || connectserver(connectpath)) batchcodec(encodefile, 1);
+		disconnectserver();
+	}
 
 //	Is LCI string given on command line ?
-	if (lcistring != NULL) {	
+	else if (lcistring != NULL) {	
 		decodeLCIstring(lcistring);
+		STATS_RECORD(diagnostics);
 		if (checkflag) {
 			printf("\n");
 			char *str = encodeLCIstring();	
@@ -1254,6 +8901,7 @@ int main(int argc, const char *argv[]) {
 		  bssid_index > 0 ) { // is some LCI information given on command line?
 		if (bssid_index > 0) showColocatedBSSIDs();
 		char *str = encodeLCIstring();	// use LCI parameters set from command line
+		STATS_RECORD(diagnostics);
 		printf("lci=%s\n", str);
 		if (checkflag) {	// check by decoding again ?
 			printf("\n");
@@ -1266,8 +8914,10 @@ int main(int argc, const char *argv[]) {
 //		do_US_MTV();	// alternate example
 	}
 
+	showstats();
+	writetrace();
 	freeColocatedBSSIDs();
-	return 0;
+	return status;
 }
 
 ///////////////////////////////////////////////////////////////////////////////